@@ -0,0 +1,276 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "bench.h"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+static int open_syscall_tracepoint()
+{
+    static const char* ID_PATHS[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+
+    for (const char* path : ID_PATHS)
+    {
+        std::ifstream id_file(path);
+        uint64_t id = 0;
+        if (!(id_file >> id))
+        {
+            continue;
+        }
+
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.config = id;
+        attr.exclude_kernel = 0;
+        int fd = static_cast<int>(
+            syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fd >= 0)
+        {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+syscall_counter::syscall_counter()
+{
+    perf_fd = open_syscall_tracepoint();
+    proc_io = perf_fd < 0 && access("/proc/thread-self/io", R_OK) == 0;
+
+    // Sampling the counter is itself a syscall or two; measure it so it can
+    // be subtracted from each interval.
+    const uint64_t first = read();
+    overhead = read() - first;
+}
+
+syscall_counter::~syscall_counter()
+{
+    if (perf_fd >= 0)
+    {
+        close(perf_fd);
+    }
+}
+
+uint64_t syscall_counter::read_proc_io() const
+{
+    int fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    char buffer[512];
+    ssize_t size = ::read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (size <= 0)
+    {
+        return 0;
+    }
+    buffer[size] = '\0';
+
+    uint64_t total = 0;
+    for (const char* key : {"syscr:", "syscw:"})
+    {
+        const char* field = strstr(buffer, key);
+        if (field != nullptr)
+        {
+            total += strtoull(field + strlen(key), nullptr, 10);
+        }
+    }
+    return total;
+}
+
+uint64_t syscall_counter::read() const
+{
+    if (perf_fd >= 0)
+    {
+        uint64_t count = 0;
+        if (::read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        {
+            return 0;
+        }
+        return count;
+    }
+
+    return proc_io ? read_proc_io() : 0;
+}
+
+uint64_t syscall_counter::elapsed(uint64_t before, uint64_t after) const
+{
+    const uint64_t count = after - before;
+    return count > overhead ? count - overhead : 0;
+}
+
+const char* syscall_counter::source() const
+{
+    if (perf_fd >= 0)
+    {
+        return "perf";
+    }
+    return proc_io ? "proc_io" : "none";
+}
+
+uint64_t bench_percentile(std::vector<uint64_t>& samples, double percentile)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t index = static_cast<size_t>(
+        std::ceil(percentile / 100.0 * samples.size()));
+    index = index == 0 ? 0 : index - 1;
+    return samples[std::min(index, samples.size() - 1)];
+}
+
+void bench_write_json(
+    FILE* out,
+    const std::vector<bench_result>& results,
+    const char* syscall_source)
+{
+    fprintf(out, "{\"syscall_source\":\"%s\",\"benchmarks\":[\n", syscall_source);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result& result = results[i];
+        fprintf(
+            out,
+            "{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+            "\"allocs_per_op\":%.3f,\"syscalls_per_op\":%.3f}%s\n",
+            result.name.c_str(),
+            static_cast<unsigned long long>(result.iterations),
+            result.ns_per_op,
+            result.allocs_per_op,
+            result.syscalls_per_op,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+static bool json_string(
+    const std::string& line,
+    const char* key,
+    std::string& value)
+{
+    const std::string needle = std::string("\"") + key + "\":\"";
+    const size_t start = line.find(needle);
+    if (start == std::string::npos)
+    {
+        return false;
+    }
+    const size_t end = line.find('"', start + needle.size());
+    if (end == std::string::npos)
+    {
+        return false;
+    }
+    value = line.substr(start + needle.size(), end - start - needle.size());
+    return true;
+}
+
+static double json_number(const std::string& line, const char* key)
+{
+    const std::string needle = std::string("\"") + key + "\":";
+    const size_t start = line.find(needle);
+    if (start == std::string::npos)
+    {
+        return 0;
+    }
+    return strtod(line.c_str() + start + needle.size(), nullptr);
+}
+
+bool bench_load_baseline(
+    const std::string& path,
+    std::map<std::string, bench_result>& baseline)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        bench_result result;
+        if (!json_string(line, "name", result.name))
+        {
+            continue;
+        }
+        result.iterations =
+            static_cast<uint64_t>(json_number(line, "iterations"));
+        result.ns_per_op = json_number(line, "ns_per_op");
+        result.allocs_per_op = json_number(line, "allocs_per_op");
+        result.syscalls_per_op = json_number(line, "syscalls_per_op");
+        baseline[result.name] = result;
+    }
+    return true;
+}
+
+int bench_compare(
+    FILE* out,
+    const std::vector<bench_result>& results,
+    const std::map<std::string, bench_result>& baseline,
+    double threshold_percent)
+{
+    int regressions = 0;
+    fprintf(
+        out,
+        "%-40s %12s %12s %8s %14s %16s\n",
+        "benchmark",
+        "base ns/op",
+        "ns/op",
+        "delta",
+        "allocs/op",
+        "syscalls/op");
+    for (const bench_result& result : results)
+    {
+        auto base = baseline.find(result.name);
+        if (base == baseline.end())
+        {
+            fprintf(out, "%-40s %12s %12.1f\n", result.name.c_str(), "-", result.ns_per_op);
+            continue;
+        }
+
+        const double delta = base->second.ns_per_op > 0
+                                 ? 100.0 *
+                                       (result.ns_per_op - base->second.ns_per_op) /
+                                       base->second.ns_per_op
+                                 : 0;
+        // Fractional increases are amortized growth, not a new allocation
+        // or syscall on every call
+        const bool slower = delta > threshold_percent;
+        const bool more_allocs =
+            result.allocs_per_op >= base->second.allocs_per_op + 0.5;
+        const bool more_syscalls =
+            result.syscalls_per_op >= base->second.syscalls_per_op + 0.5;
+        char allocs[32];
+        char syscalls[32];
+        snprintf(allocs, sizeof(allocs), "%.1f->%.1f", base->second.allocs_per_op, result.allocs_per_op);
+        snprintf(syscalls, sizeof(syscalls), "%.1f->%.1f", base->second.syscalls_per_op, result.syscalls_per_op);
+        fprintf(
+            out,
+            "%-40s %12.1f %12.1f %+7.1f%% %14s %16s%s\n",
+            result.name.c_str(),
+            base->second.ns_per_op,
+            result.ns_per_op,
+            delta,
+            allocs,
+            syscalls,
+            slower || more_allocs || more_syscalls ? "  REGRESSION" : "");
+        if (slower || more_allocs || more_syscalls)
+        {
+            regressions++;
+        }
+    }
+    return regressions;
+}
@@ -0,0 +1,135 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "alloc_tracking.h"
+
+//
+// Counts system calls made by the calling thread. Uses the
+// raw_syscalls:sys_enter tracepoint when perf events allow it, and falls back
+// to the read and write class counters of /proc/thread-self/io otherwise.
+//
+class syscall_counter
+{
+  public:
+    syscall_counter();
+    ~syscall_counter();
+
+    syscall_counter(const syscall_counter&) = delete;
+    syscall_counter& operator=(const syscall_counter&) = delete;
+
+    uint64_t read() const;
+
+    // Syscalls between two read()s, excluding those made by read() itself.
+    uint64_t elapsed(uint64_t before, uint64_t after) const;
+
+    // "perf", "proc_io" or "none", reported alongside the counts.
+    const char* source() const;
+
+  private:
+    uint64_t read_proc_io() const;
+
+    int perf_fd = -1;
+    bool proc_io = false;
+    uint64_t overhead = 0;
+};
+
+struct bench_result
+{
+    std::string name;
+    uint64_t iterations = 0;
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+    double syscalls_per_op = 0;
+};
+
+//
+// Runs 'op' in batches, doubling the batch size until one batch takes at
+// least 'min_time', and reports the per-operation cost of that batch.
+//
+template <typename op_t>
+bench_result bench_run(
+    const std::string& name,
+    const syscall_counter& syscalls,
+    std::chrono::milliseconds min_time,
+    op_t&& op)
+{
+    // Warm up caches and lazily initialized state
+    op();
+
+    bench_result result;
+    result.name = name;
+    for (uint64_t batch = 1;; batch *= 2)
+    {
+        // Allocations are counted on this thread only, leaving out the
+        // library's background threads and the syscall counter's own
+        const uint64_t syscalls_before = syscalls.read();
+        allocation_tracking_start();
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++)
+        {
+            op();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const allocation_stats allocs = allocation_tracking_stop();
+        const uint64_t syscalls_after = syscalls.read();
+
+        if (elapsed >= min_time || batch >= (1ull << 32))
+        {
+            result.iterations = batch;
+            result.ns_per_op =
+                static_cast<double>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count()) /
+                batch;
+            result.allocs_per_op =
+                static_cast<double>(allocs.count) / batch;
+            result.syscalls_per_op =
+                static_cast<double>(
+                    syscalls.elapsed(syscalls_before, syscalls_after)) /
+                batch;
+            return result;
+        }
+    }
+}
+
+//
+// Returns the 'percentile' (0-100) of 'samples', sorting them in place.
+//
+uint64_t bench_percentile(std::vector<uint64_t>& samples, double percentile);
+
+//
+// Writes results as a JSON document with one benchmark per line, the format
+// bench_load_baseline reads back.
+//
+void bench_write_json(
+    FILE* out,
+    const std::vector<bench_result>& results,
+    const char* syscall_source);
+
+bool bench_load_baseline(
+    const std::string& path,
+    std::map<std::string, bench_result>& baseline);
+
+//
+// Prints how 'results' moved against 'baseline' and returns the number of
+// regressions: ns/op worse by more than 'threshold_percent', or more
+// allocations or syscalls per op.
+//
+int bench_compare(
+    FILE* out,
+    const std::vector<bench_result>& results,
+    const std::map<std::string, bench_result>& baseline,
+    double threshold_percent);
+
+#endif
@@ -0,0 +1,479 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Multi-process local cache benchmark. Forks M processes of N threads each
+// that share one cache directory and mix local_cache_get and local_cache_add
+// calls, the way many attestation processes on one host do, so that flock
+// contention between processes shows up:
+//
+//   ./cache_contention --processes 8 --threads 4 --read-ratio 0.95
+//                      --entry-sizes 1024,16384 --keys 64
+//
+// Reports ops/s, per-operation latency percentiles and lock wait statistics
+// as JSON.
+//
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "local_cache.h"
+
+namespace
+{
+struct options
+{
+    unsigned processes = 4;
+    unsigned threads = 4;
+    std::chrono::milliseconds duration{5000};
+    double read_ratio = 0.9;
+    std::vector<size_t> entry_sizes = {4096};
+    unsigned keys = 64;
+    std::string output;
+    uint64_t seed = 1;
+};
+
+options config;
+
+constexpr size_t LOCK_COUNT = static_cast<size_t>(local_cache_lock::count);
+const char* LOCK_NAMES[LOCK_COUNT] = {
+    "directory",
+    "file_shared",
+    "file_exclusive",
+    "fill"};
+
+// What each child sends back to the parent, followed by the latency samples
+struct child_summary
+{
+    uint64_t get_count;
+    uint64_t add_count;
+    uint64_t errors;
+    local_cache_lock_stats locks[LOCK_COUNT];
+};
+
+std::string key_name(unsigned key)
+{
+    return "contention/" + std::to_string(key);
+}
+
+size_t entry_size(unsigned key)
+{
+    return config.entry_sizes[key % config.entry_sizes.size()];
+}
+
+bool write_all(int fd, const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool read_all(int fd, void* data, size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        bytes += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+//
+// Body of one child process. Waits for the parent to close 'start_fd', runs
+// the workload and writes a child_summary plus the get and add latencies to
+// 'result_fd'.
+//
+int run_child(unsigned index, int start_fd, int result_fd)
+{
+    char ignored;
+    while (read(start_fd, &ignored, 1) < 0 && errno == EINTR)
+    {
+    }
+
+    // Leave out the locks the parent took while filling the cache
+    local_cache_lock_stats inherited[LOCK_COUNT];
+    for (size_t lock = 0; lock < LOCK_COUNT; lock++)
+    {
+        inherited[lock] =
+            local_cache_get_lock_stats(static_cast<local_cache_lock>(lock));
+    }
+
+    std::atomic<bool> stop(false);
+    std::vector<std::vector<uint64_t>> get_latencies(config.threads);
+    std::vector<std::vector<uint64_t>> add_latencies(config.threads);
+    std::atomic<uint64_t> errors(0);
+    std::vector<std::thread> workers;
+    const time_t expiry = time(nullptr) + 3600;
+
+    for (unsigned t = 0; t < config.threads; t++)
+    {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 engine(config.seed * 7919 + index * 131 + t);
+            std::uniform_int_distribution<unsigned> pick_key(
+                0, config.keys - 1);
+            std::bernoulli_distribution is_read(config.read_ratio);
+            std::vector<uint8_t> data;
+            get_latencies[t].reserve(1 << 16);
+
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                const unsigned key = pick_key(engine);
+                const bool read = is_read(engine);
+                if (!read)
+                {
+                    data.assign(entry_size(key), static_cast<uint8_t>(key));
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    if (read)
+                    {
+                        local_cache_get(key_name(key));
+                    }
+                    else
+                    {
+                        local_cache_add(
+                            key_name(key), expiry, data.size(), data.data());
+                    }
+                }
+                catch (const std::exception&)
+                {
+                    errors++;
+                }
+                const uint64_t elapsed = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+                (read ? get_latencies : add_latencies)[t].push_back(elapsed);
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(config.duration);
+    stop = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    std::vector<uint64_t> gets;
+    std::vector<uint64_t> adds;
+    for (unsigned t = 0; t < config.threads; t++)
+    {
+        gets.insert(gets.end(), get_latencies[t].begin(), get_latencies[t].end());
+        adds.insert(adds.end(), add_latencies[t].begin(), add_latencies[t].end());
+    }
+
+    child_summary summary = {};
+    summary.get_count = gets.size();
+    summary.add_count = adds.size();
+    summary.errors = errors;
+    for (size_t lock = 0; lock < LOCK_COUNT; lock++)
+    {
+        summary.locks[lock] =
+            local_cache_get_lock_stats(static_cast<local_cache_lock>(lock));
+        summary.locks[lock].acquisitions -= inherited[lock].acquisitions;
+        summary.locks[lock].contended -= inherited[lock].contended;
+        summary.locks[lock].total_wait_ns -= inherited[lock].total_wait_ns;
+    }
+
+    const bool ok =
+        write_all(result_fd, &summary, sizeof(summary)) &&
+        write_all(result_fd, gets.data(), gets.size() * sizeof(uint64_t)) &&
+        write_all(result_fd, adds.data(), adds.size() * sizeof(uint64_t));
+    close(result_fd);
+    return ok ? 0 : 1;
+}
+
+void report_latencies(FILE* out, const char* name, std::vector<uint64_t>& samples, double seconds, bool last)
+{
+    const uint64_t p50 = bench_percentile(samples, 50);
+    const uint64_t p99 = bench_percentile(samples, 99);
+    const uint64_t p999 = bench_percentile(samples, 99.9);
+    fprintf(
+        out,
+        "{\"name\":\"%s\",\"count\":%llu,\"ops_per_second\":%.1f,"
+        "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}%s\n",
+        name,
+        static_cast<unsigned long long>(samples.size()),
+        seconds > 0 ? samples.size() / seconds : 0,
+        p50 / 1000.0,
+        p99 / 1000.0,
+        p999 / 1000.0,
+        (samples.empty() ? 0 : samples.back()) / 1000.0,
+        last ? "" : ",");
+}
+
+bool parse_sizes(const std::string& value)
+{
+    config.entry_sizes.clear();
+    std::istringstream stream(value);
+    std::string size;
+    while (std::getline(stream, size, ','))
+    {
+        const size_t parsed = std::stoul(size);
+        if (parsed == 0)
+        {
+            return false;
+        }
+        config.entry_sizes.push_back(parsed);
+    }
+    return !config.entry_sizes.empty();
+}
+
+bool parse_options(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--processes")
+            config.processes = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--threads")
+            config.threads = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--duration-ms")
+            config.duration = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--read-ratio")
+            config.read_ratio = std::stod(value);
+        else if (arg == "--entry-sizes")
+        {
+            if (!parse_sizes(value))
+                return false;
+        }
+        else if (arg == "--keys")
+            config.keys = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--seed")
+            config.seed = std::stoull(value);
+        else if (arg == "--output")
+            config.output = value;
+        else
+            return false;
+    }
+    return config.processes > 0 && config.threads > 0 && config.keys > 0 &&
+           config.read_ratio >= 0 && config.read_ratio <= 1;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool valid = false;
+    try
+    {
+        valid = parse_options(argc, argv);
+    }
+    catch (const std::exception&)
+    {
+    }
+    if (!valid)
+    {
+        fprintf(
+            stderr,
+            "Usage: %s [--processes M] [--threads N] [--duration-ms N] "
+            "[--read-ratio R] [--entry-sizes S1,S2,...] [--keys N] "
+            "[--seed N] [--output FILE]\n",
+            argv[0]);
+        return 2;
+    }
+
+    char cache_root[] = "/tmp/az-dcap-contention-XXXXXX";
+    const bool temporary_cache = getenv("AZDCAP_CACHE") == nullptr;
+    if (temporary_cache)
+    {
+        if (mkdtemp(cache_root) == nullptr)
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        setenv("AZDCAP_CACHE", cache_root, 1);
+    }
+
+    // Start from a full cache so reads hit; no threads exist yet, so the
+    // children inherit a consistent copy of the cache state
+    local_cache_clear();
+    const time_t expiry = time(nullptr) + 3600;
+    for (unsigned key = 0; key < config.keys; key++)
+    {
+        const std::vector<uint8_t> data(entry_size(key), static_cast<uint8_t>(key));
+        local_cache_add(key_name(key), expiry, data.size(), data.data());
+    }
+
+    int start_pipe[2];
+    if (pipe(start_pipe) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    std::vector<pid_t> children;
+    std::vector<int> result_fds;
+    for (unsigned index = 0; index < config.processes; index++)
+    {
+        int result_pipe[2];
+        if (pipe(result_pipe) != 0)
+        {
+            perror("pipe");
+            return 1;
+        }
+        const pid_t child = fork();
+        if (child < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0)
+        {
+            close(start_pipe[1]);
+            close(result_pipe[0]);
+            for (int fd : result_fds)
+            {
+                close(fd);
+            }
+            _exit(run_child(index, start_pipe[0], result_pipe[1]));
+        }
+        close(result_pipe[1]);
+        children.push_back(child);
+        result_fds.push_back(result_pipe[0]);
+    }
+
+    // Release every child at once
+    close(start_pipe[0]);
+    const auto start = std::chrono::steady_clock::now();
+    close(start_pipe[1]);
+
+    std::vector<uint64_t> gets;
+    std::vector<uint64_t> adds;
+    uint64_t errors = 0;
+    local_cache_lock_stats locks[LOCK_COUNT] = {};
+    bool failed = false;
+    for (int fd : result_fds)
+    {
+        child_summary summary;
+        if (!read_all(fd, &summary, sizeof(summary)))
+        {
+            failed = true;
+            close(fd);
+            continue;
+        }
+        const size_t get_offset = gets.size();
+        const size_t add_offset = adds.size();
+        gets.resize(get_offset + summary.get_count);
+        adds.resize(add_offset + summary.add_count);
+        failed |= !read_all(fd, gets.data() + get_offset, summary.get_count * sizeof(uint64_t)) ||
+                  !read_all(fd, adds.data() + add_offset, summary.add_count * sizeof(uint64_t));
+        close(fd);
+
+        errors += summary.errors;
+        for (size_t lock = 0; lock < LOCK_COUNT; lock++)
+        {
+            locks[lock].acquisitions += summary.locks[lock].acquisitions;
+            locks[lock].contended += summary.locks[lock].contended;
+            locks[lock].total_wait_ns += summary.locks[lock].total_wait_ns;
+            locks[lock].max_wait_ns = std::max(
+                locks[lock].max_wait_ns, summary.locks[lock].max_wait_ns);
+        }
+    }
+    for (pid_t child : children)
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    const double seconds = std::min(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count(),
+        std::chrono::duration<double>(config.duration).count());
+
+    local_cache_clear();
+    if (temporary_cache)
+    {
+        rmdir(cache_root);
+    }
+
+    FILE* out = config.output.empty() ? stdout : fopen(config.output.c_str(), "w");
+    if (out == nullptr)
+    {
+        perror(config.output.c_str());
+        return 1;
+    }
+
+    std::vector<uint64_t> all(gets);
+    all.insert(all.end(), adds.begin(), adds.end());
+    fprintf(out, "{\"processes\":%u,\"threads\":%u,\"read_ratio\":%.3f,\"keys\":%u,\"entry_sizes\":[",
+            config.processes, config.threads, config.read_ratio, config.keys);
+    for (size_t i = 0; i < config.entry_sizes.size(); i++)
+    {
+        fprintf(out, "%s%zu", i ? "," : "", config.entry_sizes[i]);
+    }
+    fprintf(out, "],\"errors\":%llu,\"operations\":[\n", static_cast<unsigned long long>(errors));
+    report_latencies(out, "all", all, seconds, false);
+    report_latencies(out, "get", gets, seconds, false);
+    report_latencies(out, "add", adds, seconds, true);
+    fprintf(out, "],\"locks\":[\n");
+    for (size_t lock = 0; lock < LOCK_COUNT; lock++)
+    {
+        fprintf(
+            out,
+            "{\"name\":\"%s\",\"acquisitions\":%llu,\"contended\":%llu,"
+            "\"wait_ms_total\":%.3f,\"wait_ms_max\":%.3f}%s\n",
+            LOCK_NAMES[lock],
+            static_cast<unsigned long long>(locks[lock].acquisitions),
+            static_cast<unsigned long long>(locks[lock].contended),
+            locks[lock].total_wait_ns / 1e6,
+            locks[lock].max_wait_ns / 1e6,
+            lock + 1 < LOCK_COUNT ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "One or more worker processes failed\n");
+        return 1;
+    }
+    return 0;
+}
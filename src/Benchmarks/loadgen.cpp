@@ -0,0 +1,547 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// End-to-end load generator. Loads libdcap_quoteprov.so the way the Intel
+// libraries do and calls sgx_ql_get_quote_verification_collateral and
+// sgx_ql_get_quote_config from many threads, then reports throughput and
+// latency percentiles per scenario:
+//
+//   cold      every call uses an FMSPC or platform never requested before
+//   warm      every key is cached before the run starts
+//   expiring  warm, while cache entries expire at --expire-rate per second
+//
+// Point AZDCAP_BASE_CERT_URL at test_server (see 'make load') or at a real
+// service. Unless AZDCAP_CACHE is set, a temporary cache directory is used.
+//
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "dcap_provider.h"
+#include "sgx_ql_lib_common.h"
+
+typedef quote3_error_t (*sgx_ql_get_quote_config_t)(
+    const sgx_ql_pck_cert_id_t* p_pck_cert_id,
+    sgx_ql_config_t** pp_quote_config);
+
+typedef quote3_error_t (*sgx_ql_free_quote_config_t)(
+    sgx_ql_config_t* p_quote_config);
+
+typedef quote3_error_t (*sgx_ql_get_quote_verification_collateral_t)(
+    const uint8_t* fmspc,
+    const uint16_t fmspc_size,
+    const char* pck_ca,
+    sgx_ql_qve_collateral_t** pp_quote_collateral);
+
+typedef quote3_error_t (*sgx_ql_free_quote_verification_collateral_t)(
+    sgx_ql_qve_collateral_t* p_quote_collateral);
+
+namespace
+{
+sgx_ql_get_quote_config_t get_quote_config;
+sgx_ql_free_quote_config_t free_quote_config;
+sgx_ql_get_quote_verification_collateral_t get_collateral;
+sgx_ql_free_quote_verification_collateral_t free_collateral;
+
+enum class api_mix
+{
+    collateral,
+    quote_config,
+    mixed,
+};
+
+struct options
+{
+    std::string library = "libdcap_quoteprov.so";
+    unsigned threads = 8;
+    std::chrono::milliseconds duration{10000};
+    unsigned keys = 100;
+    bool zipf = false;
+    double zipf_exponent = 1.1;
+    api_mix api = api_mix::mixed;
+    std::vector<std::string> scenarios = {"cold", "warm", "expiring"};
+    double expire_rate = 50;
+    std::string output;
+    uint64_t seed = 1;
+};
+
+options config;
+std::string cache_dir;
+
+//
+// Picks key indexes in [0, keys), uniformly or following Zipf's law, where the
+// k-th most popular key is requested in proportion to 1 / k^exponent.
+//
+class key_distribution
+{
+  public:
+    key_distribution(unsigned keys, bool zipf, double exponent) : keys(keys)
+    {
+        if (!zipf)
+        {
+            return;
+        }
+        double total = 0;
+        cdf.reserve(keys);
+        for (unsigned k = 1; k <= keys; k++)
+        {
+            total += 1.0 / std::pow(k, exponent);
+            cdf.push_back(total);
+        }
+        for (double& value : cdf)
+        {
+            value /= total;
+        }
+    }
+
+    unsigned operator()(std::mt19937_64& engine) const
+    {
+        if (cdf.empty())
+        {
+            return std::uniform_int_distribution<unsigned>(0, keys - 1)(engine);
+        }
+        const double sample =
+            std::uniform_real_distribution<double>(0.0, 1.0)(engine);
+        const auto it = std::lower_bound(cdf.begin(), cdf.end(), sample);
+        return std::min<unsigned>(
+            static_cast<unsigned>(it - cdf.begin()), keys - 1);
+    }
+
+  private:
+    unsigned keys;
+    std::vector<double> cdf;
+};
+
+//
+// Derives the FMSPC and PCK certificate ID of a synthetic platform from its
+// key index.
+//
+struct platform
+{
+    explicit platform(uint64_t key)
+    {
+        for (size_t i = 0; i < sizeof(fmspc); i++)
+        {
+            fmspc[i] = static_cast<uint8_t>(key >> (8 * (sizeof(fmspc) - 1 - i)));
+        }
+        memset(qe_id, 0, sizeof(qe_id));
+        memcpy(qe_id, &key, sizeof(key));
+        memset(&cpu_svn, 0, sizeof(cpu_svn));
+        cpu_svn.svn[0] = 0x04;
+        cert_id = {qe_id, sizeof(qe_id), &cpu_svn, &pce_svn, 0};
+    }
+
+    platform(const platform&) = delete;
+    platform& operator=(const platform&) = delete;
+
+    uint8_t fmspc[6];
+    uint8_t qe_id[16];
+    sgx_cpu_svn_t cpu_svn;
+    sgx_isv_svn_t pce_svn = 6;
+    sgx_ql_pck_cert_id_t cert_id;
+};
+
+bool call_api(uint64_t key, bool collateral)
+{
+    platform target(key);
+    if (collateral)
+    {
+        sgx_ql_qve_collateral_t* output = nullptr;
+        if (get_collateral(
+                target.fmspc, sizeof(target.fmspc), "processor", &output) !=
+            SGX_QL_SUCCESS)
+        {
+            return false;
+        }
+        free_collateral(output);
+        return true;
+    }
+
+    sgx_ql_config_t* output = nullptr;
+    if (get_quote_config(&target.cert_id, &output) != SGX_QL_SUCCESS)
+    {
+        return false;
+    }
+    free_quote_config(output);
+    return true;
+}
+
+void clear_cache()
+{
+    DIR* directory = opendir(cache_dir.c_str());
+    if (directory == nullptr)
+    {
+        return;
+    }
+    while (dirent* entry = readdir(directory))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            unlinkat(dirfd(directory), entry->d_name, 0);
+        }
+    }
+    closedir(directory);
+}
+
+//
+// Marks one random cache entry as expired by rewriting the expiry field of its
+// header (CacheEntryHeaderV1 in Linux/local_cache.cpp), under the same lock
+// the cache takes for writes.
+//
+void expire_random_entry(std::mt19937_64& engine)
+{
+    std::vector<std::string> entries;
+    DIR* directory = opendir(cache_dir.c_str());
+    if (directory == nullptr)
+    {
+        return;
+    }
+    while (dirent* entry = readdir(directory))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            entries.push_back(entry->d_name);
+        }
+    }
+    closedir(directory);
+    if (entries.empty())
+    {
+        return;
+    }
+
+    const std::string& name = entries[std::uniform_int_distribution<size_t>(
+        0, entries.size() - 1)(engine)];
+    int fd = open((cache_dir + "/" + name).c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    if (flock(fd, LOCK_EX) == 0)
+    {
+        const time_t expired = 1;
+        if (pwrite(fd, &expired, sizeof(expired), sizeof(uint16_t)) !=
+            sizeof(expired))
+        {
+            perror("pwrite");
+        }
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
+
+struct scenario_result
+{
+    std::string name;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+    std::vector<uint64_t> latencies_ns;
+};
+
+scenario_result run_scenario(const std::string& name)
+{
+    const bool cold = name == "cold";
+    clear_cache();
+
+    // Cold runs draw fresh keys past the warm key range, one per call
+    std::atomic<uint64_t> next_cold_key(config.keys);
+    if (!cold)
+    {
+        for (unsigned key = 0; key < config.keys; key++)
+        {
+            if (config.api != api_mix::quote_config)
+            {
+                call_api(key, true);
+            }
+            if (config.api != api_mix::collateral)
+            {
+                call_api(key, false);
+            }
+        }
+    }
+
+    const key_distribution distribution(
+        config.keys, config.zipf, config.zipf_exponent);
+    std::atomic<bool> stop(false);
+    std::vector<std::vector<uint64_t>> latencies(config.threads);
+    std::vector<uint64_t> errors(config.threads, 0);
+    std::vector<std::thread> workers;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < config.threads; t++)
+    {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 engine(config.seed * 7919 + t);
+            latencies[t].reserve(1 << 16);
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                const uint64_t key = cold ? next_cold_key++
+                                          : distribution(engine);
+                const bool collateral =
+                    config.api == api_mix::collateral ||
+                    (config.api == api_mix::mixed && (engine() & 1));
+
+                const auto call_start = std::chrono::steady_clock::now();
+                const bool ok = call_api(key, collateral);
+                latencies[t].push_back(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - call_start)
+                        .count()));
+                if (!ok)
+                {
+                    errors[t]++;
+                }
+            }
+        });
+    }
+
+    std::thread expirer;
+    if (name == "expiring" && config.expire_rate > 0)
+    {
+        expirer = std::thread([&] {
+            std::mt19937_64 engine(config.seed);
+            const auto interval = std::chrono::duration<double>(
+                1.0 / config.expire_rate);
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                expire_random_entry(engine);
+                std::this_thread::sleep_for(interval);
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(config.duration);
+    stop = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    if (expirer.joinable())
+    {
+        expirer.join();
+    }
+
+    scenario_result result;
+    result.name = name;
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    for (unsigned t = 0; t < config.threads; t++)
+    {
+        result.latencies_ns.insert(
+            result.latencies_ns.end(), latencies[t].begin(), latencies[t].end());
+        result.errors += errors[t];
+    }
+    result.requests = result.latencies_ns.size();
+    return result;
+}
+
+void report(FILE* out, std::vector<scenario_result>& results)
+{
+    fprintf(
+        out,
+        "{\"threads\":%u,\"keys\":%u,\"distribution\":\"%s\",\"scenarios\":[\n",
+        config.threads,
+        config.keys,
+        config.zipf ? "zipf" : "uniform");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        scenario_result& result = results[i];
+        const uint64_t p50 = bench_percentile(result.latencies_ns, 50);
+        const uint64_t p99 = bench_percentile(result.latencies_ns, 99);
+        const uint64_t p999 = bench_percentile(result.latencies_ns, 99.9);
+        const uint64_t max =
+            result.latencies_ns.empty() ? 0 : result.latencies_ns.back();
+        fprintf(
+            out,
+            "{\"name\":\"%s\",\"requests\":%llu,\"errors\":%llu,"
+            "\"requests_per_second\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+            "\"p999_us\":%.1f,\"max_us\":%.1f}%s\n",
+            result.name.c_str(),
+            static_cast<unsigned long long>(result.requests),
+            static_cast<unsigned long long>(result.errors),
+            result.seconds > 0 ? result.requests / result.seconds : 0,
+            p50 / 1000.0,
+            p99 / 1000.0,
+            p999 / 1000.0,
+            max / 1000.0,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+void usage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "  --library PATH        provider to load (default libdcap_quoteprov.so)\n"
+        "  --threads N           concurrent callers (default 8)\n"
+        "  --duration-ms N       length of each scenario (default 10000)\n"
+        "  --keys N              distinct platforms and FMSPCs (default 100)\n"
+        "  --distribution D      uniform or zipf (default uniform)\n"
+        "  --zipf-exponent S     skew of the zipf distribution (default 1.1)\n"
+        "  --api A               collateral, quote_config or mixed (default)\n"
+        "  --scenario S          cold, warm or expiring; repeatable (default all)\n"
+        "  --expire-rate N       entries expired per second when expiring\n"
+        "  --seed N              random seed\n"
+        "  --output FILE         write the JSON report here instead of stdout\n",
+        program);
+}
+
+bool parse_options(int argc, char** argv)
+{
+    bool scenarios_given = false;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--library")
+            config.library = value;
+        else if (arg == "--threads")
+            config.threads = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--duration-ms")
+            config.duration = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--keys")
+            config.keys = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--distribution" && (value == "uniform" || value == "zipf"))
+            config.zipf = value == "zipf";
+        else if (arg == "--zipf-exponent")
+            config.zipf_exponent = std::stod(value);
+        else if (arg == "--api" && value == "collateral")
+            config.api = api_mix::collateral;
+        else if (arg == "--api" && value == "quote_config")
+            config.api = api_mix::quote_config;
+        else if (arg == "--api" && value == "mixed")
+            config.api = api_mix::mixed;
+        else if (
+            arg == "--scenario" &&
+            (value == "cold" || value == "warm" || value == "expiring"))
+        {
+            if (!scenarios_given)
+            {
+                config.scenarios.clear();
+                scenarios_given = true;
+            }
+            config.scenarios.push_back(value);
+        }
+        else if (arg == "--expire-rate")
+            config.expire_rate = std::stod(value);
+        else if (arg == "--seed")
+            config.seed = std::stoull(value);
+        else if (arg == "--output")
+            config.output = value;
+        else
+            return false;
+    }
+    return config.threads > 0 && config.keys > 0;
+}
+
+bool load_library()
+{
+    void* library = dlopen(config.library.c_str(), RTLD_NOW);
+    if (library == nullptr)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+
+    get_quote_config = reinterpret_cast<sgx_ql_get_quote_config_t>(
+        dlsym(library, "sgx_ql_get_quote_config"));
+    free_quote_config = reinterpret_cast<sgx_ql_free_quote_config_t>(
+        dlsym(library, "sgx_ql_free_quote_config"));
+    get_collateral = reinterpret_cast<sgx_ql_get_quote_verification_collateral_t>(
+        dlsym(library, "sgx_ql_get_quote_verification_collateral"));
+    free_collateral =
+        reinterpret_cast<sgx_ql_free_quote_verification_collateral_t>(
+            dlsym(library, "sgx_ql_free_quote_verification_collateral"));
+    return get_quote_config && free_quote_config && get_collateral &&
+           free_collateral;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        if (!parse_options(argc, argv))
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    catch (const std::exception&)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // The cache directory must be known to clear and expire entries
+    const char* cache_root = getenv("AZDCAP_CACHE");
+    char temporary_root[] = "/tmp/az-dcap-loadgen-XXXXXX";
+    if (cache_root == nullptr || *cache_root == '\0')
+    {
+        if (mkdtemp(temporary_root) == nullptr)
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        setenv("AZDCAP_CACHE", temporary_root, 1);
+        cache_root = temporary_root;
+    }
+    cache_dir = std::string(cache_root) + "/.az-dcap-client";
+
+    if (!load_library())
+    {
+        return 1;
+    }
+
+    std::vector<scenario_result> results;
+    for (const std::string& scenario : config.scenarios)
+    {
+        fprintf(stderr, "Running %s for %lld ms...\n", scenario.c_str(),
+                static_cast<long long>(config.duration.count()));
+        results.push_back(run_scenario(scenario));
+    }
+
+    clear_cache();
+    if (cache_root == temporary_root)
+    {
+        rmdir(cache_dir.c_str());
+        rmdir(temporary_root);
+    }
+
+    FILE* out = config.output.empty() ? stdout : fopen(config.output.c_str(), "w");
+    if (out == nullptr)
+    {
+        perror(config.output.c_str());
+        return 1;
+    }
+    report(out, results);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Microbenchmarks for the provider's hot paths. The provider source is
+// included directly so its internal helpers can be measured without exporting
+// them from the library:
+//
+//   ./microbench [--min-time-ms N] [--filter TEXT] [--output FILE]
+//                [--baseline FILE] [--threshold PERCENT]
+//
+// Results are written as JSON. With --baseline, each benchmark is also
+// compared against a previous run and the exit code is 1 if any regressed.
+// The collateral assembly benchmarks need AZDCAP_BASE_CERT_URL to point at a
+// reachable service, e.g. test_server, to seed the cache; they are skipped
+// otherwise.
+//
+
+#include "../dcap_provider.cpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <functional>
+
+#include "bench.h"
+
+struct curl_easy_bench
+{
+    static size_t header_callback(curl_easy& curl, std::string& line)
+    {
+        return curl_easy::header_callback(&line[0], 1, line.size(), &curl);
+    }
+};
+
+namespace
+{
+struct options
+{
+    std::chrono::milliseconds min_time{200};
+    std::string filter;
+    std::string output;
+    std::string baseline;
+    double threshold = 10.0;
+};
+
+uint8_t bench_qe_id[16] = {0x00, 0xfb, 0xe6, 0x73, 0x33, 0x36, 0xea, 0xf7,
+                           0xa4, 0xe3, 0xd8, 0xb9, 0x66, 0xa8, 0x2e, 0x64};
+sgx_cpu_svn_t bench_cpu_svn = {0x04, 0x04, 0x02, 0x04, 0xff, 0x80, 0x00, 0x00,
+                               0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+sgx_isv_svn_t bench_pce_svn = 6;
+sgx_ql_pck_cert_id_t bench_cert_id = {
+    bench_qe_id,
+    sizeof(bench_qe_id),
+    &bench_cpu_svn,
+    &bench_pce_svn,
+    0};
+const uint8_t bench_fmspc[] = {0x00, 0x90, 0x6E, 0xA1, 0x00, 0x00};
+
+//
+// A two certificate PEM chain roughly the size of the ones the service
+// returns, URL-escaped as it is on the wire.
+//
+std::string make_escaped_issuer_chain()
+{
+    static const char BASE64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string chain;
+    for (int cert = 0; cert < 2; cert++)
+    {
+        chain += "-----BEGIN CERTIFICATE-----\n";
+        for (int line = 0; line < 13; line++)
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                chain += BASE64[(cert * 7 + line * 13 + i) % 64];
+            }
+            chain += '\n';
+        }
+        chain += "-----END CERTIFICATE-----\n";
+    }
+    return curl_easy::escape(chain.data(), static_cast<int>(chain.size()));
+}
+
+bool parse_options(int argc, char** argv, options& config)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--min-time-ms")
+            config.min_time = std::chrono::milliseconds(atoi(value));
+        else if (arg == "--filter")
+            config.filter = value;
+        else if (arg == "--output")
+            config.output = value;
+        else if (arg == "--baseline")
+            config.baseline = value;
+        else if (arg == "--threshold")
+            config.threshold = atof(value);
+        else
+            return false;
+    }
+    return true;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    options config;
+    if (!parse_options(argc, argv, config))
+    {
+        fprintf(
+            stderr,
+            "Usage: %s [--min-time-ms N] [--filter TEXT] [--output FILE] "
+            "[--baseline FILE] [--threshold PERCENT]\n",
+            argv[0]);
+        return 2;
+    }
+
+    // Keep benchmark entries out of the user's cache
+    char cache_dir[] = "/tmp/az-dcap-bench-XXXXXX";
+    if (getenv("AZDCAP_CACHE") == nullptr)
+    {
+        if (mkdtemp(cache_dir) == nullptr)
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        setenv("AZDCAP_CACHE", cache_dir, 1);
+    }
+
+    syscall_counter syscalls;
+    std::vector<bench_result> results;
+    auto wanted = [&](const std::string& name) {
+        return name.find(config.filter) != std::string::npos;
+    };
+    auto run = [&](const std::string& name, const std::function<void()>& op) {
+        if (!wanted(name))
+        {
+            return;
+        }
+        results.push_back(bench_run(name, syscalls, config.min_time, op));
+        fprintf(
+            stderr,
+            "%-40s %12.1f ns/op %8.2f allocs/op %8.2f syscalls/op\n",
+            name.c_str(),
+            results.back().ns_per_op,
+            results.back().allocs_per_op,
+            results.back().syscalls_per_op);
+    };
+
+    // Local cache
+    const time_t expiry = time(nullptr) + 3600;
+    for (size_t size : {256, 4096, 65536})
+    {
+        const std::vector<uint8_t> data(size, 0x5a);
+        const std::string key = "bench/entry/" + std::to_string(size);
+        run("local_cache_add/" + std::to_string(size), [&] {
+            local_cache_add(key, expiry, data.size(), data.data());
+        });
+        run("local_cache_get/" + std::to_string(size), [&] {
+            auto entry = local_cache_get(key);
+            assert(entry != nullptr);
+        });
+    }
+    run("local_cache_get/miss", [] {
+        auto entry = local_cache_get("bench/missing");
+        assert(entry == nullptr);
+    });
+
+    // URL building
+    run("build_pck_cert_url", [] { build_pck_cert_url(bench_cert_id); });
+    run("build_pck_crl_url", [] {
+        build_pck_crl_url(PROCESSOR_CRL_NAME, API_VERSION);
+    });
+    const std::string fmspc(
+        reinterpret_cast<const char*>(bench_fmspc), sizeof(bench_fmspc));
+    run("build_tcb_info_url", [&] { build_tcb_info_url(fmspc); });
+    run("build_enclave_id_url", [] {
+        std::string header;
+        build_enclave_id_url(false, header);
+    });
+
+    // Hex encoding
+    run("format_as_hex_string/16", [] {
+        format_as_hex_string(&bench_cpu_svn, sizeof(bench_cpu_svn));
+    });
+    const std::string cpu_svn_hex = "04040204ff8000000000000000000000";
+    run("hex_decode/cpu_svn", [&] {
+        sgx_cpu_svn_t decoded;
+        hex_decode(cpu_svn_hex, &decoded);
+    });
+    const std::string pce_svn_hex = "0006";
+    run("hex_decode/pce_svn", [&] {
+        uint16_t decoded;
+        hex_decode(pce_svn_hex, &decoded);
+    });
+
+    // Response headers and issuer chains
+    const std::string escaped_chain = make_escaped_issuer_chain();
+    const auto curl = curl_easy::create("http://127.0.0.1/", nullptr);
+    std::string status_line = "HTTP/1.1 200 OK\r\n";
+    std::string request_id_line =
+        "Request-ID: 6bd0a8bd-3b1c-4e2c-9d6b-4fbf1b7a0b63\r\n";
+    std::string chain_line =
+        "SGX-PCK-Certificate-Issuer-Chain: " + escaped_chain + "\r\n";
+    run("header_callback/status_line", [&] {
+        std::string line = status_line;
+        curl_easy_bench::header_callback(*curl, line);
+    });
+    run("header_callback/request_id", [&] {
+        std::string line = request_id_line;
+        curl_easy_bench::header_callback(*curl, line);
+    });
+    run("header_callback/issuer_chain", [&] {
+        std::string line = chain_line;
+        curl_easy_bench::header_callback(*curl, line);
+    });
+    run("unescape/issuer_chain", [&] { curl->unescape(escaped_chain); });
+
+    // Output buffers
+    const std::string body_string(4096, 'x');
+    const std::vector<uint8_t> body_vector(4096, 'x');
+    run("fill_qpl_string_buffer/string_4k", [&] {
+        char* buffer = nullptr;
+        uint32_t size = 0;
+        fill_qpl_string_buffer(body_string, buffer, size);
+        delete[] buffer;
+    });
+    run("fill_qpl_string_buffer/vector_4k", [&] {
+        char* buffer = nullptr;
+        uint32_t size = 0;
+        fill_qpl_string_buffer(body_vector, buffer, size);
+        delete[] buffer;
+    });
+
+    // Collateral assembly from a warm cache. Seeding it needs a service.
+    auto run_warm = [&](const std::string& name,
+                        const std::function<bool()>& seed,
+                        const std::function<void()>& op) {
+        if (!wanted(name))
+        {
+            return;
+        }
+        if (!seed())
+        {
+            fprintf(
+                stderr,
+                "Skipping %s: no service at AZDCAP_BASE_CERT_URL\n",
+                name.c_str());
+            return;
+        }
+        run(name, op);
+    };
+    auto get_collateral = [] {
+        sgx_ql_qve_collateral_t* output = nullptr;
+        const quote3_error_t result = sgx_ql_get_quote_verification_collateral(
+            bench_fmspc, sizeof(bench_fmspc), "processor", &output);
+        if (result == SGX_QL_SUCCESS)
+        {
+            sgx_ql_free_quote_verification_collateral(output);
+        }
+        return result == SGX_QL_SUCCESS;
+    };
+    auto get_quote_config = [] {
+        sgx_ql_config_t* output = nullptr;
+        const quote3_error_t result =
+            sgx_ql_get_quote_config(&bench_cert_id, &output);
+        if (result == SGX_QL_SUCCESS)
+        {
+            sgx_ql_free_quote_config(output);
+        }
+        return result == SGX_QL_SUCCESS;
+    };
+    run_warm(
+        "get_quote_verification_collateral/warm",
+        get_collateral,
+        get_collateral);
+    run_warm("get_quote_config/warm", get_quote_config, get_quote_config);
+
+    local_cache_clear();
+    if (strcmp(getenv("AZDCAP_CACHE"), cache_dir) == 0)
+    {
+        rmdir(cache_dir);
+    }
+
+    FILE* out = stdout;
+    if (!config.output.empty())
+    {
+        out = fopen(config.output.c_str(), "w");
+        if (out == nullptr)
+        {
+            perror(config.output.c_str());
+            return 1;
+        }
+    }
+    bench_write_json(out, results, syscalls.source());
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    if (!config.baseline.empty())
+    {
+        std::map<std::string, bench_result> baseline;
+        if (!bench_load_baseline(config.baseline, baseline))
+        {
+            fprintf(stderr, "Cannot read baseline %s\n", config.baseline.c_str());
+            return 1;
+        }
+        const int regressions =
+            bench_compare(stderr, results, baseline, config.threshold);
+        if (regressions > 0)
+        {
+            fprintf(stderr, "%d benchmark(s) regressed\n", regressions);
+            return 1;
+        }
+    }
+
+    return 0;
+}
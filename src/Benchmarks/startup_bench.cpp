@@ -0,0 +1,342 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Startup benchmark for tools that load the provider, make one call and exit.
+// Every sample runs in a fresh process, since the costs measured here are only
+// paid once per process:
+//
+//   dlopen         dlopen of libdcap_quoteprov.so, constructors included
+//   first_call     first sgx_ql_get_quote_config, from a warm disk cache
+//   dlclose        unloading the library again
+//
+// The one-time initialization inside those is broken down by
+// startup_components, a helper linked directly against the same code:
+// OpenSSL and libcurl global initialization, log initialization and cache
+// directory discovery. It must sit next to this binary.
+//
+// AZDCAP_BASE_CERT_URL must reach a service (see 'make startup-bench') so the
+// cache can be warmed before measuring. Unless AZDCAP_CACHE is set, a
+// temporary cache directory is used.
+//
+
+#include <dlfcn.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "sgx_ql_lib_common.h"
+
+typedef quote3_error_t (*sgx_ql_get_quote_config_t)(
+    const sgx_ql_pck_cert_id_t* p_pck_cert_id,
+    sgx_ql_config_t** pp_quote_config);
+
+typedef quote3_error_t (*sgx_ql_free_quote_config_t)(
+    sgx_ql_config_t* p_quote_config);
+
+namespace
+{
+uint8_t qe_id[16] = {0x00, 0xfb, 0xe6, 0x73, 0x33, 0x36, 0xea, 0xf7,
+                     0xa4, 0xe3, 0xd8, 0xb9, 0x66, 0xa8, 0x2e, 0x64};
+sgx_cpu_svn_t cpu_svn = {{0x04, 0x04, 0x02, 0x04, 0xff, 0x80, 0x00, 0x00,
+                          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}};
+sgx_isv_svn_t pce_svn = 6;
+sgx_ql_pck_cert_id_t cert_id = {qe_id, sizeof(qe_id), &cpu_svn, &pce_svn, 0};
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+}
+
+//
+// Child side of a "load" sample: prints dlopen, first call and dlclose times
+// in nanoseconds.
+//
+int measure_load(const char* library_path)
+{
+    auto start = std::chrono::steady_clock::now();
+    void* library = dlopen(library_path, RTLD_NOW);
+    const uint64_t load = elapsed_ns(start);
+    if (library == nullptr)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    auto get_quote_config = reinterpret_cast<sgx_ql_get_quote_config_t>(
+        dlsym(library, "sgx_ql_get_quote_config"));
+    auto free_quote_config = reinterpret_cast<sgx_ql_free_quote_config_t>(
+        dlsym(library, "sgx_ql_free_quote_config"));
+    if (get_quote_config == nullptr || free_quote_config == nullptr)
+    {
+        fprintf(stderr, "Missing exports in %s\n", library_path);
+        return 1;
+    }
+
+    start = std::chrono::steady_clock::now();
+    sgx_ql_config_t* config = nullptr;
+    const quote3_error_t result = get_quote_config(&cert_id, &config);
+    if (result == SGX_QL_SUCCESS)
+    {
+        free_quote_config(config);
+    }
+    const uint64_t first_call = elapsed_ns(start);
+    if (result != SGX_QL_SUCCESS)
+    {
+        fprintf(stderr, "sgx_ql_get_quote_config failed: 0x%x\n", result);
+        return 1;
+    }
+
+    start = std::chrono::steady_clock::now();
+    dlclose(library);
+    const uint64_t unload = elapsed_ns(start);
+
+    printf(
+        "%llu %llu %llu\n",
+        static_cast<unsigned long long>(load),
+        static_cast<unsigned long long>(first_call),
+        static_cast<unsigned long long>(unload));
+    return 0;
+}
+
+//
+// Runs 'argv' in a fresh process and parses the numbers it prints.
+//
+bool run_sample(const std::vector<std::string>& args, std::vector<uint64_t>& values)
+{
+    int output[2];
+    if (pipe(output) != 0)
+    {
+        return false;
+    }
+
+    const pid_t child = fork();
+    if (child < 0)
+    {
+        return false;
+    }
+    if (child == 0)
+    {
+        dup2(output[1], STDOUT_FILENO);
+        close(output[0]);
+        close(output[1]);
+        std::vector<char*> argv;
+        for (const std::string& arg : args)
+        {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(output[1]);
+    std::string text;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(output[0], buffer, sizeof(buffer))) > 0)
+    {
+        text.append(buffer, static_cast<size_t>(count));
+    }
+    close(output[0]);
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return false;
+    }
+
+    // The library logs to stdout too, so only the last line is the sample
+    const size_t line_end = text.find_last_not_of('\n');
+    const size_t line_start = line_end == std::string::npos
+                                  ? 0
+                                  : text.find_last_of('\n', line_end) + 1;
+    values.clear();
+    const char* cursor = text.c_str() + line_start;
+    char* end = nullptr;
+    for (unsigned long long value = strtoull(cursor, &end, 10); end != cursor;
+         value = strtoull(cursor, &end, 10))
+    {
+        values.push_back(value);
+        cursor = end;
+    }
+    return true;
+}
+
+int remove_path(const char* path, const struct stat*, int, struct FTW*)
+{
+    return remove(path);
+}
+
+std::string sibling_path(const char* name)
+{
+    char self[4096];
+    const ssize_t size = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (size <= 0)
+    {
+        return name;
+    }
+    self[size] = '\0';
+    std::string path(self);
+    return path.substr(0, path.rfind('/') + 1) + name;
+}
+
+void report(FILE* out, const char* name, std::vector<uint64_t>& samples, bool last)
+{
+    const uint64_t p50 = bench_percentile(samples, 50);
+    const uint64_t p90 = bench_percentile(samples, 90);
+    fprintf(
+        out,
+        "{\"name\":\"%s\",\"samples\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+        "\"min_us\":%.1f,\"max_us\":%.1f}%s\n",
+        name,
+        samples.size(),
+        p50 / 1000.0,
+        p90 / 1000.0,
+        (samples.empty() ? 0 : samples.front()) / 1000.0,
+        (samples.empty() ? 0 : samples.back()) / 1000.0,
+        last ? "" : ",");
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--child-load") == 0)
+    {
+        return measure_load(argv[2]);
+    }
+
+    std::string library = "libdcap_quoteprov.so";
+    unsigned iterations = 20;
+    std::string output;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--library") == 0)
+            library = argv[i + 1];
+        else if (strcmp(argv[i], "--iterations") == 0)
+            iterations = static_cast<unsigned>(strtoul(argv[i + 1], nullptr, 10));
+        else if (strcmp(argv[i], "--output") == 0)
+            output = argv[i + 1];
+        else
+            iterations = 0;
+    }
+    if (argc % 2 == 0 || iterations == 0)
+    {
+        fprintf(
+            stderr,
+            "Usage: %s [--library PATH] [--iterations N] [--output FILE]\n",
+            argv[0]);
+        return 2;
+    }
+
+    char cache_root[] = "/tmp/az-dcap-startup-XXXXXX";
+    const bool temporary_cache = getenv("AZDCAP_CACHE") == nullptr;
+    if (temporary_cache)
+    {
+        if (mkdtemp(cache_root) == nullptr)
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        setenv("AZDCAP_CACHE", cache_root, 1);
+    }
+
+    const std::string self = sibling_path("startup_bench");
+    const std::string components = sibling_path("startup_components");
+    const std::vector<std::string> load_args = {self, "--child-load", library};
+
+    // The first run fetches from the service and warms the cache
+    std::vector<uint64_t> values;
+    int result = 0;
+    if (!run_sample(load_args, values))
+    {
+        fprintf(stderr, "Could not warm the cache; is AZDCAP_BASE_CERT_URL reachable?\n");
+        result = 1;
+    }
+
+    struct component
+    {
+        const char* name;
+        const char* mode;
+        std::vector<uint64_t> samples;
+    };
+    std::vector<component> breakdown = {
+        {"openssl_init", "openssl", {}},
+        {"curl_global_init", "curl", {}},
+        {"log_init", "log", {}},
+        {"cache_directory_discovery", "cache", {}},
+    };
+    std::vector<uint64_t> load_samples;
+    std::vector<uint64_t> first_call_samples;
+    std::vector<uint64_t> unload_samples;
+
+    for (unsigned i = 0; i < iterations && result == 0; i++)
+    {
+        if (!run_sample(load_args, values) || values.size() != 3)
+        {
+            fprintf(stderr, "Load sample failed\n");
+            result = 1;
+            break;
+        }
+        load_samples.push_back(values[0]);
+        first_call_samples.push_back(values[1]);
+        unload_samples.push_back(values[2]);
+
+        for (component& part : breakdown)
+        {
+            if (!run_sample({components, part.mode}, values) || values.size() != 1)
+            {
+                fprintf(stderr, "%s sample failed\n", part.name);
+                result = 1;
+                break;
+            }
+            part.samples.push_back(values[0]);
+        }
+    }
+
+    if (temporary_cache)
+    {
+        if (nftw(cache_root, remove_path, 4, FTW_DEPTH | FTW_PHYS) != 0)
+        {
+            fprintf(stderr, "Could not remove %s\n", cache_root);
+        }
+    }
+    if (result != 0)
+    {
+        return result;
+    }
+
+    FILE* out = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (out == nullptr)
+    {
+        perror(output.c_str());
+        return 1;
+    }
+    fprintf(out, "{\"library\":\"%s\",\"phases\":[\n", library.c_str());
+    report(out, "dlopen", load_samples, false);
+    report(out, "first_call", first_call_samples, false);
+    report(out, "dlclose", unload_samples, true);
+    fprintf(out, "],\"breakdown\":[\n");
+    for (size_t i = 0; i < breakdown.size(); i++)
+    {
+        report(out, breakdown[i].name, breakdown[i].samples, i + 1 == breakdown.size());
+    }
+    fprintf(out, "]}\n");
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Helper for startup_bench. Times one piece of the provider's one-time
+// initialization in a fresh process and prints it in nanoseconds:
+//
+//   openssl   OpenSSL initialization, as triggered by curl_global_init
+//   curl      curl_global_init(CURL_GLOBAL_DEFAULT), from init.cpp,
+//             OpenSSL initialization included
+//   log       reading the logging environment on first use
+//   cache     cache directory discovery and creation (init_callback in
+//             local_cache.cpp), without the lookup that triggered it
+//
+
+#include <curl/curl.h>
+#include <openssl/ssl.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "local_cache.h"
+#include "private.h"
+
+static uint64_t time_ns(void (*operation)())
+{
+    const auto start = std::chrono::steady_clock::now();
+    operation();
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s openssl|curl|log|cache\n", argv[0]);
+        return 2;
+    }
+
+    const char* mode = argv[1];
+    uint64_t elapsed = 0;
+    if (strcmp(mode, "openssl") == 0)
+    {
+        elapsed = time_ns([] { OPENSSL_init_ssl(0, nullptr); });
+    }
+    else if (strcmp(mode, "curl") == 0)
+    {
+        elapsed = time_ns([] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+    }
+    else if (strcmp(mode, "log") == 0)
+    {
+        // Without a callback this reads AZDCAP_DEBUG_LOG_LEVEL, as the first
+        // log statement in the library does
+        elapsed = time_ns([] { log_level_enabled(SGX_QL_LOG_INFO); });
+    }
+    else if (strcmp(mode, "cache") == 0)
+    {
+        // The first lookup discovers the cache directory, the second doesn't
+        const uint64_t first =
+            time_ns([] { local_cache_get("startup/missing"); });
+        const uint64_t second =
+            time_ns([] { local_cache_get("startup/missing"); });
+        elapsed = first > second ? first - second : 0;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown mode '%s'\n", mode);
+        return 2;
+    }
+
+    printf("%llu\n", static_cast<unsigned long long>(elapsed));
+    return 0;
+}
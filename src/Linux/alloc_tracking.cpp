@@ -0,0 +1,115 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "alloc_tracking.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <new>
+
+//
+// Defining the allocator entry points in the executable interposes them for
+// the whole process, so allocations made by the dlopen'ed provider, libcurl
+// and OpenSSL are seen here too. The default operator new allocates through
+// malloc; it is replaced as well so the count doesn't depend on that.
+// Counters are per thread, so the library's background threads don't show up
+// in a measurement.
+//
+static thread_local bool tracking = false;
+static thread_local allocation_stats tracked = {0, 0};
+
+static inline void track(size_t size)
+{
+    if (tracking)
+    {
+        tracked.count++;
+        tracked.bytes += size;
+    }
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+    track(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    track(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    track(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    track(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == nullptr ? ENOMEM : 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    track(size);
+    return __libc_memalign(alignment, size);
+}
+}
+
+void* operator new(size_t size)
+{
+    track(size);
+    void* ptr = __libc_malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void allocation_tracking_start()
+{
+    tracked = {0, 0};
+    tracking = true;
+}
+
+allocation_stats allocation_tracking_stop()
+{
+    tracking = false;
+    return tracked;
+}
@@ -0,0 +1,167 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "cache_layer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr int64_t DEFAULT_MAX_AGE_SECONDS = 24 * 60 * 60;
+
+//
+// A layer mapped into memory. Mappings stay for the life of the process.
+//
+struct mapped_layer
+{
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+    const cache_layer_header* header = nullptr;
+    const cache_layer_record* records = nullptr;
+};
+
+struct layer_set
+{
+    std::vector<mapped_layer> layers;
+    int64_t max_age = DEFAULT_MAX_AGE_SECONDS;
+};
+
+static bool map_layer(const std::string& path, mapped_layer& layer)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat info{};
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+        static_cast<size_t>(info.st_size) >= sizeof(cache_layer_header))
+    {
+        base = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return false;
+    }
+
+    layer.base = static_cast<const uint8_t*>(base);
+    layer.size = static_cast<size_t>(info.st_size);
+    layer.header = reinterpret_cast<const cache_layer_header*>(layer.base);
+    layer.records = reinterpret_cast<const cache_layer_record*>(
+        layer.base + sizeof(cache_layer_header));
+
+    const size_t records_size =
+        static_cast<size_t>(layer.header->entry_count) * sizeof(cache_layer_record);
+    if (memcmp(layer.header->magic, CACHE_LAYER_MAGIC, sizeof(CACHE_LAYER_MAGIC)) != 0 ||
+        layer.header->version != CACHE_LAYER_VERSION ||
+        records_size > layer.size - sizeof(cache_layer_header))
+    {
+        munmap(base, layer.size);
+        return false;
+    }
+    return true;
+}
+
+static layer_set load_layers()
+{
+    layer_set set;
+    const char* max_age = ::getenv("AZDCAP_CACHE_LAYER_MAX_AGE");
+    if (max_age != nullptr && *max_age != '\0')
+    {
+        set.max_age = strtoll(max_age, nullptr, 10);
+    }
+
+    const char* path = ::getenv("AZDCAP_CACHE_LAYER");
+    if (path == nullptr || *path == '\0')
+    {
+        return set;
+    }
+
+    std::vector<std::string> paths;
+    if (DIR* directory = opendir(path))
+    {
+        while (const dirent* entry = readdir(directory))
+        {
+            if (entry->d_name[0] != '.')
+            {
+                paths.push_back(std::string(path) + "/" + entry->d_name);
+            }
+        }
+        closedir(directory);
+
+        // Consulted in name order, so that the order is up to the image
+        std::sort(paths.begin(), paths.end());
+    }
+    else
+    {
+        paths.push_back(path);
+    }
+
+    for (const std::string& layer_path : paths)
+    {
+        mapped_layer layer;
+        if (map_layer(layer_path, layer))
+        {
+            set.layers.push_back(layer);
+        }
+    }
+    return set;
+}
+
+static const layer_set& get_layers()
+{
+    static const layer_set layers = load_layers();
+    return layers;
+}
+
+static bool key_less(const cache_layer_record& record, const uint8_t* key)
+{
+    return memcmp(record.key, key, CACHE_LAYER_KEY_SIZE) < 0;
+}
+
+std::unique_ptr<std::vector<uint8_t>> cache_layer_get(const std::string& id)
+{
+    const layer_set& set = get_layers();
+    if (set.layers.empty())
+    {
+        return nullptr;
+    }
+
+    uint8_t key[CACHE_LAYER_KEY_SIZE];
+    static_assert(SHA256_DIGEST_LENGTH == CACHE_LAYER_KEY_SIZE, "keys are SHA-256 hashes");
+    SHA256(reinterpret_cast<const unsigned char*>(id.data()), id.size(), key);
+
+    const int64_t now = static_cast<int64_t>(time(nullptr));
+    for (const mapped_layer& layer : set.layers)
+    {
+        if (now - layer.header->build_time > set.max_age)
+        {
+            continue;
+        }
+
+        const cache_layer_record* end = layer.records + layer.header->entry_count;
+        const cache_layer_record* record =
+            std::lower_bound(layer.records, end, key, key_less);
+        if (record == end || memcmp(record->key, key, CACHE_LAYER_KEY_SIZE) != 0 ||
+            record->expiry <= now || record->offset > layer.size ||
+            record->size > layer.size - record->offset)
+        {
+            continue;
+        }
+
+        const uint8_t* data = layer.base + record->offset;
+        return std::make_unique<std::vector<uint8_t>>(data, data + record->size);
+    }
+    return nullptr;
+}
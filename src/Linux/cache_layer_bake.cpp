@@ -0,0 +1,222 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Bakes a local cache directory into a read-only cache layer (see
+// ../cache_layer.h) while building an image:
+//
+//   AZDCAP_CACHE=/build ./my-attestation-warmup
+//   ./az-dcap-bake-layer --cache-dir /build/.az-dcap-client --output collateral.layer
+//
+// and in the image, AZDCAP_CACHE_LAYER=/path/to/collateral.layer. Expired
+// entries are left out. The layer is stamped with the time it is baked
+// unless --build-time is given.
+//
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "cache_layer.h"
+#include "local_cache_entry.h"
+
+namespace
+{
+struct options
+{
+    std::string cache_dir;
+    std::string output;
+    int64_t build_time = 0;
+};
+
+struct baked_entry
+{
+    cache_layer_record record;
+    std::vector<uint8_t> data;
+};
+
+options config;
+
+bool decode_key(const char* name, uint8_t* key)
+{
+    if (strlen(name) != 2 * CACHE_LAYER_KEY_SIZE ||
+        strspn(name, "0123456789abcdef") != 2 * CACHE_LAYER_KEY_SIZE)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < CACHE_LAYER_KEY_SIZE; i++)
+    {
+        key[i] = static_cast<uint8_t>(strtoul(std::string(name + 2 * i, 2).c_str(), nullptr, 16));
+    }
+    return true;
+}
+
+bool read_file(const std::string& path, std::vector<uint8_t>& contents)
+{
+    FILE* input = fopen(path.c_str(), "rb");
+    if (input == nullptr)
+    {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), input)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + read);
+    }
+    const bool ok = ferror(input) == 0;
+    fclose(input);
+    return ok;
+}
+
+bool collect_entries(std::vector<baked_entry>& entries)
+{
+    DIR* directory = opendir(config.cache_dir.c_str());
+    if (directory == nullptr)
+    {
+        perror(config.cache_dir.c_str());
+        return false;
+    }
+
+    const time_t now = time(nullptr);
+    while (const dirent* entry = readdir(directory))
+    {
+        baked_entry baked{};
+        std::vector<uint8_t> contents;
+        if (!decode_key(entry->d_name, baked.record.key) ||
+            !read_file(config.cache_dir + "/" + entry->d_name, contents) ||
+            contents.size() <= sizeof(CacheEntryHeaderV1))
+        {
+            continue;
+        }
+
+        CacheEntryHeaderV1 header;
+        memcpy(&header, contents.data(), sizeof(header));
+        if (header.version != CACHE_V1 || header.expiry <= now)
+        {
+            continue;
+        }
+
+        baked.record.expiry = static_cast<int64_t>(header.expiry);
+        baked.data.assign(contents.begin() + sizeof(header), contents.end());
+        entries.push_back(std::move(baked));
+    }
+    closedir(directory);
+
+    std::sort(entries.begin(), entries.end(), [](const baked_entry& a, const baked_entry& b) {
+        return memcmp(a.record.key, b.record.key, CACHE_LAYER_KEY_SIZE) < 0;
+    });
+    return true;
+}
+
+//
+// Writes the layer next to the output and renames it into place, so that a
+// reader never maps a partial layer.
+//
+bool write_layer(std::vector<baked_entry>& entries, size_t& size)
+{
+    cache_layer_header header{};
+    memcpy(header.magic, CACHE_LAYER_MAGIC, sizeof(header.magic));
+    header.version = CACHE_LAYER_VERSION;
+    header.entry_count = static_cast<uint32_t>(entries.size());
+    header.build_time = config.build_time;
+
+    // Data follows the index, each entry 8 byte aligned
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(cache_layer_record);
+    for (baked_entry& entry : entries)
+    {
+        entry.record.offset = offset;
+        entry.record.size = entry.data.size();
+        offset = (offset + entry.data.size() + 7) & ~uint64_t(7);
+    }
+
+    std::vector<uint8_t> layer(offset, 0);
+    memcpy(layer.data(), &header, sizeof(header));
+    uint8_t* index = layer.data() + sizeof(header);
+    for (const baked_entry& entry : entries)
+    {
+        memcpy(index, &entry.record, sizeof(entry.record));
+        index += sizeof(entry.record);
+        memcpy(layer.data() + entry.record.offset, entry.data.data(), entry.data.size());
+    }
+
+    const std::string temporary = config.output + ".tmp";
+    FILE* output = fopen(temporary.c_str(), "wb");
+    if (output == nullptr)
+    {
+        perror(temporary.c_str());
+        return false;
+    }
+    const bool written = fwrite(layer.data(), 1, layer.size(), output) == layer.size();
+    if (fclose(output) != 0 || !written || rename(temporary.c_str(), config.output.c_str()) != 0)
+    {
+        perror(config.output.c_str());
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    size = layer.size();
+    return true;
+}
+
+void usage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s --cache-dir DIR --output FILE [--build-time SECONDS]\n"
+        "  --cache-dir DIR       local cache directory to bake, e.g. ~/.az-dcap-client\n"
+        "  --output FILE         layer to write\n"
+        "  --build-time SECONDS  timestamp of the layer (default now)\n",
+        program);
+}
+
+bool parse_options(int argc, char** argv)
+{
+    config.build_time = static_cast<int64_t>(time(nullptr));
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        const char* value = argv[i + 1];
+        if (arg == "--cache-dir")
+            config.cache_dir = value;
+        else if (arg == "--output")
+            config.output = value;
+        else if (arg == "--build-time")
+            config.build_time = strtoll(value, nullptr, 10);
+        else
+            return false;
+    }
+    return argc % 2 == 1 && !config.cache_dir.empty() && !config.output.empty();
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<baked_entry> entries;
+    size_t size = 0;
+    if (!collect_entries(entries) || !write_layer(entries, size))
+    {
+        return 1;
+    }
+
+    printf(
+        "Baked %zu entries into %s (%zu bytes)\n",
+        entries.size(),
+        config.output.c_str(),
+        size);
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "command_line.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+bool parse_command_line(
+    int argc,
+    char** argv,
+    std::initializer_list<command_line_flag> flags,
+    std::initializer_list<command_line_option> options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const command_line_flag* flag = nullptr;
+        for (const command_line_flag& candidate : flags)
+        {
+            if (strcmp(arg, candidate.name) == 0)
+            {
+                flag = &candidate;
+            }
+        }
+        if (flag != nullptr)
+        {
+            *flag->value = true;
+            continue;
+        }
+
+        const command_line_option* option = nullptr;
+        for (const command_line_option& candidate : options)
+        {
+            if (strcmp(arg, candidate.name) == 0)
+            {
+                option = &candidate;
+            }
+        }
+        if (option == nullptr || i + 1 >= argc)
+        {
+            return false;
+        }
+        option->set(argv[++i]);
+    }
+    return true;
+}
+
+bool start_daemon()
+{
+    const pid_t child = fork();
+    if (child < 0)
+    {
+        perror("fork");
+        return false;
+    }
+    if (child > 0)
+    {
+        printf("%d\n", static_cast<int>(child));
+        fflush(stdout);
+        exit(0);
+    }
+
+    setsid();
+    if (freopen("/dev/null", "w", stdout) == nullptr)
+    {
+        perror("/dev/null");
+        return false;
+    }
+    return true;
+}
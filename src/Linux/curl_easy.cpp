@@ -6,10 +6,18 @@
 
 #include "curl_easy.h"
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <limits>
 #include <locale>
+#include <mutex>
+#include <thread>
+#include <strings.h>
+#include "fault_injection.h"
+#include "http_fixtures.h"
 #include "private.h"
+#include "probes.h"
+#include "sidecar.h"
 
 #ifdef __LINUX__
 #include <openssl/err.h>
@@ -48,6 +56,26 @@ static bool is_http_version(const char* buffer, size_t buffer_size)
            0 == memcmp(buffer, HTTP_VERSION, sizeof(HTTP_VERSION) - 1);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Connection sharing, see curl_easy::share_connections
+///////////////////////////////////////////////////////////////////////////////
+static CURLSH* shared_connections = nullptr;
+static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+// See curl_easy::restrict_protocols
+static bool protocols_restricted = false;
+static bool http_allowed = false;
+
+static void lock_share(CURL*, curl_lock_data data, curl_lock_access, void*)
+{
+    share_locks[data].lock();
+}
+
+static void unlock_share(CURL*, curl_lock_data data, void*)
+{
+    share_locks[data].unlock();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // curl_easy::Error implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -82,6 +110,7 @@ std::unique_ptr<curl_easy> curl_easy::create(const std::string& url, const std::
         throw std::bad_alloc();
     }
 
+    easy->url = url;
     easy->set_opt_or_throw(CURLOPT_URL, url.c_str());
     easy->set_opt_or_throw(CURLOPT_WRITEFUNCTION, &write_callback);
     easy->set_opt_or_throw(CURLOPT_WRITEDATA, easy.get());
@@ -89,9 +118,26 @@ std::unique_ptr<curl_easy> curl_easy::create(const std::string& url, const std::
     easy->set_opt_or_throw(CURLOPT_HEADERDATA, easy.get());
     easy->set_opt_or_throw(CURLOPT_FAILONERROR, 1L);
     easy->set_opt_or_throw(CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
+    if (shared_connections != nullptr)
+    {
+        easy->set_opt_or_throw(CURLOPT_SHARE, shared_connections);
+    }
+    if (protocols_restricted)
+    {
+#if LIBCURL_VERSION_NUM >= 0x075500
+        const char* protocols = http_allowed ? "http,https" : "https";
+        easy->set_opt_or_throw(CURLOPT_PROTOCOLS_STR, protocols);
+        easy->set_opt_or_throw(CURLOPT_REDIR_PROTOCOLS_STR, protocols);
+#else
+        const long protocols = http_allowed ? CURLPROTO_HTTP | CURLPROTO_HTTPS : CURLPROTO_HTTPS;
+        easy->set_opt_or_throw(CURLOPT_PROTOCOLS, protocols);
+        easy->set_opt_or_throw(CURLOPT_REDIR_PROTOCOLS, protocols);
+#endif
+    }
 
     if (p_body != nullptr && !p_body->empty())
     {
+        easy->request_body = *p_body;
         easy->set_opt_or_throw(CURLOPT_CUSTOMREQUEST, "GET");
         easy->set_opt_or_throw(CURLOPT_COPYPOSTFIELDS, p_body->c_str());
     }
@@ -121,23 +167,262 @@ std::unique_ptr<curl_easy> curl_easy::create(const std::string& url, const std::
     return easy;
 }
 
+void curl_easy::share_connections()
+{
+    if (shared_connections != nullptr)
+    {
+        return;
+    }
+
+    CURLSH* share = curl_share_init();
+    if (share == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &lock_share);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &unlock_share);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    shared_connections = share;
+}
+
+void curl_easy::restrict_protocols(bool allow_http)
+{
+    protocols_restricted = true;
+    http_allowed = allow_http;
+}
+
 curl_easy::~curl_easy()
 {
     curl_easy_cleanup(handle);
+    curl_slist_free_all(request_headers);
+}
+
+//
+// Duration between two cumulative CURLINFO_*_TIME_T values. Phases which did
+// not happen (e.g. DNS on a reused connection) report zero.
+//
+static int64_t phase_duration(curl_off_t end, curl_off_t start)
+{
+    return end > start ? static_cast<int64_t>(end - start) : 0;
+}
+
+void curl_easy::collect_timings() const
+{
+    curl_off_t name_lookup = 0;
+    curl_off_t connect = 0;
+    curl_off_t app_connect = 0;
+    curl_off_t start_transfer = 0;
+    curl_off_t total = 0;
+    curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+
+    curl_off_t size_download = 0;
+    long new_connects = 0;
+    long http_status = 0;
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &size_download);
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &new_connects);
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_status);
+
+    const curl_off_t request_sent = app_connect > 0 ? app_connect : connect;
+    timings.name_lookup = phase_duration(name_lookup, 0);
+    timings.connect = phase_duration(connect, name_lookup);
+    timings.tls_handshake =
+        app_connect > 0 ? phase_duration(app_connect, connect) : 0;
+    timings.time_to_first_byte = phase_duration(start_transfer, request_sent);
+    timings.transfer = phase_duration(total, start_transfer);
+    timings.total = phase_duration(total, 0);
+    timings.bytes_downloaded =
+        size_download > 0 ? static_cast<uint64_t>(size_download) : 0;
+
+    // A transfer which got as far as sending the request without opening a
+    // connection went out over one that was already open
+    timings.connection_reused = new_connects == 0 && start_transfer > 0;
+    timings.http_status = http_status;
+}
+
+//
+// Answers the request from its recorded fixture the way curl_easy_perform
+// would have, CURLOPT_FAILONERROR included.
+//
+CURLcode curl_easy::replay() const
+{
+    timings = fetch_timings();
+    http_fixture fixture;
+    if (!http_fixture_load(url, request_body, fixture))
+    {
+        LOG_ERROR("No recorded response for '%s'", url.c_str());
+        return CURLE_COULDNT_CONNECT;
+    }
+
+    const std::chrono::microseconds delay = http_fixture_replay_delay(fixture);
+    if (delay.count() > 0)
+    {
+        std::this_thread::sleep_for(delay);
+    }
+
+    timings.time_to_first_byte = delay.count();
+    timings.total = delay.count();
+    timings.http_status = fixture.status;
+    headers = std::move(fixture.headers);
+    if (fixture.status >= 400)
+    {
+        return CURLE_HTTP_RETURNED_ERROR;
+    }
+
+    timings.bytes_downloaded = fixture.body.size();
+    body.insert(body.end(), fixture.body.begin(), fixture.body.end());
+    return CURLE_OK;
+}
+
+void curl_easy::record() const
+{
+    // Nothing to replay if the service never answered
+    if (timings.http_status == 0)
+    {
+        return;
+    }
+
+    http_fixture fixture;
+    fixture.status = timings.http_status;
+    fixture.headers = headers;
+    fixture.body = body;
+    fixture.latency_us = timings.total;
+    http_fixture_save(url, request_body, fixture);
+}
+
+bool curl_easy::fetch_from_sidecar(CURLcode& result) const
+{
+    const auto start = std::chrono::steady_clock::now();
+    sidecar_response response;
+    sidecar_request request;
+    request.max_age = cache_max_age;
+    request.url = url;
+    request.body = request_body;
+    request.headers = request_header_values;
+    if (!sidecar_fetch(std::move(request), response))
+    {
+        return false;
+    }
+
+    // The upstream phases happened in the daemon, if at all
+    timings = fetch_timings();
+    timings.total = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    timings.time_to_first_byte = timings.total;
+    timings.connection_reused = true;
+    timings.http_status = response.http_status;
+    timings.bytes_downloaded = response.body.size();
+    headers = std::move(response.headers);
+    body.insert(body.end(), response.body.begin(), response.body.end());
+    result = static_cast<CURLcode>(response.curl_code);
+    LOG_INFO(
+        "Fetched '%s' through the sidecar (%s)",
+        url.c_str(),
+        response.cache_hit ? "cached" : "fetched");
+    return true;
+}
+
+//
+// The transfer itself: over the network, through the sidecar when one is
+// listening, or from the recorded fixtures in replay mode.
+//
+CURLcode curl_easy::transfer() const
+{
+    const http_fixture_mode fixture_mode = http_fixture_get_mode();
+    if (fixture_mode == http_fixture_mode::replay)
+    {
+        return replay();
+    }
+
+    CURLcode result;
+    if (!fetch_from_sidecar(result))
+    {
+        result = curl_easy_perform(handle);
+        collect_timings();
+    }
+    if (fixture_mode == http_fixture_mode::record)
+    {
+        record();
+    }
+    return result;
+}
+
+//
+// transfer() with the faults from AZDCAP_FAULT_INJECTION applied, see
+// fault_injection.h. Injected failures never reach the transport.
+//
+CURLcode curl_easy::transfer_with_faults(const fault_plan& faults) const
+{
+    if (faults.delay.count() > 0)
+    {
+        std::this_thread::sleep_for(faults.delay);
+    }
+
+    CURLcode result;
+    if (faults.curl_error != 0)
+    {
+        LOG_INFO("Injecting CURL error %d for '%s'", faults.curl_error, url.c_str());
+        timings = fetch_timings();
+        result = static_cast<CURLcode>(faults.curl_error);
+    }
+    else if (faults.http_status != 0)
+    {
+        LOG_INFO("Injecting HTTP status %ld for '%s'", faults.http_status, url.c_str());
+        timings = fetch_timings();
+        timings.http_status = faults.http_status;
+        result = CURLE_HTTP_RETURNED_ERROR;
+    }
+    else
+    {
+        result = transfer();
+        if (faults.truncate && body.size() > faults.truncate_size)
+        {
+            body.resize(faults.truncate_size);
+            timings.bytes_downloaded = body.size();
+        }
+        for (const std::string& name : faults.dropped_headers)
+        {
+            for (auto header = headers.begin(); header != headers.end();)
+            {
+                header = strcasecmp(header->first.c_str(), name.c_str()) == 0
+                             ? headers.erase(header)
+                             : std::next(header);
+            }
+        }
+    }
+
+    timings.time_to_first_byte += faults.delay.count();
+    timings.total += faults.delay.count();
+    return result;
 }
 
 void curl_easy::perform() const
 {
-    CURLcode result = curl_easy_perform(handle);
+    AZDCAP_PROBE1(perform__start, handle);
+    fault_plan faults;
+    const CURLcode result = fault_injection_plan(url, faults)
+                                ? transfer_with_faults(faults)
+                                : transfer();
+    AZDCAP_PROBE3(
+        perform__end, handle, static_cast<int>(result), timings.http_status);
     if (result == CURLE_HTTP_RETURNED_ERROR)
     {
-        long http_code = 0;
-        curl_easy_getinfo (handle, CURLINFO_RESPONSE_CODE, &http_code);
-        log(SGX_QL_LOG_ERROR, "HTTP error (%zd)", http_code);
+        LOG_ERROR("HTTP error (%ld)", timings.http_status);
     }
     throw_on_error(result, "curl_easy_perform");
 }
 
+const fetch_timings& curl_easy::get_timings() const
+{
+    return timings;
+}
+
 const std::vector<uint8_t>& curl_easy::get_body() const
 {
     return body;
@@ -150,6 +435,11 @@ const std::string* curl_easy::get_header(const std::string& field_name) const
     return field_iter == headers.end() ? nullptr : &field_iter->second;
 }
 
+const std::map<std::string, std::string>& curl_easy::get_headers() const
+{
+    return headers;
+}
+
 void curl_easy::set_headers(const std::map<std::string, std::string>& header_name_values)
 {
     struct curl_slist *headers = NULL;
@@ -159,6 +449,16 @@ void curl_easy::set_headers(const std::map<std::string, std::string>& header_nam
         headers = curl_slist_append(headers, header.c_str());
     }
     set_opt_or_throw(CURLOPT_HTTPHEADER, headers);
+
+    // CURL does not copy the list, so it has to live as long as the handle
+    curl_slist_free_all(request_headers);
+    request_headers = headers;
+    request_header_values = header_name_values;
+}
+
+void curl_easy::set_cache_max_age(int64_t seconds)
+{
+    cache_max_age = seconds;
 }
 
 std::string curl_easy::unescape(const std::string& encoded) const
@@ -198,7 +498,7 @@ size_t curl_easy::write_callback(
     // CURL_MAX_WRITE_SIZE.
     if (size > CURL_MAX_WRITE_SIZE || nmemb > CURL_MAX_WRITE_SIZE)
     {
-        log(SGX_QL_LOG_ERROR, "Write callback buffer size is too large");
+        LOG_ERROR("Write callback buffer size is too large");
         return 0;
     }
 
@@ -231,7 +531,7 @@ size_t curl_easy::header_callback(
     // CURL_MAX_WRITE_SIZE.
     if (size > CURL_MAX_HTTP_HEADER || nitems > CURL_MAX_HTTP_HEADER)
     {
-        log(SGX_QL_LOG_ERROR, "Header callback buffer size is too large");
+        LOG_ERROR("Header callback buffer size is too large");
         return 0;
     }
 
@@ -241,7 +541,7 @@ size_t curl_easy::header_callback(
     if (buffer_size < 2 || buffer[buffer_size - 1] != '\n' ||
         buffer[buffer_size - 2] != '\r')
     {
-        log(SGX_QL_LOG_ERROR, "Header data not properly terminated with CRLF.");
+        LOG_ERROR("Header data not properly terminated with CRLF.");
         return 0;
     }
 
@@ -278,7 +578,7 @@ size_t curl_easy::header_callback(
 
     if (content_start_index >= buffer_size)
     {
-        log(SGX_QL_LOG_ERROR, "Header is empty.");
+        LOG_ERROR("Header is empty.");
         return 0;
     }
 
@@ -292,7 +592,7 @@ size_t curl_easy::header_callback(
 
     if (content_end_index <= content_start_index)
     {
-        log(SGX_QL_LOG_ERROR, "Header delimiter is missing.");
+        LOG_ERROR("Header delimiter is missing.");
         return 0;
     }
 
@@ -310,7 +610,7 @@ void curl_easy::throw_on_error(CURLcode code, const char* function)
 {
     if (code != CURLE_OK)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Encountered CURL error %d in %s",
             code,
             function);
@@ -14,6 +14,9 @@
 #include <string>
 #include <vector>
 #include <curl/curl.h>
+#include "telemetry.h"
+
+struct fault_plan;
 
 //
 // RAII wrapper around Curl to make resource management exception-safe. This
@@ -38,6 +41,15 @@ class curl_easy
 
     static std::unique_ptr<curl_easy> create(const std::string& url, const std::string* const p_body);
 
+    // Lets the handles created afterwards share connections, DNS lookups and
+    // TLS sessions, for the long running sidecar (see ../sidecar.h).
+    static void share_connections();
+
+    // Limits the handles created afterwards, redirects included, to HTTPS,
+    // and to plain HTTP as well if 'allow_http'. For the sidecar, which must
+    // not fetch anything else on behalf of its clients.
+    static void restrict_protocols(bool allow_http);
+
     ~curl_easy();
 
     curl_easy(curl_easy&) = delete;
@@ -47,14 +59,26 @@ class curl_easy
 
     void perform() const;
 
+    // Phase durations of the most recent perform(), successful or not.
+    const fetch_timings& get_timings() const;
+
     const std::vector<uint8_t>& get_body() const;
 
     const std::string* get_header(const std::string& field_name) const;
+    const std::map<std::string, std::string>& get_headers() const;
 
     void set_headers(const std::map<std::string, std::string>& header_name_values);
 
+    // How long the caller is going to cache the response for, so that the
+    // sidecar keeps it no longer.
+    void set_cache_max_age(int64_t seconds);
+
     std::string unescape(const std::string& encoded) const;
     static std::string escape(const char *buffer, int len);
+
+    // Lets the microbenchmarks in ../Benchmarks call the CURL callbacks.
+    friend struct curl_easy_bench;
+
   private:
     curl_easy() = default;
 
@@ -86,6 +110,20 @@ class curl_easy
 
     static void throw_on_error(CURLcode code, const char* function);
 
+    void collect_timings() const;
+
+    // Stand-ins for curl_easy_perform in AZDCAP_HTTP_MODE=replay and record,
+    // see http_fixtures.h
+    CURLcode replay() const;
+    void record() const;
+
+    // Stand-in for curl_easy_perform when a sidecar is listening. Returns
+    // false if it did not answer.
+    bool fetch_from_sidecar(CURLcode& result) const;
+
+    CURLcode transfer() const;
+    CURLcode transfer_with_faults(const fault_plan& faults) const;
+
     // Wraps curl_easy_setopt operations which are not ever supposed to fail.
     template <typename T>
     void set_opt_or_throw(CURLoption option, T param)
@@ -100,8 +138,16 @@ class curl_easy
     }
 
     CURL* handle = nullptr;
-    std::vector<uint8_t> body;
-    std::map<std::string, std::string> headers;
+    curl_slist* request_headers = nullptr;
+    std::map<std::string, std::string> request_header_values;
+    int64_t cache_max_age = 0;
+    std::string url;
+    std::string request_body;
+
+    // The response, filled in by perform()
+    mutable std::vector<uint8_t> body;
+    mutable std::map<std::string, std::string> headers;
+    mutable fetch_timings timings;
 };
 
 #endif
@@ -0,0 +1,205 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "fault_injection.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include <fnmatch.h>
+
+#include "environment.h"
+#include "private.h"
+
+struct fault_rule
+{
+    std::string pattern;
+    double rate = 1.0;
+    unsigned latency_ms = 0;
+    unsigned jitter_ms = 0;
+    int curl_error = 0;
+    long http_status = 0;
+    bool truncate = false;
+    size_t truncate_size = 0;
+    std::vector<std::string> dropped_headers;
+};
+
+struct fault_config
+{
+    std::vector<fault_rule> rules;
+    bool seeded = false;
+    uint64_t seed = 0;
+};
+
+static std::vector<std::string> split(const std::string& text, char separator)
+{
+    std::vector<std::string> parts;
+    std::istringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, separator))
+    {
+        if (!part.empty())
+        {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+static bool parse_rule(const std::string& text, fault_rule& rule)
+{
+    const std::vector<std::string> fields = split(text, ',');
+    if (fields.empty())
+    {
+        return false;
+    }
+
+    rule.pattern = fields[0];
+    for (size_t i = 1; i < fields.size(); i++)
+    {
+        const size_t equals = fields[i].find('=');
+        if (equals == std::string::npos)
+        {
+            return false;
+        }
+        const std::string key = fields[i].substr(0, equals);
+        const std::string value = fields[i].substr(equals + 1);
+        const char* number = value.c_str();
+
+        if (key == "latency_ms")
+            rule.latency_ms = static_cast<unsigned>(strtoul(number, nullptr, 10));
+        else if (key == "jitter_ms")
+            rule.jitter_ms = static_cast<unsigned>(strtoul(number, nullptr, 10));
+        else if (key == "curl_error")
+            rule.curl_error = static_cast<int>(strtol(number, nullptr, 10));
+        else if (key == "status")
+        {
+            // Only error statuses fail a request under CURLOPT_FAILONERROR
+            rule.http_status = strtol(number, nullptr, 10);
+            if (rule.http_status < 400)
+            {
+                return false;
+            }
+        }
+        else if (key == "truncate")
+        {
+            rule.truncate = true;
+            rule.truncate_size = strtoull(number, nullptr, 10);
+        }
+        else if (key == "drop_header")
+            rule.dropped_headers.push_back(value);
+        else if (key == "rate")
+        {
+            char* end = nullptr;
+            rule.rate = strtod(number, &end);
+            if (end == number || !(rule.rate >= 0.0 && rule.rate <= 1.0))
+            {
+                return false;
+            }
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+static fault_config read_config()
+{
+    fault_config config;
+    const std::string rules =
+        get_env_variable_no_log(ENV_AZDCAP_FAULT_INJECTION).first;
+    for (const std::string& text : split(rules, ';'))
+    {
+        fault_rule rule;
+        if (!parse_rule(text, rule))
+        {
+            LOG_ERROR("Ignoring malformed fault injection rule '%s'", text.c_str());
+            continue;
+        }
+        config.rules.push_back(rule);
+    }
+
+    const std::string seed =
+        get_env_variable_no_log(ENV_AZDCAP_FAULT_INJECTION_SEED).first;
+    if (!seed.empty())
+    {
+        config.seeded = true;
+        config.seed = strtoull(seed.c_str(), nullptr, 10);
+    }
+
+    if (!config.rules.empty())
+    {
+        LOG_WARNING(
+            "Fault injection is enabled with %zu rule(s)", config.rules.size());
+    }
+    return config;
+}
+
+static const fault_config& get_config()
+{
+    static const fault_config config = read_config();
+    return config;
+}
+
+//
+// Per thread generator. With a seed, each thread gets its own repeatable
+// sequence in the order the threads first inject a fault.
+//
+static std::mt19937_64& get_generator()
+{
+    static std::atomic<uint64_t> thread_count(0);
+    thread_local std::mt19937_64 generator(
+        get_config().seeded ? get_config().seed + thread_count++
+                            : std::random_device()());
+    return generator;
+}
+
+bool fault_injection_plan(const std::string& url, fault_plan& plan)
+{
+    const fault_config& config = get_config();
+    if (config.rules.empty())
+    {
+        return false;
+    }
+
+    bool matched = false;
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    for (const fault_rule& rule : config.rules)
+    {
+        if (fnmatch(rule.pattern.c_str(), url.c_str(), 0) != 0 ||
+            (rule.rate < 1.0 && chance(get_generator()) >= rule.rate))
+        {
+            continue;
+        }
+
+        matched = true;
+        unsigned delay_ms = rule.latency_ms;
+        if (rule.jitter_ms > 0)
+        {
+            delay_ms += std::uniform_int_distribution<unsigned>(
+                0, rule.jitter_ms)(get_generator());
+        }
+        plan.delay += std::chrono::milliseconds(delay_ms);
+        if (rule.curl_error != 0)
+        {
+            plan.curl_error = rule.curl_error;
+        }
+        if (rule.http_status != 0)
+        {
+            plan.http_status = rule.http_status;
+        }
+        if (rule.truncate)
+        {
+            plan.truncate = true;
+            plan.truncate_size = rule.truncate_size;
+        }
+        plan.dropped_headers.insert(
+            plan.dropped_headers.end(),
+            rule.dropped_headers.begin(),
+            rule.dropped_headers.end());
+    }
+    return matched;
+}
@@ -0,0 +1,276 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "http_fixtures.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#include "environment.h"
+#include "private.h"
+
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// Fixture files hold a text preamble followed by the raw body:
+//
+//   AZDCAP-HTTP-FIXTURE 1
+//   url: <url>
+//   status: <HTTP status>
+//   latency-us: <duration of the recorded request>
+//   header: <name>: <value>      (once per response header)
+//   body-size: <bytes>
+//   <body>
+//
+static constexpr char FIXTURE_MAGIC[] = "AZDCAP-HTTP-FIXTURE 1";
+
+enum class replay_latency
+{
+    none,
+    recorded,
+    fixed
+};
+
+struct fixture_config
+{
+    http_fixture_mode mode = http_fixture_mode::off;
+    std::string directory;
+    replay_latency latency = replay_latency::none;
+    std::chrono::microseconds fixed_latency{0};
+};
+
+static fixture_config read_config()
+{
+    fixture_config config;
+    const std::string mode = get_env_variable_no_log(ENV_AZDCAP_HTTP_MODE).first;
+    if (mode.empty())
+    {
+        return config;
+    }
+
+    config.directory =
+        get_env_variable_no_log(ENV_AZDCAP_HTTP_FIXTURE_DIR).first;
+    if (config.directory.empty())
+    {
+        LOG_ERROR(
+            "%s is set but %s is not, ignoring it",
+            ENV_AZDCAP_HTTP_MODE,
+            ENV_AZDCAP_HTTP_FIXTURE_DIR);
+        return config;
+    }
+
+    if (mode == "record")
+    {
+        config.mode = http_fixture_mode::record;
+        if (mkdir(config.directory.c_str(), 0700) != 0 && errno != EEXIST)
+        {
+            LOG_ERROR(
+                "Unable to create fixture directory '%s', errno %d",
+                config.directory.c_str(),
+                errno);
+        }
+    }
+    else if (mode == "replay")
+    {
+        config.mode = http_fixture_mode::replay;
+    }
+    else
+    {
+        LOG_ERROR(
+            "Unknown %s '%s', expected 'record' or 'replay'",
+            ENV_AZDCAP_HTTP_MODE,
+            mode.c_str());
+        return config;
+    }
+
+    const std::string latency =
+        get_env_variable_no_log(ENV_AZDCAP_HTTP_REPLAY_LATENCY).first;
+    if (latency == "recorded")
+    {
+        config.latency = replay_latency::recorded;
+    }
+    else if (!latency.empty())
+    {
+        config.latency = replay_latency::fixed;
+        config.fixed_latency = std::chrono::milliseconds(
+            strtoul(latency.c_str(), nullptr, 10));
+    }
+
+    LOG_INFO(
+        "HTTP %s mode, fixtures in '%s'",
+        mode.c_str(),
+        config.directory.c_str());
+    return config;
+}
+
+static const fixture_config& get_config()
+{
+    static const fixture_config config = read_config();
+    return config;
+}
+
+static std::string get_fixture_path(
+    const std::string& url,
+    const std::string& request_body)
+{
+    const std::string key = url + '\n' + request_body;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(key.data()), key.size(), hash);
+
+    std::string path = get_config().directory + "/";
+    path.reserve(path.size() + 2 * sizeof(hash));
+    for (size_t i = 0; i < sizeof(hash); i++)
+    {
+        char buf[3];
+        snprintf(buf, sizeof(buf), "%02x", hash[i]);
+        path += buf;
+    }
+    return path;
+}
+
+http_fixture_mode http_fixture_get_mode()
+{
+    return get_config().mode;
+}
+
+//
+// Read one preamble line without its newline. Returns false at end of file.
+//
+static bool read_line(FILE* file, std::string& line)
+{
+    line.clear();
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n')
+    {
+        line += static_cast<char>(c);
+    }
+    return c != EOF;
+}
+
+static bool starts_with(const std::string& line, const char* prefix)
+{
+    return line.compare(0, strlen(prefix), prefix) == 0;
+}
+
+bool http_fixture_load(
+    const std::string& url,
+    const std::string& request_body,
+    http_fixture& fixture)
+{
+    const std::string path = get_fixture_path(url, request_body);
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    bool loaded = false;
+    std::string line;
+    if (read_line(file, line) && line == FIXTURE_MAGIC)
+    {
+        fixture = http_fixture();
+        while (read_line(file, line))
+        {
+            if (starts_with(line, "url: "))
+            {
+                if (line.compare(5, std::string::npos, url) != 0)
+                {
+                    break;
+                }
+            }
+            else if (starts_with(line, "status: "))
+            {
+                fixture.status = strtol(line.c_str() + 8, nullptr, 10);
+            }
+            else if (starts_with(line, "latency-us: "))
+            {
+                fixture.latency_us = strtoll(line.c_str() + 12, nullptr, 10);
+            }
+            else if (starts_with(line, "header: "))
+            {
+                const size_t separator = line.find(": ", 8);
+                if (separator != std::string::npos)
+                {
+                    fixture.headers[line.substr(8, separator - 8)] =
+                        line.substr(separator + 2);
+                }
+            }
+            else if (starts_with(line, "body-size: "))
+            {
+                const size_t size = strtoull(line.c_str() + 11, nullptr, 10);
+                fixture.body.resize(size);
+                loaded = size == 0 ||
+                         fread(fixture.body.data(), 1, size, file) == size;
+                break;
+            }
+        }
+    }
+    fclose(file);
+
+    if (!loaded)
+    {
+        LOG_ERROR("Ignoring malformed fixture '%s'", path.c_str());
+    }
+    return loaded;
+}
+
+void http_fixture_save(
+    const std::string& url,
+    const std::string& request_body,
+    const http_fixture& fixture)
+{
+    // Written under a unique name and renamed into place, so that concurrent
+    // recordings of the same request never leave a torn file behind
+    const std::string path = get_fixture_path(url, request_body);
+    const std::string temp_path = path + ".tmp." + std::to_string(getpid()) +
+                                  "." +
+                                  std::to_string(std::hash<std::thread::id>()(
+                                      std::this_thread::get_id()));
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        LOG_ERROR(
+            "Unable to record fixture '%s', errno %d", path.c_str(), errno);
+        return;
+    }
+
+    fprintf(file, "%s\n", FIXTURE_MAGIC);
+    fprintf(file, "url: %s\n", url.c_str());
+    fprintf(file, "status: %ld\n", fixture.status);
+    fprintf(file, "latency-us: %lld\n", static_cast<long long>(fixture.latency_us));
+    for (const auto& header : fixture.headers)
+    {
+        fprintf(file, "header: %s: %s\n", header.first.c_str(), header.second.c_str());
+    }
+    fprintf(file, "body-size: %zu\n", fixture.body.size());
+    fwrite(fixture.body.data(), 1, fixture.body.size(), file);
+
+    const bool written = ferror(file) == 0;
+    if (fclose(file) != 0 || !written ||
+        rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        LOG_ERROR(
+            "Unable to record fixture '%s', errno %d", path.c_str(), errno);
+        remove(temp_path.c_str());
+    }
+}
+
+std::chrono::microseconds http_fixture_replay_delay(const http_fixture& fixture)
+{
+    switch (get_config().latency)
+    {
+        case replay_latency::recorded:
+            return std::chrono::microseconds(fixture.latency_us);
+        case replay_latency::fixed:
+            return get_config().fixed_latency;
+        case replay_latency::none:
+            break;
+    }
+    return std::chrono::microseconds(0);
+}
@@ -2,11 +2,18 @@
 // Licensed under the MIT License.
 
 #include "local_cache.h"
+#include "local_cache_entry.h"
+#include "probes.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <thread>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <ftw.h>
 #include <locale.h>
@@ -17,13 +24,93 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-constexpr uint16_t CACHE_V1 = 1;
-
 constexpr locale_t NULL_LOCALE = reinterpret_cast<locale_t>(0);
 
 static std::string g_cache_dirname = "";
 static std::mutex cache_directory_lock;
 
+// With AZDCAP_CACHE_POLICY=memory, the on-disk copy of the tmpfs cache in
+// g_cache_dirname. Empty otherwise.
+static std::string g_persistent_dirname = "";
+
+//
+// While no cache directory could be created the cache is disabled, and
+// creating one is not attempted again before next_init_attempt. The delay
+// doubles with each failed attempt.
+//
+static constexpr std::chrono::seconds INIT_RETRY_MIN(1);
+static constexpr std::chrono::seconds INIT_RETRY_MAX(60);
+static std::chrono::seconds init_retry_delay(0);
+static std::chrono::steady_clock::time_point next_init_attempt;
+
+//
+// Contention counters for each local_cache_lock. Uncontended acquisitions
+// only bump 'acquisitions'; the clock is read only when a lock has to be
+// waited for.
+//
+struct lock_counters
+{
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> total_wait_ns{0};
+    std::atomic<uint64_t> max_wait_ns{0};
+};
+
+static lock_counters lock_stats[static_cast<size_t>(local_cache_lock::count)];
+
+static lock_counters& get_lock_counters(local_cache_lock lock)
+{
+    return lock_stats[static_cast<size_t>(lock)];
+}
+
+static void record_lock_wait(
+    local_cache_lock lock,
+    std::chrono::steady_clock::time_point wait_start)
+{
+    const uint64_t wait_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - wait_start)
+            .count());
+
+    lock_counters& counters = get_lock_counters(lock);
+    counters.contended.fetch_add(1, std::memory_order_relaxed);
+    counters.total_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+
+    uint64_t max_wait_ns = counters.max_wait_ns.load(std::memory_order_relaxed);
+    while (wait_ns > max_wait_ns &&
+           !counters.max_wait_ns.compare_exchange_weak(
+               max_wait_ns, wait_ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+//
+// std::lock_guard for cache_directory_lock which records contention.
+//
+class directory_lock_guard
+{
+  public:
+    directory_lock_guard()
+    {
+        if (!cache_directory_lock.try_lock())
+        {
+            const auto wait_start = std::chrono::steady_clock::now();
+            cache_directory_lock.lock();
+            record_lock_wait(local_cache_lock::directory, wait_start);
+        }
+        get_lock_counters(local_cache_lock::directory)
+            .acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~directory_lock_guard()
+    {
+        cache_directory_lock.unlock();
+    }
+
+    directory_lock_guard(const directory_lock_guard&) = delete;
+    directory_lock_guard& operator=(const directory_lock_guard&) = delete;
+};
+
 static constexpr size_t CACHE_LOCATIONS = 5;
 static const char *cache_locations[CACHE_LOCATIONS];
 
@@ -57,15 +144,6 @@ static void throw_errno(const std::string& description)
     throw_errno(description, errno);
 }
 
-//
-// Represents an entry in our filesystem cache.
-//
-struct __attribute__ ((__packed__)) CacheEntryHeaderV1
-{
-    uint16_t version;   // The version of the cache header
-    time_t expiry;      // expiration time of this cache item
-};
-
 //
 // Helper class, similar to std::fstream, which also includes file locking.
 //
@@ -98,7 +176,26 @@ public:
         if (this->fd != -1)
         {
             const int lock_op = (flags & (O_WRONLY | O_RDWR)) ? LOCK_EX : LOCK_SH;
-            RETRY_ON_EINTR(::flock(this->fd, lock_op), "flock");
+            const local_cache_lock lock = lock_op == LOCK_EX
+                                              ? local_cache_lock::file_exclusive
+                                              : local_cache_lock::file_shared;
+            AZDCAP_PROBE2(flock__wait__start, this->fd, lock_op);
+            if (::flock(this->fd, lock_op | LOCK_NB) != 0)
+            {
+                const bool contended = errno == EWOULDBLOCK;
+                const auto wait_start = std::chrono::steady_clock::now();
+                RETRY_ON_EINTR(::flock(this->fd, lock_op), "flock");
+                if (contended)
+                {
+                    record_lock_wait(lock, wait_start);
+                }
+            }
+            if (!this->has_failed)
+            {
+                get_lock_counters(lock).acquisitions.fetch_add(
+                    1, std::memory_order_relaxed);
+            }
+            AZDCAP_PROBE2(flock__wait__end, this->fd, lock_op);
         }
     }
 
@@ -195,46 +292,235 @@ static void load_cache_locations()
     cache_locations[4] = "/tmp/";
 }
 
-static void init_callback()
+//
+// Where AZDCAP_CACHE_POLICY asks for the cache to be kept:
+//   disk         the first usable of cache_locations (the default)
+//   memory       a tmpfs location, with a copy on disk which a cache emptied
+//                by a reboot is refilled from
+//   memory-only  a tmpfs location, without a copy
+// Both memory policies fall back to disk when no tmpfs location is usable.
+//
+enum class cache_policy
+{
+    disk,
+    memory,
+    memory_only
+};
+
+static cache_policy get_cache_policy()
+{
+    const char* policy = ::getenv("AZDCAP_CACHE_POLICY");
+    if (policy != nullptr && strcmp(policy, "memory") == 0)
+    {
+        return cache_policy::memory;
+    }
+    if (policy != nullptr && strcmp(policy, "memory-only") == 0)
+    {
+        return cache_policy::memory_only;
+    }
+    return cache_policy::disk;
+}
+
+//
+// The cache directory in the first of cache_locations which is set, created
+// if needed. Throws if it cannot be.
+//
+static std::string find_disk_location()
 {
-    load_cache_locations();
     const std::string application_name("/.az-dcap-client/");
-    std::string dirname;
-    std::string all_locations;
 
     // Try the cache locations in order
     for (auto &cache_location : cache_locations)
     {
         if (cache_location != 0 && strcmp(cache_location, "") != 0)
         {
-            dirname = cache_location + application_name;
+            const std::string dirname = cache_location + application_name;
             make_dir(dirname, 0777);
-            g_cache_dirname = dirname;
-            return;
+            return dirname;
+        }
+    }
+
+    throw std::runtime_error("No cache location was found. Please define one of the following environment variables to enable caching: AZDCAP_CACHE,XDG_CACHE_HOME,HOME,TMPDIR");
+}
+
+//
+// Creates 'dirname' for our use only. As /dev/shm is shared by all users, an
+// existing one is used only if it is a directory (not a link to one) which
+// we own and nobody else can write to.
+//
+static bool make_private_dir(const std::string& dirname)
+{
+    if (mkdir(dirname.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    struct stat buf{};
+    return lstat(dirname.c_str(), &buf) == 0 && S_ISDIR(buf.st_mode) &&
+           buf.st_uid == geteuid() && (buf.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+           access(dirname.c_str(), W_OK) == 0;
+}
+
+//
+// $XDG_RUNTIME_DIR, a tmpfs private to the user, or else a directory of our
+// own in /dev/shm. Returns "" if neither is usable.
+//
+static std::string find_memory_location()
+{
+    const char* runtime_dir = ::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && *runtime_dir != '\0')
+    {
+        const std::string dirname = std::string(runtime_dir) + "/.az-dcap-client";
+        if (make_private_dir(dirname))
+        {
+            return dirname;
+        }
+    }
+
+    const std::string dirname =
+        "/dev/shm/az-dcap-client-" + std::to_string(geteuid());
+    return make_private_dir(dirname) ? dirname : "";
+}
+
+// Entries are named by the hex SHA-256 of their id, see get_file_name
+static bool is_entry_name(const char* name)
+{
+    return strlen(name) == 2 * SHA256_DIGEST_LENGTH &&
+           strspn(name, "0123456789abcdef") == 2 * SHA256_DIGEST_LENGTH;
+}
+
+//
+// Copies the unexpired entries of the persistent copy which are missing from
+// the tmpfs cache into it, and removes the expired ones. Entries which fail
+// to copy are simply fetched again.
+//
+static void rehydrate()
+{
+    DIR* directory = opendir(g_persistent_dirname.c_str());
+    if (directory == nullptr)
+    {
+        return;
+    }
+
+    const time_t now = time(nullptr);
+    while (const dirent* entry = readdir(directory))
+    {
+        if (!is_entry_name(entry->d_name))
+        {
+            continue;
+        }
+        const std::string target = g_cache_dirname + "/" + entry->d_name;
+        if (access(target.c_str(), F_OK) == 0)
+        {
+            continue;
+        }
+
+        const std::string source = g_persistent_dirname + "/" + entry->d_name;
+        file persistent;
+        persistent.open(source, O_RDONLY);
+        const off_t size = persistent.failed() ? -1 : persistent.seek(0, SEEK_END);
+        if (size < static_cast<off_t>(sizeof(CacheEntryHeaderV1)))
+        {
+            continue;
+        }
+        std::vector<uint8_t> contents(static_cast<size_t>(size));
+        persistent.seek(0, SEEK_SET);
+        persistent.read(contents.data(), contents.size());
+        if (persistent.failed())
+        {
+            continue;
+        }
+
+        CacheEntryHeaderV1 header{};
+        memcpy(&header, contents.data(), sizeof(header));
+        if (header.version != CACHE_V1 || header.expiry <= now)
+        {
+            persistent.close();
+            unlink(source.c_str());
+            continue;
+        }
+
+        // O_EXCL: never replace an entry added since we looked
+        file memory;
+        memory.open(target, O_CREAT | O_EXCL | O_WRONLY, 0666);
+        if (!memory.failed())
+        {
+            memory.write(contents.data(), contents.size());
+            if (memory.failed())
+            {
+                memory.close();
+                unlink(target.c_str());
+            }
         }
     }
-    
-    // Collect all of the environment variables for the error message
-    std::string environment_variable_list;
-    for (size_t i = 0; i < CACHE_LOCATIONS - 1; ++i)
+    closedir(directory);
+}
+
+static void init_callback()
+{
+    load_cache_locations();
+    const cache_policy policy = get_cache_policy();
+
+    if (policy != cache_policy::disk)
     {
-        environment_variable_list += cache_locations[i];
-        if (i != CACHE_LOCATIONS - 2)
+        const std::string memory_dirname = find_memory_location();
+        if (!memory_dirname.empty())
         {
-            environment_variable_list += ",";
+            g_cache_dirname = memory_dirname;
+            if (policy == cache_policy::memory)
+            {
+                // Without the copy the cache is simply kept in memory only
+                try
+                {
+                    g_persistent_dirname = find_disk_location();
+                    rehydrate();
+                }
+                catch (std::runtime_error&)
+                {
+                    g_persistent_dirname.clear();
+                }
+            }
+            return;
         }
     }
 
-    throw std::runtime_error("No cache location was found. Please define one of the following environment variables to enable caching: " + environment_variable_list);
+    g_cache_dirname = find_disk_location();
 }
 
-static void init()
+//
+// Returns false while the cache is disabled. An attempt at creating the
+// cache directory which fails throws, the calls until the next attempt do
+// not.
+//
+static bool init()
 {
-    std::lock_guard<std::mutex> lock(cache_directory_lock);
-    if (g_cache_dirname == "")
+    directory_lock_guard lock;
+    if (!g_cache_dirname.empty())
+    {
+        return true;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (init_retry_delay.count() > 0 && now < next_init_attempt)
+    {
+        return false;
+    }
+
+    try
     {
         init_callback();
     }
+    catch (std::runtime_error&)
+    {
+        init_retry_delay = init_retry_delay.count() == 0
+                               ? INIT_RETRY_MIN
+                               : std::min(init_retry_delay * 2, INIT_RETRY_MAX);
+        next_init_attempt = now + init_retry_delay;
+        throw;
+    }
+
+    init_retry_delay = std::chrono::seconds(0);
+    return true;
 }
 
 static std::string sha256(size_t data_size, const void* data)
@@ -264,10 +550,21 @@ static std::string sha256(const std::string& input)
 
 static std::string get_file_name(const std::string& id)
 {
-    std::lock_guard<std::mutex> lock(cache_directory_lock);
+    directory_lock_guard lock;
     return g_cache_dirname + "/" + sha256(id);
 }
 
+//
+// Name of the entry in the persistent copy, or "" if there is none.
+//
+static std::string get_persistent_file_name(const std::string& id)
+{
+    directory_lock_guard lock;
+    return g_persistent_dirname.empty()
+               ? ""
+               : g_persistent_dirname + "/" + sha256(id);
+}
+
 static int delete_path(
     const char* fpath,
     const struct stat* sb,
@@ -305,19 +602,45 @@ static int delete_path(
     }
 }
 
+bool local_cache_enabled()
+{
+    return init();
+}
+
 void local_cache_clear()
 {
-    init();
+    if (!init())
+    {
+        return;
+    }
 
-    std::lock_guard<std::mutex> lock(cache_directory_lock);
+    directory_lock_guard lock;
     constexpr int MAX_FDS = 4;
     int rc = nftw(g_cache_dirname.c_str(), delete_path, MAX_FDS, FTW_DEPTH);
+    if (rc == 0 && !g_persistent_dirname.empty())
+    {
+        rc = nftw(g_persistent_dirname.c_str(), delete_path, MAX_FDS, FTW_DEPTH);
+    }
     if (rc != 0)
     {
         throw_errno("Error clearing cache");
     }
 }
 
+static void write_entry(
+    const std::string& file_name,
+    const CacheEntryHeaderV1& header,
+    size_t data_size,
+    const void* data)
+{
+    file cache_entry;
+    cache_entry.throw_on_error();
+    cache_entry.open(file_name, O_CREAT | O_WRONLY, 0666);
+    cache_entry.truncate();
+    cache_entry.write(&header, sizeof(header));
+    cache_entry.write(data, data_size);
+}
+
 void local_cache_add(
     const std::string& id,
     time_t expiry,
@@ -328,18 +651,32 @@ void local_cache_add(
     throw_if(data_size == 0, "Data cannot be empty.");
     throw_if(data == nullptr, "Data pointer must not be NULL.");
 
-    init();
+    if (!init())
+    {
+        return;
+    }
+
+    AZDCAP_PROBE3(
+        cache__add, id.c_str(), data_size, static_cast<int64_t>(expiry));
 
     CacheEntryHeaderV1 header{};
     header.version = CACHE_V1;
     header.expiry = expiry;
 
-    file cache_entry;
-    cache_entry.throw_on_error();
-    cache_entry.open(get_file_name(id), O_CREAT | O_WRONLY, 0666);
-    cache_entry.truncate();
-    cache_entry.write(&header, sizeof(header));
-    cache_entry.write(data, data_size);
+    write_entry(get_file_name(id), header, data_size, data);
+
+    const std::string persistent_file_name = get_persistent_file_name(id);
+    if (!persistent_file_name.empty())
+    {
+        // Best effort: lookups are served from the tmpfs copy
+        try
+        {
+            write_entry(persistent_file_name, header, data_size, data);
+        }
+        catch (std::runtime_error&)
+        {
+        }
+    }
 }
 
 std::unique_ptr<std::vector<uint8_t>> local_cache_get(
@@ -347,13 +684,18 @@ std::unique_ptr<std::vector<uint8_t>> local_cache_get(
 {
     throw_if(id.empty(), "The 'id' parameter must not be empty.");
 
-    init();
+    if (!init())
+    {
+        AZDCAP_PROBE1(cache__miss, id.c_str());
+        return nullptr;
+    }
 
     const auto file_name = get_file_name(id);
     file cache_file;
     cache_file.open(file_name, O_RDONLY);
     if (cache_file.failed())
     {
+        AZDCAP_PROBE1(cache__miss, id.c_str());
         return nullptr;
     }
 
@@ -368,6 +710,7 @@ std::unique_ptr<std::vector<uint8_t>> local_cache_get(
         unlink(file_name.c_str());
         // Even if unlink fails, we can just return null. Thus, the return
         // value is intentionally ignored here.
+        AZDCAP_PROBE1(cache__miss, id.c_str());
         return nullptr;
     }
 
@@ -378,5 +721,186 @@ std::unique_ptr<std::vector<uint8_t>> local_cache_get(
 
     auto cache_entry = std::make_unique<std::vector<uint8_t>>(data_size);
     cache_file.read(reinterpret_cast<char*>(cache_entry->data()), data_size);
+    AZDCAP_PROBE2(cache__hit, id.c_str(), data_size);
     return cache_entry;
 }
+
+//
+// The fill lock is an exclusive flock on an empty file beside the entry.
+// Closing the file releases it, also when the holder dies. The holder
+// removes the file before releasing it, so a process which opened it
+// meanwhile finds its lock on a file no longer in the directory, and tries
+// again with a new one.
+//
+struct posix_fill_lock : local_cache_fill_lock
+{
+    int fd = -1;
+    std::string name;
+
+    ~posix_fill_lock() override
+    {
+        if (fd != -1)
+        {
+            if (!name.empty())
+            {
+                ::unlink(name.c_str());
+            }
+            ::close(fd);
+        }
+    }
+};
+
+static int open_lock_file(const std::string& name)
+{
+    int fd;
+    do
+    {
+        fd = ::open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1)
+    {
+        throw_errno("Error opening lock file '" + name + "'");
+    }
+    return fd;
+}
+
+//
+// Whether 'fd' is still the file named 'name', rather than one removed by
+// the previous holder of its lock.
+//
+static bool is_current_lock_file(int fd, const std::string& name)
+{
+    struct stat opened;
+    struct stat current;
+    if (::fstat(fd, &opened) != 0)
+    {
+        throw_errno("Error calling fstat on '" + name + "'");
+    }
+    if (::stat(name.c_str(), &current) != 0)
+    {
+        if (errno != ENOENT)
+        {
+            throw_errno("Error calling stat on '" + name + "'");
+        }
+        return false;
+    }
+    return opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+}
+
+static bool try_flock_exclusive(int fd, const std::string& name)
+{
+    int rc;
+    do
+    {
+        rc = ::flock(fd, LOCK_EX | LOCK_NB);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == -1 && errno != EWOULDBLOCK)
+    {
+        throw_errno("Error calling flock on '" + name + "'");
+    }
+    return rc == 0;
+}
+
+std::unique_ptr<local_cache_fill_lock> local_cache_lock_fill(
+    const std::string& id,
+    std::chrono::milliseconds timeout)
+{
+    throw_if(id.empty(), "The 'id' parameter must not be empty.");
+
+    if (!init())
+    {
+        return nullptr;
+    }
+
+    auto lock = std::make_unique<posix_fill_lock>();
+    const std::string lock_name = get_file_name(id) + ".lock";
+    const auto wait_start = std::chrono::steady_clock::now();
+    const auto deadline = wait_start + timeout;
+    std::chrono::milliseconds interval(2);
+    for (;;)
+    {
+        if (lock->fd == -1)
+        {
+            lock->fd = open_lock_file(lock_name);
+        }
+
+        if (try_flock_exclusive(lock->fd, lock_name))
+        {
+            if (is_current_lock_file(lock->fd, lock_name))
+            {
+                break;
+            }
+
+            // Released by a holder which has removed the file
+            lock->waited = true;
+            ::close(lock->fd);
+            lock->fd = -1;
+            continue;
+        }
+
+        // Poll rather than block, so that a stuck holder costs us 'timeout'
+        // at most
+        lock->waited = true;
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            record_lock_wait(local_cache_lock::fill, wait_start);
+            return nullptr;
+        }
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+            interval, deadline - now));
+        interval = std::min(interval * 2, std::chrono::milliseconds(50));
+    }
+
+    if (lock->waited)
+    {
+        record_lock_wait(local_cache_lock::fill, wait_start);
+    }
+    lock->name = lock_name;
+    get_lock_counters(local_cache_lock::fill)
+        .acquisitions.fetch_add(1, std::memory_order_relaxed);
+    return std::move(lock);
+}
+
+bool local_cache_size(uint64_t& size)
+{
+    directory_lock_guard lock;
+    if (g_cache_dirname.empty())
+    {
+        return false;
+    }
+
+    DIR* directory = opendir(g_cache_dirname.c_str());
+    if (directory == nullptr)
+    {
+        throw_errno("Error opening cache directory '" + g_cache_dirname + "'");
+    }
+
+    size = 0;
+    while (const dirent* entry = readdir(directory))
+    {
+        struct stat entry_stat;
+        if (fstatat(dirfd(directory), entry->d_name, &entry_stat, 0) == 0 &&
+            S_ISREG(entry_stat.st_mode))
+        {
+            size += static_cast<uint64_t>(entry_stat.st_size);
+        }
+    }
+
+    closedir(directory);
+    return true;
+}
+
+local_cache_lock_stats local_cache_get_lock_stats(local_cache_lock lock)
+{
+    const lock_counters& counters = get_lock_counters(lock);
+
+    local_cache_lock_stats stats;
+    stats.acquisitions = counters.acquisitions.load(std::memory_order_relaxed);
+    stats.contended = counters.contended.load(std::memory_order_relaxed);
+    stats.total_wait_ns =
+        counters.total_wait_ns.load(std::memory_order_relaxed);
+    stats.max_wait_ns = counters.max_wait_ns.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,23 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef LOCAL_CACHE_ENTRY_H
+#define LOCAL_CACHE_ENTRY_H
+
+#include <cstdint>
+#include <ctime>
+
+//
+// On-disk format of an entry in the local cache: this header followed by the
+// data. Read by local_cache.cpp and by az-dcap-bake-layer.
+//
+constexpr uint16_t CACHE_V1 = 1;
+
+struct __attribute__ ((__packed__)) CacheEntryHeaderV1
+{
+    uint16_t version;   // The version of the cache header
+    time_t expiry;      // expiration time of this cache item
+};
+
+#endif
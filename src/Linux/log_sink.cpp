@@ -0,0 +1,366 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "log_sink.h"
+
+#include <pthread.h>
+#include <stdio_ext.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "environment.h"
+
+// Each record holds one fully formatted line, prefix included
+static constexpr size_t RECORD_SIZE = 640;
+static constexpr size_t RING_CAPACITY = 1024; // must be a power of two
+static constexpr size_t RING_MASK = RING_CAPACITY - 1;
+static constexpr uint64_t DEFAULT_MAX_FILE_SIZE = 10 * 1024 * 1024;
+static constexpr auto DRAIN_INTERVAL = std::chrono::milliseconds(100);
+
+static_assert(
+    (RING_CAPACITY & RING_MASK) == 0,
+    "Ring capacity must be a power of two.");
+
+//
+// Slot in the ring buffer. 'sequence' tells producers and the consumer who
+// owns the slot (see Vyukov's bounded MPMC queue): a producer may fill it when
+// sequence == position, the consumer may drain it when sequence == position+1.
+//
+struct log_record
+{
+    std::atomic<size_t> sequence;
+    size_t length;
+    char data[RECORD_SIZE];
+};
+
+static log_record ring[RING_CAPACITY];
+static std::atomic<size_t> enqueue_position(0);
+static size_t dequeue_position = 0; // only touched by the writer thread
+static std::atomic<uint64_t> dropped_count(0);
+
+static std::atomic<bool> sink_running(false);
+static std::atomic<bool> stop_requested(false);
+static std::atomic<bool> sink_started(false);
+static std::mutex sink_start_mutex;
+static std::thread writer_thread;
+
+// Only used to park the writer thread and to wait for flushes; producers
+// never take these locks.
+static std::mutex writer_mutex;
+static std::condition_variable writer_wakeup;
+static std::condition_variable writer_drained;
+static size_t flushed_position = 0;
+
+//
+// Output destination, owned by the writer thread once it has started.
+//
+static FILE* output = nullptr;
+static std::string output_file_name;
+static uint64_t max_file_size = DEFAULT_MAX_FILE_SIZE;
+static uint64_t output_file_size = 0;
+
+static void open_output()
+{
+    output = stdout;
+    if (output_file_name.empty())
+    {
+        return;
+    }
+
+    FILE* file = fopen(output_file_name.c_str(), "a");
+    if (file == nullptr)
+    {
+        fprintf(
+            stderr,
+            "Azure Quote Provider: libdcap_quoteprov.so [ERROR]: Unable to "
+            "open log file '%s', logging to stdout\n",
+            output_file_name.c_str());
+        output_file_name.clear();
+        return;
+    }
+
+    output = file;
+    fseek(output, 0, SEEK_END);
+    long position = ftell(output);
+    output_file_size = position > 0 ? static_cast<uint64_t>(position) : 0;
+}
+
+static void rotate_output_if_needed()
+{
+    if (output_file_name.empty() || max_file_size == 0 ||
+        output_file_size < max_file_size)
+    {
+        return;
+    }
+
+    fclose(output);
+    const std::string rotated_name = output_file_name + ".1";
+    std::rename(output_file_name.c_str(), rotated_name.c_str());
+    output_file_size = 0;
+    open_output();
+}
+
+static void write_line(const char* data, size_t length)
+{
+    fwrite(data, 1, length, output);
+    output_file_size += length;
+    rotate_output_if_needed();
+}
+
+//
+// Write out every record the producers have finished publishing. Returns the
+// number of records written.
+//
+static size_t drain()
+{
+    size_t written = 0;
+    for (;;)
+    {
+        log_record& record = ring[dequeue_position & RING_MASK];
+        const size_t sequence = record.sequence.load(std::memory_order_acquire);
+        if (sequence != dequeue_position + 1)
+        {
+            break;
+        }
+
+        write_line(record.data, record.length);
+        record.sequence.store(
+            dequeue_position + RING_CAPACITY, std::memory_order_release);
+        ++dequeue_position;
+        ++written;
+    }
+
+    return written;
+}
+
+static void writer_loop()
+{
+    uint64_t reported_drops = 0;
+    for (;;)
+    {
+        const bool stopping = stop_requested.load(std::memory_order_acquire);
+        const size_t written = drain();
+
+        const uint64_t drops = dropped_count.load(std::memory_order_relaxed);
+        if (drops != reported_drops)
+        {
+            char line[128];
+            int length = snprintf(
+                line,
+                sizeof(line),
+                "Azure Quote Provider: libdcap_quoteprov.so [WARNING]: "
+                "%llu log messages dropped, log buffer was full\n",
+                static_cast<unsigned long long>(drops - reported_drops));
+            write_line(line, static_cast<size_t>(length));
+            reported_drops = drops;
+        }
+
+        if (written != 0 || stopping)
+        {
+            fflush(output);
+        }
+
+        std::unique_lock<std::mutex> lock(writer_mutex);
+        flushed_position = dequeue_position;
+        writer_drained.notify_all();
+        if (stopping)
+        {
+            break;
+        }
+
+        writer_wakeup.wait_for(lock, DRAIN_INTERVAL);
+    }
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+    output = nullptr;
+}
+
+static void reset_sink_in_child();
+
+static void start_sink()
+{
+    // Once per process image; a child starting its own sink inherits it
+    static const bool fork_handler_registered =
+        pthread_atfork(nullptr, nullptr, reset_sink_in_child) == 0;
+    (void)fork_handler_registered;
+
+    for (size_t i = 0; i < RING_CAPACITY; ++i)
+    {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_position.store(0, std::memory_order_relaxed);
+    dequeue_position = 0;
+    flushed_position = 0;
+    dropped_count.store(0, std::memory_order_relaxed);
+    stop_requested.store(false, std::memory_order_relaxed);
+
+    output_file_name = get_env_variable_no_log(ENV_AZDCAP_DEBUG_LOG_FILE).first;
+    const std::string max_size =
+        get_env_variable_no_log(ENV_AZDCAP_DEBUG_LOG_FILE_MAX_SIZE).first;
+    if (!max_size.empty())
+    {
+        max_file_size = strtoull(max_size.c_str(), nullptr, 10);
+    }
+
+    open_output();
+
+    try
+    {
+        writer_thread = std::thread(writer_loop);
+    }
+    catch (std::exception&)
+    {
+        // Without a writer thread callers fall back to writing synchronously
+        return;
+    }
+
+    sink_running.store(true, std::memory_order_release);
+}
+
+//
+// A forked child has no writer thread, and whatever the parent had queued is
+// the parent's to write. Start over in the child: the sink is started again
+// on its first message. The locks may have been held by threads which do not
+// exist in the child, so they are reinitialized rather than unlocked.
+//
+static void reset_sink_in_child()
+{
+    sink_running.store(false, std::memory_order_relaxed);
+    sink_started.store(false, std::memory_order_relaxed);
+    new (&sink_start_mutex) std::mutex();
+    new (&writer_mutex) std::mutex();
+    new (&writer_wakeup) std::condition_variable();
+    new (&writer_drained) std::condition_variable();
+
+    // Not joinable in the child; leave the parent's handle alone
+    new (&writer_thread) std::thread();
+
+    // Discard the parent's buffered lines rather than writing them twice
+    if (output != nullptr && output != stdout)
+    {
+        __fpurge(output);
+        fclose(output);
+    }
+    output = nullptr;
+}
+
+//
+// Stops the writer thread after draining the ring buffer. Runs when the
+// library is unloaded via dlclose and when the process exits.
+//
+static struct log_sink_shutdown
+{
+    ~log_sink_shutdown()
+    {
+        if (!sink_running.exchange(false))
+        {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            stop_requested.store(true, std::memory_order_release);
+        }
+        writer_wakeup.notify_one();
+        writer_thread.join();
+    }
+} shutdown_on_unload;
+
+bool log_sink_write(const char* level_name, const char* message)
+{
+    if (!sink_started.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(sink_start_mutex);
+        if (!sink_started.load(std::memory_order_relaxed))
+        {
+            start_sink();
+            sink_started.store(true, std::memory_order_release);
+        }
+    }
+    if (!sink_running.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    size_t position = enqueue_position.load(std::memory_order_relaxed);
+    log_record* record;
+    for (;;)
+    {
+        record = &ring[position & RING_MASK];
+        const size_t sequence = record->sequence.load(std::memory_order_acquire);
+        const intptr_t difference =
+            static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (difference == 0)
+        {
+            if (enqueue_position.compare_exchange_weak(
+                    position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // The writer has not caught up with this slot yet
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        else
+        {
+            position = enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    int length = snprintf(
+        record->data,
+        sizeof(record->data),
+        "Azure Quote Provider: libdcap_quoteprov.so [%s]: %s\n",
+        level_name,
+        message);
+    if (length < 0)
+    {
+        length = 0;
+    }
+    else if (static_cast<size_t>(length) >= sizeof(record->data))
+    {
+        // Truncated, but keep the line terminated
+        length = sizeof(record->data) - 1;
+        record->data[length - 1] = '\n';
+    }
+
+    record->length = static_cast<size_t>(length);
+    record->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+void log_sink_flush()
+{
+    if (!sink_running.load(std::memory_order_acquire))
+    {
+        return;
+    }
+
+    const size_t target = enqueue_position.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    writer_wakeup.notify_one();
+    writer_drained.wait(lock, [target] {
+        return flushed_position >= target ||
+               !sink_running.load(std::memory_order_acquire);
+    });
+}
+
+uint64_t log_sink_dropped_count()
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
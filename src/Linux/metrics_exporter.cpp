@@ -0,0 +1,413 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "metrics_exporter.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "dcap_provider.h"
+#include "environment.h"
+#include "local_cache.h"
+#include "log_sink.h"
+#include "private.h"
+#include "telemetry.h"
+
+static constexpr unsigned DEFAULT_INTERVAL_SECONDS = 15;
+
+static const char* const phase_names[SGX_QL_FETCH_PHASE_COUNT] = {
+    "name_lookup",
+    "connect",
+    "tls_handshake",
+    "time_to_first_byte",
+    "transfer",
+    "total"};
+
+static std::once_flag exporter_start_flag;
+static std::thread exporter_thread;
+static std::mutex exporter_mutex;
+static std::condition_variable exporter_wakeup;
+static bool exporter_running = false;
+static bool stop_requested = false;
+
+static std::string metrics_file_name;
+static std::chrono::seconds export_interval(DEFAULT_INTERVAL_SECONDS);
+
+//
+// Quote a label value as required by the exposition format.
+//
+static std::string label_value(const std::string& value)
+{
+    std::string escaped("\"");
+    for (char c : value)
+    {
+        switch (c)
+        {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            default:
+                escaped += c;
+        }
+    }
+    return escaped + '"';
+}
+
+static void write_family_header(
+    std::ostringstream& out,
+    const char* name,
+    const char* type,
+    const char* help)
+{
+    out << "# HELP " << name << ' ' << help << '\n';
+    out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+static void write_fetch_histograms(
+    std::ostringstream& out,
+    const sgx_ql_fetch_stats_t& stats)
+{
+    write_family_header(
+        out,
+        "az_dcap_fetch_duration_seconds",
+        "histogram",
+        "Duration of each phase of collateral fetches.");
+    for (uint32_t i = 0; i < stats.endpoint_count; ++i)
+    {
+        const sgx_ql_endpoint_fetch_stats_t& endpoint = stats.endpoints[i];
+        for (int phase = 0; phase < SGX_QL_FETCH_PHASE_COUNT; ++phase)
+        {
+            const sgx_ql_fetch_histogram_t& histogram = endpoint.phases[phase];
+            const std::string labels =
+                "host=" + label_value(endpoint.host) +
+                ",collateral=" + label_value(endpoint.collateral) +
+                ",phase=" + label_value(phase_names[phase]);
+
+            uint64_t cumulative = 0;
+            for (int bucket = 0; bucket < SGX_QL_FETCH_HISTOGRAM_BUCKETS;
+                 ++bucket)
+            {
+                cumulative += histogram.buckets[bucket];
+                out << "az_dcap_fetch_duration_seconds_bucket{" << labels
+                    << ",le=\"";
+                if (bucket == SGX_QL_FETCH_HISTOGRAM_BUCKETS - 1)
+                {
+                    out << "+Inf";
+                }
+                else
+                {
+                    out << stats.bucket_upper_bounds_us[bucket] / 1e6;
+                }
+                out << "\"} " << cumulative << '\n';
+            }
+            out << "az_dcap_fetch_duration_seconds_sum{" << labels << "} "
+                << histogram.sum_us / 1e6 << '\n';
+            out << "az_dcap_fetch_duration_seconds_count{" << labels << "} "
+                << histogram.count << '\n';
+        }
+    }
+}
+
+static void write_endpoint_counter(
+    std::ostringstream& out,
+    const sgx_ql_fetch_stats_t& stats,
+    const char* name,
+    const char* help,
+    uint64_t sgx_ql_endpoint_fetch_stats_t::*field)
+{
+    write_family_header(out, name, "counter", help);
+    for (uint32_t i = 0; i < stats.endpoint_count; ++i)
+    {
+        const sgx_ql_endpoint_fetch_stats_t& endpoint = stats.endpoints[i];
+        out << name << "{host=" << label_value(endpoint.host)
+            << ",collateral=" << label_value(endpoint.collateral) << "} "
+            << endpoint.*field << '\n';
+    }
+}
+
+static const struct
+{
+    local_cache_lock lock;
+    const char* name;
+} cache_locks[] = {{local_cache_lock::directory, "directory"},
+                   {local_cache_lock::file_shared, "file_shared"},
+                   {local_cache_lock::file_exclusive, "file_exclusive"},
+                   {local_cache_lock::fill, "fill"}};
+
+//
+// One metric family with a sample per cache lock. 'scale' converts the
+// field to the unit of the metric.
+//
+static void write_lock_family(
+    std::ostringstream& out,
+    const char* name,
+    const char* type,
+    const char* help,
+    uint64_t local_cache_lock_stats::*field,
+    double scale = 1)
+{
+    write_family_header(out, name, type, help);
+    for (const auto& cache_lock : cache_locks)
+    {
+        const local_cache_lock_stats stats =
+            local_cache_get_lock_stats(cache_lock.lock);
+        out << name << "{lock=" << label_value(cache_lock.name) << "} ";
+        if (scale == 1)
+        {
+            out << stats.*field;
+        }
+        else
+        {
+            out << stats.*field * scale;
+        }
+        out << '\n';
+    }
+}
+
+static void write_lock_stats(std::ostringstream& out)
+{
+    write_lock_family(
+        out,
+        "az_dcap_cache_lock_acquisitions_total",
+        "counter",
+        "Cache locks taken.",
+        &local_cache_lock_stats::acquisitions);
+    write_lock_family(
+        out,
+        "az_dcap_cache_lock_contended_total",
+        "counter",
+        "Cache locks which had to be waited for.",
+        &local_cache_lock_stats::contended);
+    write_lock_family(
+        out,
+        "az_dcap_cache_lock_wait_seconds_total",
+        "counter",
+        "Time spent waiting for cache locks.",
+        &local_cache_lock_stats::total_wait_ns,
+        1e-9);
+    write_lock_family(
+        out,
+        "az_dcap_cache_lock_wait_max_seconds",
+        "gauge",
+        "Longest single wait for a cache lock.",
+        &local_cache_lock_stats::max_wait_ns,
+        1e-9);
+}
+
+std::string metrics_format_prometheus()
+{
+    std::ostringstream out;
+    out.precision(9);
+
+    const telemetry_counters counters = telemetry_get_counters();
+
+    write_family_header(
+        out,
+        "az_dcap_collateral_requests_total",
+        "counter",
+        "Collateral requested, by whether it was a cache hit, a cache miss, "
+        "or is never cached.");
+    for (const auto& entry : counters.collateral_lookups)
+    {
+        out << "az_dcap_collateral_requests_total{collateral="
+            << label_value(entry.first.first)
+            << ",source=" << label_value(entry.first.second) << "} "
+            << entry.second << '\n';
+    }
+
+    std::unique_ptr<sgx_ql_fetch_stats_t, void (*)(sgx_ql_fetch_stats_t*)>
+        stats(telemetry_get_fetch_stats(), [](sgx_ql_fetch_stats_t* p) {
+            delete[] reinterpret_cast<uint8_t*>(p);
+        });
+    if (stats)
+    {
+        write_fetch_histograms(out, *stats);
+        write_endpoint_counter(
+            out,
+            *stats,
+            "az_dcap_fetches_total",
+            "Collateral fetches, successful or not.",
+            &sgx_ql_endpoint_fetch_stats_t::fetch_count);
+        write_endpoint_counter(
+            out,
+            *stats,
+            "az_dcap_fetch_bytes_total",
+            "Bytes of collateral downloaded.",
+            &sgx_ql_endpoint_fetch_stats_t::bytes_downloaded);
+        write_endpoint_counter(
+            out,
+            *stats,
+            "az_dcap_fetch_reused_connections_total",
+            "Fetches which reused an open connection.",
+            &sgx_ql_endpoint_fetch_stats_t::reused_connection_count);
+    }
+
+    write_family_header(
+        out,
+        "az_dcap_fetch_errors_total",
+        "counter",
+        "Failed fetches, by CURL error code and HTTP status (0 if there was "
+        "no response).");
+    for (const auto& entry : counters.fetch_errors)
+    {
+        out << "az_dcap_fetch_errors_total{curl_code=\"" << entry.first.first
+            << "\",http_status=\"" << entry.first.second << "\"} "
+            << entry.second << '\n';
+    }
+
+    write_lock_stats(out);
+
+    write_family_header(
+        out,
+        "az_dcap_log_messages_dropped_total",
+        "counter",
+        "Debug log messages dropped because the log buffer was full.");
+    out << "az_dcap_log_messages_dropped_total " << log_sink_dropped_count()
+        << '\n';
+
+    // Skipped until a call into the library has set up the cache
+    try
+    {
+        uint64_t cache_size = 0;
+        if (local_cache_size(cache_size))
+        {
+            write_family_header(
+                out,
+                "az_dcap_cache_directory_bytes",
+                "gauge",
+                "Size of the local collateral cache.");
+            out << "az_dcap_cache_directory_bytes " << cache_size << '\n';
+        }
+    }
+    catch (std::exception&)
+    {
+        // The cache directory went away, so there is nothing to report
+    }
+
+    return out.str();
+}
+
+//
+// Write the metrics to a temporary file and rename it over the real one.
+//
+static void export_metrics()
+{
+    const std::string metrics = metrics_format_prometheus();
+    const std::string temporary_name = metrics_file_name + ".tmp";
+
+    FILE* file = fopen(temporary_name.c_str(), "w");
+    if (file == nullptr)
+    {
+        LOG_WARNING(
+            "Unable to open metrics file '%s'", temporary_name.c_str());
+        return;
+    }
+
+    const bool written =
+        fwrite(metrics.data(), 1, metrics.size(), file) == metrics.size();
+    if (fclose(file) != 0 || !written ||
+        std::rename(temporary_name.c_str(), metrics_file_name.c_str()) != 0)
+    {
+        LOG_WARNING(
+            "Unable to write metrics file '%s'", metrics_file_name.c_str());
+        std::remove(temporary_name.c_str());
+    }
+}
+
+static void exporter_loop()
+{
+    std::unique_lock<std::mutex> lock(exporter_mutex);
+    for (;;)
+    {
+        const bool stopping = stop_requested;
+        lock.unlock();
+        export_metrics();
+        lock.lock();
+
+        if (stopping)
+        {
+            break;
+        }
+
+        exporter_wakeup.wait_for(
+            lock, export_interval, [] { return stop_requested; });
+    }
+}
+
+//
+// Writes the metrics a final time and stops the exporter thread. Runs when the
+// library is unloaded via dlclose and when the process exits.
+//
+struct metrics_exporter_shutdown
+{
+    ~metrics_exporter_shutdown()
+    {
+        if (!exporter_running)
+        {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(exporter_mutex);
+            stop_requested = true;
+        }
+        exporter_wakeup.notify_one();
+        exporter_thread.join();
+        exporter_running = false;
+    }
+};
+
+static void start_exporter()
+{
+    metrics_file_name = get_env_variable_no_log(ENV_AZDCAP_METRICS_FILE).first;
+    if (metrics_file_name.empty())
+    {
+        return;
+    }
+
+    const std::string interval =
+        get_env_variable_no_log(ENV_AZDCAP_METRICS_INTERVAL).first;
+    if (!interval.empty())
+    {
+        const unsigned long seconds = strtoul(interval.c_str(), nullptr, 10);
+        if (seconds > 0)
+        {
+            export_interval = std::chrono::seconds(seconds);
+        }
+    }
+
+    try
+    {
+        exporter_thread = std::thread(exporter_loop);
+    }
+    catch (std::exception&)
+    {
+        LOG_WARNING("Unable to start the metrics exporter thread");
+        return;
+    }
+
+    exporter_running = true;
+
+    // Constructed after every namespace scope object in the library, so it is
+    // destroyed before them and the final export still sees the telemetry and
+    // cache state. Link order can't guarantee that once LTO merges the files.
+    static metrics_exporter_shutdown shutdown_on_unload;
+}
+
+void metrics_exporter_start()
+{
+    std::call_once(exporter_start_flag, start_exporter);
+}
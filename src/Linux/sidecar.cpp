@@ -0,0 +1,402 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "sidecar.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "environment.h"
+#include "private.h"
+
+// A daemon which takes longer than this is treated as gone, and the request
+// is fetched in process instead
+static constexpr int SIDECAR_TIMEOUT_SECONDS = 5;
+
+static std::atomic<bool> client_enabled(true);
+static std::atomic<uint64_t> next_request_id(1);
+
+///////////////////////////////////////////////////////////////////////////////
+// Framing
+///////////////////////////////////////////////////////////////////////////////
+static void put_u32(std::string& out, uint32_t value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_u64(std::string& out, uint64_t value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_bytes(std::string& out, const void* data, size_t size)
+{
+    put_u32(out, static_cast<uint32_t>(size));
+    out.append(static_cast<const char*>(data), size);
+}
+
+static void put_string(std::string& out, const std::string& value)
+{
+    put_bytes(out, value.data(), value.size());
+}
+
+static void put_headers(
+    std::string& out,
+    const std::map<std::string, std::string>& headers)
+{
+    put_u32(out, static_cast<uint32_t>(headers.size()));
+    for (const auto& header : headers)
+    {
+        put_string(out, header.first);
+        put_string(out, header.second);
+    }
+}
+
+struct payload_reader
+{
+    const char* next;
+    const char* end;
+
+    bool get(void* value, size_t size)
+    {
+        if (static_cast<size_t>(end - next) < size)
+        {
+            return false;
+        }
+        memcpy(value, next, size);
+        next += size;
+        return true;
+    }
+
+    bool get_u32(uint32_t& value)
+    {
+        return get(&value, sizeof(value));
+    }
+
+    bool get_u64(uint64_t& value)
+    {
+        return get(&value, sizeof(value));
+    }
+
+    bool get_string(std::string& value)
+    {
+        uint32_t size = 0;
+        if (!get_u32(size) || static_cast<size_t>(end - next) < size)
+        {
+            return false;
+        }
+        value.assign(next, size);
+        next += size;
+        return true;
+    }
+
+    bool get_headers(std::map<std::string, std::string>& headers)
+    {
+        uint32_t count = 0;
+        if (!get_u32(count))
+        {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string name;
+            std::string value;
+            if (!get_string(name) || !get_string(value))
+            {
+                return false;
+            }
+            headers[name] = std::move(value);
+        }
+        return true;
+    }
+};
+
+static bool write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        // MSG_NOSIGNAL: a daemon going away must not SIGPIPE the host process
+        const ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+static bool read_all(int fd, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        data += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+//
+// 'frame' holds space for the header followed by the payload.
+//
+static bool write_frame(int fd, sidecar_frame_type type, std::string& frame)
+{
+    sidecar_frame_header header;
+    header.magic = SIDECAR_MAGIC;
+    header.version = SIDECAR_VERSION;
+    header.type = static_cast<uint16_t>(type);
+    header.size = static_cast<uint32_t>(frame.size() - sizeof(header));
+    memcpy(&frame[0], &header, sizeof(header));
+    return write_all(fd, frame.data(), frame.size());
+}
+
+static bool read_frame(int fd, sidecar_frame_type type, std::string& payload)
+{
+    sidecar_frame_header header;
+    if (!read_all(fd, reinterpret_cast<char*>(&header), sizeof(header)))
+    {
+        return false;
+    }
+    if (header.magic != SIDECAR_MAGIC || header.version != SIDECAR_VERSION ||
+        header.type != static_cast<uint16_t>(type) ||
+        header.size > SIDECAR_MAX_FRAME)
+    {
+        LOG_ERROR("Malformed sidecar frame header");
+        return false;
+    }
+    payload.resize(header.size);
+    return read_all(fd, &payload[0], payload.size());
+}
+
+bool sidecar_write_request(int fd, const sidecar_request& request)
+{
+    std::string frame(sizeof(sidecar_frame_header), '\0');
+    frame.reserve(frame.size() + request.url.size() + request.body.size() + 256);
+    put_u64(frame, request.id);
+    put_u64(frame, static_cast<uint64_t>(request.max_age));
+    put_string(frame, request.url);
+    put_string(frame, request.body);
+    put_headers(frame, request.headers);
+    return write_frame(fd, sidecar_frame_type::fetch_request, frame);
+}
+
+bool sidecar_read_request(int fd, sidecar_request& request)
+{
+    std::string payload;
+    if (!read_frame(fd, sidecar_frame_type::fetch_request, payload))
+    {
+        return false;
+    }
+    payload_reader reader{payload.data(), payload.data() + payload.size()};
+    uint64_t max_age = 0;
+    if (!reader.get_u64(request.id) || !reader.get_u64(max_age) ||
+        !reader.get_string(request.url) || !reader.get_string(request.body) ||
+        !reader.get_headers(request.headers) || reader.next != reader.end)
+    {
+        return false;
+    }
+    request.max_age = static_cast<int64_t>(max_age);
+    return true;
+}
+
+bool sidecar_write_response(int fd, const sidecar_response& response)
+{
+    std::string frame(sizeof(sidecar_frame_header), '\0');
+    frame.reserve(frame.size() + response.body.size() + 1024);
+    put_u64(frame, response.id);
+    put_u32(frame, static_cast<uint32_t>(response.curl_code));
+    put_u32(frame, static_cast<uint32_t>(response.http_status));
+    frame.push_back(response.cache_hit ? 1 : 0);
+    put_headers(frame, response.headers);
+    put_bytes(frame, response.body.data(), response.body.size());
+    return write_frame(fd, sidecar_frame_type::fetch_response, frame);
+}
+
+bool sidecar_read_response(int fd, sidecar_response& response)
+{
+    std::string payload;
+    if (!read_frame(fd, sidecar_frame_type::fetch_response, payload))
+    {
+        return false;
+    }
+    payload_reader reader{payload.data(), payload.data() + payload.size()};
+    uint32_t curl_code = 0;
+    uint32_t http_status = 0;
+    uint8_t cache_hit = 0;
+    std::string body;
+    if (!reader.get_u64(response.id) || !reader.get_u32(curl_code) ||
+        !reader.get_u32(http_status) ||
+        !reader.get(&cache_hit, sizeof(cache_hit)) ||
+        !reader.get_headers(response.headers) || !reader.get_string(body) ||
+        reader.next != reader.end)
+    {
+        return false;
+    }
+    response.curl_code = static_cast<int32_t>(curl_code);
+    response.http_status = static_cast<int32_t>(http_status);
+    response.cache_hit = cache_hit != 0;
+    response.body.assign(body.begin(), body.end());
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Client
+///////////////////////////////////////////////////////////////////////////////
+const std::string& sidecar_socket_path()
+{
+    static const std::string path = [] {
+        std::string value = get_env_variable_no_log(ENV_AZDCAP_SIDECAR_SOCKET).first;
+        return value.empty() ? std::string(SIDECAR_DEFAULT_SOCKET) : value;
+    }();
+    return path;
+}
+
+void sidecar_client_disable()
+{
+    client_enabled = false;
+}
+
+//
+// Only a socket set up by root or by this user is trusted to answer with
+// collateral.
+//
+static bool sidecar_listening()
+{
+    struct stat info;
+    return stat(sidecar_socket_path().c_str(), &info) == 0 &&
+           S_ISSOCK(info.st_mode) &&
+           (info.st_uid == 0 || info.st_uid == geteuid());
+}
+
+static int sidecar_connect()
+{
+    const std::string& path = sidecar_socket_path();
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        LOG_ERROR("Sidecar socket path '%s' is too long", path.c_str());
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    timeval timeout = {SIDECAR_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        LOG_WARNING(
+            "Unable to connect to the sidecar at '%s' (errno %d)",
+            path.c_str(),
+            errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// Each thread keeps its connection open between fetches. A forked child
+// inherits the descriptor, and sharing it with the parent would interleave
+// their frames, so the connection belongs to the process which opened it.
+//
+struct sidecar_connection
+{
+    int fd = -1;
+    pid_t owner = 0;
+
+    ~sidecar_connection()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    //
+    // Drops a connection opened before a fork, or one the daemon has closed
+    // since it was last used, e.g. on restart or when it was idle.
+    //
+    bool usable()
+    {
+        if (fd < 0)
+        {
+            return false;
+        }
+        pollfd closed = {fd, POLLIN, 0};
+        if (owner != getpid() || poll(&closed, 1, 0) != 0)
+        {
+            reset();
+            return false;
+        }
+        return true;
+    }
+};
+
+bool sidecar_fetch(sidecar_request request, sidecar_response& response)
+{
+    if (!client_enabled || !sidecar_listening())
+    {
+        return false;
+    }
+
+    thread_local sidecar_connection connection;
+    if (!connection.usable())
+    {
+        connection.fd = sidecar_connect();
+        connection.owner = getpid();
+        if (connection.fd < 0)
+        {
+            return false;
+        }
+    }
+
+    request.id = next_request_id++;
+    sidecar_response received;
+    if (sidecar_write_request(connection.fd, request) &&
+        sidecar_read_response(connection.fd, received) &&
+        received.id == request.id)
+    {
+        response = std::move(received);
+        return true;
+    }
+
+    // No retry: the caller falls back to fetching in process right away
+    connection.reset();
+    LOG_WARNING("The sidecar did not answer for '%s'", request.url.c_str());
+    return false;
+}
@@ -0,0 +1,654 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Node-local collateral sidecar. Answers the cache misses of every process
+// using libdcap_quoteprov.so on the node over a Unix domain socket (see
+// ../sidecar.h for the protocol), so the service sees one client per node:
+//
+//   ./az-dcap-sidecar --socket /run/az-dcap-client/sidecar.sock --daemon
+//
+// Responses are kept in memory as long as the library would cache them, and
+// no longer than their Cache-Control max-age or --ttl-seconds. Concurrent
+// misses for the same request wait for a single upstream fetch, the upstream
+// connections are shared between all requests, and entries which were used
+// since they were fetched are refetched in the background
+// --refresh-ahead-seconds before they expire, so that busy entries never
+// expire in front of a caller. Fault injection and record/replay apply to
+// its upstream fetches as they would in process.
+//
+// The URLs come from the library, but only those under the service base URL
+// (AZDCAP_BASE_CERT_URL as in the library, or --base-url) are fetched, over
+// HTTPS unless the base URL is plain HTTP. The socket is only open to the
+// daemon's user and --group.
+//
+
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "command_line.h"
+#include "curl_easy.h"
+#include "environment.h"
+#include "sidecar.h"
+
+namespace
+{
+using clock_type = std::chrono::steady_clock;
+
+using clock_seconds = std::chrono::seconds;
+
+// Per-call header the library sets, which must not be replayed on a refresh
+constexpr char REQUEST_ID_HEADER[] = "Request-ID";
+
+// An idle client connection is closed after this long
+constexpr int IDLE_TIMEOUT_SECONDS = 30;
+
+struct options
+{
+    std::string socket_path;
+    std::vector<std::string> base_urls;
+    std::string group;
+    unsigned ttl_seconds = 3600;
+    unsigned refresh_ahead_seconds = 300;
+    size_t max_entries = 4096;
+    size_t max_connections = 64;
+    bool daemon = false;
+    bool verbose = false;
+};
+
+struct cache_entry
+{
+    sidecar_request request;
+    sidecar_response response;
+    clock_type::time_point expiry;
+    clock_type::time_point next_refresh; // earliest time to try a refresh
+    bool used = false; // looked up since it was last fetched
+};
+
+// A miss being fetched, for others missing on the same request to wait on
+struct inflight_fetch
+{
+    bool done = false;
+    sidecar_response response;
+};
+
+struct statistics
+{
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> upstream{0};
+    std::atomic<uint64_t> refreshes{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+options config;
+statistics stats;
+std::atomic<bool> stopping(false);
+std::atomic<size_t> connections(0);
+
+std::mutex cache_lock;
+std::condition_variable fetch_done;
+std::condition_variable refresh_wakeup;
+std::unordered_map<std::string, cache_entry> cache;
+std::unordered_map<std::string, std::shared_ptr<inflight_fetch>> inflight;
+
+//
+// The request headers which shape the response: all of them but the
+// per-call Request-ID.
+//
+std::map<std::string, std::string> forwarded_headers(const sidecar_request& request)
+{
+    std::map<std::string, std::string> headers;
+    for (const auto& header : request.headers)
+    {
+        if (strcasecmp(header.first.c_str(), REQUEST_ID_HEADER) != 0)
+        {
+            headers.insert(header);
+        }
+    }
+    return headers;
+}
+
+//
+// Callers sending different headers may get different responses, so they do
+// not share entries. Neither URLs nor headers contain newlines.
+//
+std::string cache_key(const sidecar_request& request)
+{
+    std::string key = request.url + '\n';
+    for (const auto& header : forwarded_headers(request))
+    {
+        key += header.first + ": " + header.second + '\n';
+    }
+    return key + '\n' + request.body;
+}
+
+bool cacheable(const sidecar_response& response)
+{
+    return response.curl_code == CURLE_OK && response.http_status == 200;
+}
+
+//
+// Whether 'url' is under one of the base URLs. Dot segments are refused, as
+// curl would resolve them to a path outside the base.
+//
+bool allowed(const std::string& url)
+{
+    const std::string path = url.substr(0, url.find_first_of("?#"));
+    if (path.find("/./") != std::string::npos || path.find("/../") != std::string::npos ||
+        (path.size() >= 2 && path.compare(path.size() - 2, 2, "/.") == 0) ||
+        (path.size() >= 3 && path.compare(path.size() - 3, 3, "/..") == 0))
+    {
+        return false;
+    }
+
+    for (const std::string& base : config.base_urls)
+    {
+        if (url.compare(0, base.size(), base) == 0 &&
+            (url.size() == base.size() || base.back() == '/' ||
+             url[base.size()] == '/' || url[base.size()] == '?'))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// How long to keep a response: as long as the library caches it, capped by
+// its Cache-Control max-age and --ttl-seconds. Zero for not at all.
+//
+clock_seconds lifetime(const sidecar_request& request, const sidecar_response& response)
+{
+    int64_t seconds = std::min<int64_t>(request.max_age, config.ttl_seconds);
+    for (const auto& header : response.headers)
+    {
+        // Header names are kept as the service sent them
+        if (strcasecmp(header.first.c_str(), "Cache-Control") != 0)
+        {
+            continue;
+        }
+        const size_t max_age = header.second.find("max-age=");
+        if (max_age != std::string::npos)
+        {
+            seconds = std::min<int64_t>(
+                seconds, strtoll(header.second.c_str() + max_age + 8, nullptr, 10));
+        }
+    }
+    return clock_seconds(std::max<int64_t>(seconds, 0));
+}
+
+sidecar_response fetch_upstream(const sidecar_request& request)
+{
+    stats.upstream++;
+    sidecar_response response;
+    try
+    {
+        auto curl = curl_easy::create(request.url, &request.body);
+        if (!request.headers.empty())
+        {
+            curl->set_headers(request.headers);
+        }
+        try
+        {
+            curl->perform();
+        }
+        catch (const curl_easy::error& error)
+        {
+            response.curl_code = error.code;
+        }
+        response.http_status = static_cast<int32_t>(curl->get_timings().http_status);
+        response.headers = curl->get_headers();
+        response.body = curl->get_body();
+    }
+    catch (const std::exception& error)
+    {
+        fprintf(stderr, "Fetching '%s' failed: %s\n", request.url.c_str(), error.what());
+        response = sidecar_response();
+        response.curl_code = CURLE_FAILED_INIT;
+    }
+    return response;
+}
+
+//
+// Makes room for one more entry, expired ones first. Called with cache_lock
+// held.
+//
+void evict_for_insert()
+{
+    if (cache.size() < config.max_entries)
+    {
+        return;
+    }
+
+    const clock_type::time_point now = clock_type::now();
+    auto soonest = cache.end();
+    for (auto entry = cache.begin(); entry != cache.end();)
+    {
+        if (entry->second.expiry <= now)
+        {
+            entry = cache.erase(entry);
+            continue;
+        }
+        if (soonest == cache.end() || entry->second.expiry < soonest->second.expiry)
+        {
+            soonest = entry;
+        }
+        ++entry;
+    }
+    if (cache.size() >= config.max_entries && soonest != cache.end())
+    {
+        cache.erase(soonest);
+    }
+}
+
+//
+// Called with cache_lock held.
+//
+void store(const std::string& key, const sidecar_request& request, const sidecar_response& response)
+{
+    const clock_seconds keep = lifetime(request, response);
+    if (keep.count() == 0)
+    {
+        cache.erase(key);
+        return;
+    }
+
+    auto entry = cache.find(key);
+    if (entry == cache.end())
+    {
+        evict_for_insert();
+        entry = cache.emplace(key, cache_entry()).first;
+    }
+
+    const clock_type::time_point now = clock_type::now();
+    entry->second.request = request;
+    entry->second.request.id = 0;
+    entry->second.request.headers = forwarded_headers(request);
+    entry->second.response = response;
+    entry->second.expiry = now + keep;
+    entry->second.next_refresh = now;
+    entry->second.used = false;
+}
+
+sidecar_response lookup(const sidecar_request& request)
+{
+    stats.requests++;
+    const std::string key = cache_key(request);
+    std::unique_lock<std::mutex> lock(cache_lock);
+
+    auto entry = cache.find(key);
+    if (entry != cache.end() && clock_type::now() < entry->second.expiry)
+    {
+        stats.hits++;
+        entry->second.used = true;
+        sidecar_response response = entry->second.response;
+        response.cache_hit = true;
+        return response;
+    }
+
+    auto pending = inflight.find(key);
+    if (pending != inflight.end())
+    {
+        stats.coalesced++;
+        const std::shared_ptr<inflight_fetch> fetch = pending->second;
+        fetch_done.wait(lock, [&] { return fetch->done; });
+        sidecar_response response = fetch->response;
+        response.cache_hit = true;
+        return response;
+    }
+
+    const auto fetch = std::make_shared<inflight_fetch>();
+    inflight.emplace(key, fetch);
+    lock.unlock();
+
+    sidecar_response response = fetch_upstream(request);
+
+    lock.lock();
+    if (cacheable(response))
+    {
+        store(key, request, response);
+    }
+    fetch->response = response;
+    fetch->done = true;
+    inflight.erase(key);
+    fetch_done.notify_all();
+    return response;
+}
+
+//
+// Refetches the entries which are about to expire and were used since they
+// were last fetched, and drops the expired ones.
+//
+void refresh_loop()
+{
+    const auto refresh_ahead = std::chrono::seconds(config.refresh_ahead_seconds);
+    const auto retry_delay = std::chrono::seconds(30);
+
+    std::unique_lock<std::mutex> lock(cache_lock);
+    while (!stopping)
+    {
+        refresh_wakeup.wait_for(lock, std::chrono::seconds(1));
+
+        const clock_type::time_point now = clock_type::now();
+        std::vector<std::string> due;
+        for (auto entry = cache.begin(); entry != cache.end();)
+        {
+            cache_entry& value = entry->second;
+            if (value.expiry <= now)
+            {
+                entry = cache.erase(entry);
+                continue;
+            }
+            if (value.used && value.expiry - now <= refresh_ahead &&
+                value.next_refresh <= now && inflight.count(entry->first) == 0)
+            {
+                due.push_back(entry->first);
+            }
+            ++entry;
+        }
+
+        for (const std::string& key : due)
+        {
+            auto entry = cache.find(key);
+            if (stopping || entry == cache.end())
+            {
+                continue;
+            }
+            const sidecar_request request = entry->second.request;
+            entry->second.next_refresh = clock_type::now() + retry_delay;
+            lock.unlock();
+
+            const sidecar_response response = fetch_upstream(request);
+
+            lock.lock();
+            if (cacheable(response))
+            {
+                stats.refreshes++;
+                store(key, request, response);
+            }
+            else if (config.verbose)
+            {
+                fprintf(stderr, "Refreshing '%s' failed\n", request.url.c_str());
+            }
+        }
+    }
+}
+
+void serve_connection(int fd)
+{
+    sidecar_request request;
+    while (sidecar_read_request(fd, request))
+    {
+        // Closing makes the client fetch in process, which it is free to do
+        if (!allowed(request.url))
+        {
+            stats.rejected++;
+            fprintf(stderr, "Refusing to fetch '%s'\n", request.url.c_str());
+            break;
+        }
+
+        sidecar_response response = lookup(request);
+        response.id = request.id;
+        if (config.verbose)
+        {
+            fprintf(
+                stderr,
+                "%s -> %d (%s)\n",
+                request.url.c_str(),
+                response.http_status,
+                response.cache_hit ? "cached" : "fetched");
+        }
+        if (!sidecar_write_response(fd, response))
+        {
+            break;
+        }
+        request = sidecar_request();
+    }
+    close(fd);
+    connections--;
+}
+
+//
+// Binds the socket, replacing a stale one left by a daemon which did not
+// shut down cleanly but never one which is still being served.
+//
+int listen_on(const std::string& path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", path.c_str());
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    const size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0)
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        if (connect(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+        {
+            fprintf(stderr, "A sidecar is already listening on '%s'\n", path.c_str());
+            close(listener);
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        perror("bind");
+        close(listener);
+        return -1;
+    }
+
+    // Only the daemon's user and group may connect
+    if (!config.group.empty())
+    {
+        const group* owner = getgrnam(config.group.c_str());
+        if (owner == nullptr || chown(path.c_str(), static_cast<uid_t>(-1), owner->gr_gid) != 0)
+        {
+            fprintf(stderr, "Unable to give '%s' to group '%s'\n", path.c_str(), config.group.c_str());
+            unlink(path.c_str());
+            close(listener);
+            return -1;
+        }
+    }
+    chmod(path.c_str(), 0660);
+    return listener;
+}
+
+void on_signal(int)
+{
+    stopping = true;
+}
+
+void usage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "  --socket PATH                socket to listen on (default %s)\n"
+        "  --group NAME                 group allowed to connect (default the daemon's)\n"
+        "  --base-url URL               service to fetch from, may be repeated\n"
+        "                               (default AZDCAP_BASE_CERT_URL or %s)\n"
+        "  --ttl-seconds N              longest responses are kept (default 3600)\n"
+        "  --refresh-ahead-seconds N    refresh used entries this long before\n"
+        "                               they expire (default 300)\n"
+        "  --max-entries N              most responses kept (default 4096)\n"
+        "  --max-connections N          most clients served at once (default 64)\n"
+        "  --daemon                     fork once listening and print the child's pid\n"
+        "  --verbose                    log each request to stderr\n",
+        program,
+        sidecar_socket_path().c_str(),
+        AZDCAP_DEFAULT_BASE_URL);
+}
+
+bool parse_options(int argc, char** argv)
+{
+    config.socket_path = sidecar_socket_path();
+    if (!parse_command_line(
+            argc,
+            argv,
+            {{"--daemon", &config.daemon}, {"--verbose", &config.verbose}},
+            {{"--socket", [](const char* value) { config.socket_path = value; }},
+             {"--group", [](const char* value) { config.group = value; }},
+             {"--base-url", [](const char* value) { config.base_urls.push_back(value); }},
+             {"--ttl-seconds", [](const char* value) {
+                  config.ttl_seconds = static_cast<unsigned>(strtoul(value, nullptr, 10));
+              }},
+             {"--refresh-ahead-seconds", [](const char* value) {
+                  config.refresh_ahead_seconds =
+                      static_cast<unsigned>(strtoul(value, nullptr, 10));
+              }},
+             {"--max-entries", [](const char* value) {
+                  config.max_entries = strtoull(value, nullptr, 10);
+              }},
+             {"--max-connections", [](const char* value) {
+                  config.max_connections = strtoull(value, nullptr, 10);
+              }}}))
+    {
+        return false;
+    }
+
+    if (config.base_urls.empty())
+    {
+        const std::string base_url = get_env_variable_no_log(ENV_AZDCAP_BASE_URL).first;
+        config.base_urls.push_back(base_url.empty() ? AZDCAP_DEFAULT_BASE_URL : base_url);
+    }
+    return !config.socket_path.empty() && config.ttl_seconds > 0 &&
+           config.max_entries > 0 && config.max_connections > 0;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // Our own fetches go upstream, not back to ourselves
+    sidecar_client_disable();
+
+    if (!parse_options(argc, argv))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const int listener = listen_on(config.socket_path);
+    if (listener < 0)
+    {
+        return 1;
+    }
+
+    if (config.daemon)
+    {
+        if (!start_daemon())
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        printf("Listening on %s\n", config.socket_path.c_str());
+    }
+    fflush(stdout);
+
+    curl_easy::share_connections();
+    const bool allow_http = std::any_of(
+        config.base_urls.begin(), config.base_urls.end(), [](const std::string& base) {
+            return base.compare(0, 7, "http://") == 0;
+        });
+    curl_easy::restrict_protocols(allow_http);
+
+    struct sigaction action = {};
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::thread refresher(refresh_loop);
+    while (!stopping)
+    {
+        pollfd waiting = {listener, POLLIN, 0};
+        if (poll(&waiting, 1, 500) <= 0)
+        {
+            continue;
+        }
+        const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // Past the limit the client fetches in process instead
+        if (connections >= config.max_connections)
+        {
+            stats.rejected++;
+            close(fd);
+            continue;
+        }
+        timeval timeout = {IDLE_TIMEOUT_SECONDS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        connections++;
+        std::thread(serve_connection, fd).detach();
+    }
+
+    // Stop taking requests before anything else, so that clients fall back
+    unlink(config.socket_path.c_str());
+    close(listener);
+    refresh_wakeup.notify_all();
+    refresher.join();
+
+    fprintf(
+        stderr,
+        "requests %llu, hits %llu, coalesced %llu, upstream fetches %llu, "
+        "refreshes %llu, rejected %llu\n",
+        static_cast<unsigned long long>(stats.requests),
+        static_cast<unsigned long long>(stats.hits),
+        static_cast<unsigned long long>(stats.coalesced),
+        static_cast<unsigned long long>(stats.upstream),
+        static_cast<unsigned long long>(stats.refreshes),
+        static_cast<unsigned long long>(stats.rejected));
+
+    // Connection threads may still be answering, so skip the destructors
+    fflush(stderr);
+    _exit(0);
+}
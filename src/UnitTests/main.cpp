@@ -3,11 +3,19 @@
 
 
 extern void LocalCacheTests();
+#if defined(__LINUX__)
+extern void CacheLayerTests();
+extern void LogSinkTests();
+#endif
 extern void QuoteProvTests();
 
 int main()
 {
     LocalCacheTests();
+#if defined(__LINUX__)
+    CacheLayerTests();
+    LogSinkTests();
+#endif
     QuoteProvTests();
     
     return 0;
@@ -0,0 +1,141 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#undef NDEBUG // ensure that asserts are never compiled out
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "cache_layer.h"
+#include "UnitTests/unit_test.h"
+
+static const char LAYER_DIRECTORY[] = "./test_cache_layer";
+
+static time_t now() { return time(nullptr); }
+
+struct layer_entry
+{
+    std::string id;
+    int64_t expiry;
+    std::vector<uint8_t> data;
+};
+
+//
+// Write a layer the way az-dcap-bake-layer does.
+//
+static void WriteLayer(const std::string& path, int64_t build_time, std::vector<layer_entry> entries)
+{
+    std::vector<cache_layer_record> records(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        SHA256(
+            reinterpret_cast<const unsigned char*>(entries[i].id.data()),
+            entries[i].id.size(),
+            records[i].key);
+    }
+
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return memcmp(records[a].key, records[b].key, CACHE_LAYER_KEY_SIZE) < 0;
+    });
+
+    cache_layer_header header{};
+    memcpy(header.magic, CACHE_LAYER_MAGIC, sizeof(header.magic));
+    header.version = CACHE_LAYER_VERSION;
+    header.entry_count = static_cast<uint32_t>(entries.size());
+    header.build_time = build_time;
+
+    FILE* file = fopen(path.c_str(), "wb");
+    assert(file != nullptr);
+    assert(fwrite(&header, sizeof(header), 1, file) == 1);
+    // Each entry's data 8 byte aligned
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(cache_layer_record);
+    for (size_t i : order)
+    {
+        records[i].expiry = entries[i].expiry;
+        records[i].offset = offset;
+        records[i].size = entries[i].data.size();
+        offset = (offset + entries[i].data.size() + 7) & ~uint64_t(7);
+        assert(fwrite(&records[i], sizeof(records[i]), 1, file) == 1);
+    }
+    static const uint8_t padding[8] = {};
+    for (size_t i : order)
+    {
+        assert(fwrite(entries[i].data.data(), 1, entries[i].data.size(), file) == entries[i].data.size());
+        const size_t padding_size = (8 - entries[i].data.size() % 8) % 8;
+        assert(fwrite(padding, 1, padding_size, file) == padding_size);
+    }
+    assert(fclose(file) == 0);
+}
+
+//
+// Look up entries in a directory of layers: a fresh layer, a layer built
+// longer ago than the default AZDCAP_CACHE_LAYER_MAX_AGE and a file that is
+// not a layer at all.
+//
+static void LayerLookup()
+{
+    TEST_START();
+
+    static const std::vector<uint8_t> data = { 4, 8, 15, 16, 23, 42 };
+    WriteLayer(
+        std::string(LAYER_DIRECTORY) + "/1-fresh.layer",
+        now(),
+        {
+            { "LayerHit", now() + 60, data },
+            { "LayerExpired", now() - 1, data },
+            { "LayerEmpty", now() + 60, {} },
+        });
+    WriteLayer(
+        std::string(LAYER_DIRECTORY) + "/2-stale.layer",
+        now() - 2 * 24 * 60 * 60,
+        {
+            { "LayerStale", now() + 60, data },
+        });
+    FILE* garbage = fopen((std::string(LAYER_DIRECTORY) + "/3-garbage.layer").c_str(), "wb");
+    assert(garbage != nullptr);
+    fputs("not a layer", garbage);
+    fclose(garbage);
+
+    setenv("AZDCAP_CACHE_LAYER", LAYER_DIRECTORY, 1);
+
+    auto hit = cache_layer_get("LayerHit");
+    assert(hit != nullptr);
+    assert(*hit == data);
+
+    auto empty = cache_layer_get("LayerEmpty");
+    assert(empty != nullptr);
+    assert(empty->empty());
+
+    assert(cache_layer_get("LayerExpired") == nullptr);
+    assert(cache_layer_get("LayerStale") == nullptr);
+    assert(cache_layer_get("LayerAbsent") == nullptr);
+
+    // Layers are read once, so the provider loaded by the quote tests gets
+    // its own, empty, set
+    unsetenv("AZDCAP_CACHE_LAYER");
+
+    TEST_PASSED();
+}
+
+extern void CacheLayerTests()
+{
+    assert(system((std::string("rm -rf ") + LAYER_DIRECTORY).c_str()) == 0);
+    assert(mkdir(LAYER_DIRECTORY, 0700) == 0);
+
+    LayerLookup();
+
+    assert(system((std::string("rm -rf ") + LAYER_DIRECTORY).c_str()) == 0);
+}
@@ -4,9 +4,16 @@
 #undef NDEBUG // ensure that asserts are never compiled out
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <string>
 #include <thread>
 #if defined(__LINUX__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #else
 #include <windows.h>
@@ -202,8 +209,436 @@ static void ThreadSafetyTest()
     TEST_PASSED();
 }
 
+//
+// Verifies the lock statistics are consistent, and that the contention
+// created by ThreadSafetyTest was seen on the file locks.
+//
+static void LockStatsTest()
+{
+    TEST_START();
+
+    const auto directory = local_cache_get_lock_stats(local_cache_lock::directory);
+    const auto shared = local_cache_get_lock_stats(local_cache_lock::file_shared);
+    const auto exclusive = local_cache_get_lock_stats(local_cache_lock::file_exclusive);
+
+    assert(shared.acquisitions > 0);
+    assert(exclusive.acquisitions > 0);
+    assert(shared.contended + exclusive.contended > 0);
+
+    for (const auto& stats : {directory, shared, exclusive})
+    {
+        assert(stats.contended <= stats.acquisitions);
+        assert(stats.max_wait_ns <= stats.total_wait_ns);
+        assert(stats.contended > 0 || stats.total_wait_ns == 0);
+    }
+
+    TEST_PASSED();
+}
+
+//
+// Only one holder of an entry's fill lock at a time: a second taker times
+// out while it is held, and gets it once it is released, knowing it waited.
+//
+static void FillLockTest()
+{
+    TEST_START();
+
+    const std::chrono::milliseconds short_wait(20);
+    const std::chrono::milliseconds long_wait(5000);
+
+    auto first = local_cache_lock_fill(__FUNCTION__, short_wait);
+    assert(first != nullptr);
+    assert(!first->waited);
+
+    assert(local_cache_lock_fill(__FUNCTION__, short_wait) == nullptr);
+
+    // Other entries are not affected
+    auto other = local_cache_lock_fill("FillLockTestOther", short_wait);
+    assert(other != nullptr);
+    assert(!other->waited);
+
+    std::thread releaser([&first] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        first.reset();
+    });
+    auto second = local_cache_lock_fill(__FUNCTION__, long_wait);
+    releaser.join();
+    assert(second != nullptr);
+    assert(second->waited);
+
+    const auto fill = local_cache_get_lock_stats(local_cache_lock::fill);
+    assert(fill.acquisitions >= 3);
+    assert(fill.contended >= 2);
+
+    TEST_PASSED();
+}
+
+#if defined(__LINUX__)
+//
+// The cache directory is chosen once per process, so tests of how it is
+// chosen run in a child forked before the first cache call.
+//
+static void RunInChild(void (*test)())
+{
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        test();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+//
+// Points AZDCAP_CACHE, the first cache location, at a regular file, in which
+// no directory can be created whatever our privileges.
+//
+static const char NOT_A_DIRECTORY[] = "./test_cache_not_a_directory";
+
+static void MakeCacheLocationUnusable()
+{
+    const int fd = open(NOT_A_DIRECTORY, O_CREAT | O_WRONLY, 0600);
+    assert(fd >= 0);
+    close(fd);
+
+    setenv("AZDCAP_CACHE", NOT_A_DIRECTORY, 1);
+}
+
+//
+// With an unusable location the cache is disabled: the attempt at creating a
+// directory throws, and until the next one every call is a quiet no-op.
+//
+static void DisabledCacheChild()
+{
+    MakeCacheLocationUnusable();
+    static const uint8_t data[] = "disabled";
+
+    AssertException<std::runtime_error>([] { local_cache_enabled(); });
+
+    assert(!local_cache_enabled());
+    assert(local_cache_get(__FUNCTION__) == nullptr);
+    local_cache_add(__FUNCTION__, now() + 60, sizeof(data), data);
+    assert(local_cache_get(__FUNCTION__) == nullptr);
+    assert(local_cache_lock_fill(__FUNCTION__, std::chrono::milliseconds(0)) == nullptr);
+    uint64_t size = 0;
+    assert(!local_cache_size(size));
+    local_cache_clear();
+}
+
+static void DisabledCacheTest()
+{
+    TEST_START();
+    RunInChild(DisabledCacheChild);
+    TEST_PASSED();
+}
+
+//
+// Creating the directory is retried after one second, then after a delay
+// which doubles, and the cache is enabled once an attempt succeeds.
+//
+static const char RETRY_LOCATION[] = "./test_cache_retry";
+
+static void DisabledCacheRetryChild()
+{
+    MakeCacheLocationUnusable();
+
+    AssertException<std::runtime_error>([] { local_cache_enabled(); });
+    assert(!local_cache_enabled());
+
+    // The second attempt, a second later, fails too
+    usleep(1100 * 1000);
+    AssertException<std::runtime_error>([] { local_cache_enabled(); });
+
+    // The location becomes usable, but the next attempt is two seconds on
+    setenv("AZDCAP_CACHE", RETRY_LOCATION, 1);
+    usleep(1100 * 1000);
+    assert(!local_cache_enabled());
+
+    usleep(1000 * 1000);
+    assert(local_cache_enabled());
+
+    static const uint8_t data[] = "enabled";
+    local_cache_add(__FUNCTION__, now() + 60, sizeof(data), data);
+    assert(local_cache_get(__FUNCTION__) != nullptr);
+}
+
+static void DisabledCacheRetryTest()
+{
+    TEST_START();
+
+    assert(system((std::string("rm -rf ") + RETRY_LOCATION).c_str()) == 0);
+    assert(mkdir(RETRY_LOCATION, 0700) == 0);
+
+    RunInChild(DisabledCacheRetryChild);
+
+    assert(system((std::string("rm -rf ") + RETRY_LOCATION).c_str()) == 0);
+    unlink(NOT_A_DIRECTORY);
+
+    TEST_PASSED();
+}
+
+//
+// AZDCAP_CACHE_POLICY=memory with XDG_RUNTIME_DIR and AZDCAP_CACHE pointing
+// at directories of our own. MEMORY_CACHE is where the cache goes if the
+// runtime directory is accepted.
+//
+static const char RUNTIME_DIR[] = "./test_cache_runtime";
+static const char DISK_DIR[] = "./test_cache_disk";
+static const std::string MEMORY_CACHE = std::string(RUNTIME_DIR) + "/.az-dcap-client";
+static const std::string DISK_CACHE = std::string(DISK_DIR) + "/.az-dcap-client";
+static const std::string SHARED_MEMORY_CACHE =
+    "/dev/shm/az-dcap-client-" + std::to_string(geteuid());
+static const char* memory_policy = "memory";
+
+static const char FRESH_ENTRY[] = "MemoryPolicyFresh";
+static const char EXPIRED_ENTRY[] = "MemoryPolicyExpired";
+
+// Entries are named by the hex SHA-256 of their id
+static std::string EntryPath(const std::string& directory, const std::string& id)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(id.data()), id.size(), hash);
+    std::string path = directory + "/";
+    for (unsigned char byte : hash)
+    {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", byte);
+        path += hex;
+    }
+    return path;
+}
+
+static bool Exists(const std::string& path)
+{
+    return access(path.c_str(), F_OK) == 0;
+}
+
+static void UseMemoryPolicy()
+{
+    setenv("AZDCAP_CACHE_POLICY", memory_policy, 1);
+    setenv("XDG_RUNTIME_DIR", RUNTIME_DIR, 1);
+    setenv("AZDCAP_CACHE", DISK_DIR, 1);
+}
+
+static void AddEntriesChild()
+{
+    UseMemoryPolicy();
+    static const uint8_t data[] = "memory";
+    local_cache_add(FRESH_ENTRY, now() + 60, sizeof(data), data);
+    local_cache_add(EXPIRED_ENTRY, now() - 1, sizeof(data), data);
+}
+
+static void StartCacheChild()
+{
+    UseMemoryPolicy();
+    assert(local_cache_enabled());
+}
+
+static void ResetMemoryPolicyDirectories()
+{
+    assert(system((std::string("rm -rf ") + RUNTIME_DIR + " " + DISK_DIR).c_str()) == 0);
+    assert(mkdir(RUNTIME_DIR, 0700) == 0);
+    assert(mkdir(DISK_DIR, 0700) == 0);
+
+    // An unsafe runtime directory makes the cache fall back to /dev/shm
+    for (const char* id : {FRESH_ENTRY, EXPIRED_ENTRY})
+    {
+        unlink(EntryPath(SHARED_MEMORY_CACHE, id).c_str());
+    }
+}
+
+//
+// memory-only keeps the cache in the runtime directory, private to us, and
+// never writes to the disk location.
+//
+static void MemoryOnlyPolicyTest()
+{
+    TEST_START();
+
+    ResetMemoryPolicyDirectories();
+    memory_policy = "memory-only";
+    RunInChild(AddEntriesChild);
+
+    assert(Exists(EntryPath(MEMORY_CACHE, FRESH_ENTRY)));
+    struct stat info{};
+    assert(lstat(MEMORY_CACHE.c_str(), &info) == 0);
+    assert(S_ISDIR(info.st_mode) && (info.st_mode & 0777) == 0700);
+    assert(!Exists(DISK_CACHE));
+
+    TEST_PASSED();
+}
+
+//
+// A runtime directory someone else could have planted is never used: one
+// others can write to, one owned by someone else, or a symbolic link.
+//
+static void AssertRuntimeDirectoryRejected(const std::string& cache_directory)
+{
+    memory_policy = "memory-only";
+    RunInChild(AddEntriesChild);
+    assert(!Exists(EntryPath(cache_directory, FRESH_ENTRY)));
+}
+
+static void MemoryPolicyUnsafeDirectoryTest()
+{
+    TEST_START();
+
+    ResetMemoryPolicyDirectories();
+    assert(mkdir(MEMORY_CACHE.c_str(), 0700) == 0);
+    assert(chmod(MEMORY_CACHE.c_str(), 0777) == 0);
+    AssertRuntimeDirectoryRejected(MEMORY_CACHE);
+
+    // Only root can make a directory for someone else
+    if (geteuid() == 0)
+    {
+        ResetMemoryPolicyDirectories();
+        assert(mkdir(MEMORY_CACHE.c_str(), 0700) == 0);
+        assert(chown(MEMORY_CACHE.c_str(), 65534, static_cast<gid_t>(-1)) == 0);
+        AssertRuntimeDirectoryRejected(MEMORY_CACHE);
+    }
+
+    ResetMemoryPolicyDirectories();
+    const std::string target = std::string(RUNTIME_DIR) + "/target";
+    assert(mkdir(target.c_str(), 0700) == 0);
+    assert(symlink("target", MEMORY_CACHE.c_str()) == 0);
+    AssertRuntimeDirectoryRejected(target);
+
+    ResetMemoryPolicyDirectories();
+
+    TEST_PASSED();
+}
+
+//
+// With the memory policy, entries are also written to disk. A memory cache
+// emptied by a reboot is refilled from there with the unexpired entries, and
+// the expired ones are removed.
+//
+static void MemoryPolicyRehydrateTest()
+{
+    TEST_START();
+
+    ResetMemoryPolicyDirectories();
+    memory_policy = "memory";
+    RunInChild(AddEntriesChild);
+    for (const std::string& directory : {MEMORY_CACHE, DISK_CACHE})
+    {
+        assert(Exists(EntryPath(directory, FRESH_ENTRY)));
+        assert(Exists(EntryPath(directory, EXPIRED_ENTRY)));
+    }
+
+    assert(system(("rm -rf " + MEMORY_CACHE).c_str()) == 0);
+    RunInChild(StartCacheChild);
+
+    assert(Exists(EntryPath(MEMORY_CACHE, FRESH_ENTRY)));
+    assert(!Exists(EntryPath(MEMORY_CACHE, EXPIRED_ENTRY)));
+    assert(Exists(EntryPath(DISK_CACHE, FRESH_ENTRY)));
+    assert(!Exists(EntryPath(DISK_CACHE, EXPIRED_ENTRY)));
+
+    assert(system((std::string("rm -rf ") + RUNTIME_DIR + " " + DISK_DIR).c_str()) == 0);
+
+    TEST_PASSED();
+}
+
+//
+// A fill lock's file is removed when it is released, also when another
+// process was waiting on it, so lock files do not pile up in the cache.
+//
+static const char FILL_LOCK_ENTRY[] = "FillLockCleanup";
+
+static void FillLockCleanupChild()
+{
+    unsetenv("AZDCAP_CACHE_POLICY");
+    setenv("AZDCAP_CACHE", DISK_DIR, 1);
+
+    auto first = local_cache_lock_fill(FILL_LOCK_ENTRY, std::chrono::milliseconds(20));
+    assert(first != nullptr);
+    assert(Exists(EntryPath(DISK_CACHE, FILL_LOCK_ENTRY) + ".lock"));
+
+    std::thread waiter([] {
+        auto second = local_cache_lock_fill(FILL_LOCK_ENTRY, std::chrono::milliseconds(5000));
+        assert(second != nullptr);
+        assert(second->waited);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    first.reset();
+    waiter.join();
+
+    auto third = local_cache_lock_fill(FILL_LOCK_ENTRY, std::chrono::milliseconds(20));
+    assert(third != nullptr);
+    assert(!third->waited);
+}
+
+static void FillLockCleanupTest()
+{
+    TEST_START();
+
+    assert(system((std::string("rm -rf ") + DISK_DIR).c_str()) == 0);
+    assert(mkdir(DISK_DIR, 0700) == 0);
+    RunInChild(FillLockCleanupChild);
+
+    DIR* directory = opendir(DISK_CACHE.c_str());
+    assert(directory != nullptr);
+    while (const dirent* entry = readdir(directory))
+    {
+        const std::string name = entry->d_name;
+        assert(name.size() < 5 || name.compare(name.size() - 5, 5, ".lock") != 0);
+    }
+    closedir(directory);
+
+    assert(system((std::string("rm -rf ") + DISK_DIR).c_str()) == 0);
+
+    TEST_PASSED();
+}
+
+//
+// Reading the size, as the metrics exporter does, leaves the cache alone
+// until another call has set it up.
+//
+static void CacheSizeChild()
+{
+    setenv("AZDCAP_CACHE", DISK_DIR, 1);
+
+    uint64_t size = 0;
+    assert(!local_cache_size(size));
+    struct stat dir_stat;
+    assert(stat(DISK_CACHE.c_str(), &dir_stat) != 0);
+
+    static const uint8_t data[] = "sized";
+    local_cache_add(__FUNCTION__, now() + 60, sizeof(data), data);
+    assert(local_cache_size(size));
+    assert(size >= sizeof(data));
+}
+
+static void CacheSizeTest()
+{
+    TEST_START();
+
+    assert(system((std::string("rm -rf ") + DISK_DIR).c_str()) == 0);
+    assert(mkdir(DISK_DIR, 0700) == 0);
+    RunInChild(CacheSizeChild);
+    assert(system((std::string("rm -rf ") + DISK_DIR).c_str()) == 0);
+
+    TEST_PASSED();
+}
+#endif
+
 extern void LocalCacheTests()
 {
+#if defined(__LINUX__)
+    // Before this process picks its own cache directory
+    DisabledCacheTest();
+    DisabledCacheRetryTest();
+    MemoryOnlyPolicyTest();
+    MemoryPolicyUnsafeDirectoryTest();
+    MemoryPolicyRehydrateTest();
+    FillLockCleanupTest();
+    CacheSizeTest();
+#endif
+
     local_cache_clear();
 
     AddGetItem();
@@ -212,4 +647,6 @@ extern void LocalCacheTests()
     VerifyExpiryWorks();
     InvalidParams();
     ThreadSafetyTest();
+    LockStatsTest();
+    FillLockTest();
 }
@@ -0,0 +1,139 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log_sink.h"
+#include "UnitTests/unit_test.h"
+
+static const char LOG_FILE[] = "./test_log_sink.log";
+
+//
+// The sink starts once per process and reads AZDCAP_DEBUG_LOG_FILE when it
+// does, so each test runs in a child of its own.
+//
+static void RunInChild(void (*test)())
+{
+    remove(LOG_FILE);
+
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        setenv("AZDCAP_DEBUG_LOG_FILE", LOG_FILE, 1);
+        test();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    remove(LOG_FILE);
+}
+
+static std::string ReadLog()
+{
+    FILE* file = fopen(LOG_FILE, "r");
+    assert(file != nullptr);
+    std::string contents;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.append(buffer, read);
+    }
+    fclose(file);
+    return contents;
+}
+
+static size_t CountLines(const std::string& log, const std::string& message)
+{
+    const std::string line = "[INFO]: " + message + "\n";
+    size_t count = 0;
+    for (size_t position = log.find(line); position != std::string::npos;
+         position = log.find(line, position + line.size()))
+    {
+        ++count;
+    }
+    return count;
+}
+
+//
+// A burst larger than the ring buffer, written faster than the writer thread
+// drains it, drops the overflow without blocking. Every message is either
+// written or counted as dropped, and the drops are reported in the log.
+//
+static constexpr unsigned BURST_SIZE = 4096;
+
+static void DropChild()
+{
+    for (unsigned i = 0; i < BURST_SIZE; i++)
+    {
+        assert(log_sink_write("INFO", "burst"));
+    }
+    log_sink_flush();
+
+    const uint64_t dropped = log_sink_dropped_count();
+    assert(dropped > 0);
+
+    const std::string log = ReadLog();
+    assert(CountLines(log, "burst") + dropped == BURST_SIZE);
+    assert(log.find("log messages dropped, log buffer was full\n") !=
+           std::string::npos);
+}
+
+static void LogSinkDropTest()
+{
+    TEST_START();
+    RunInChild(DropChild);
+    TEST_PASSED();
+}
+
+//
+// A forked child starts a sink of its own. Each process writes its own
+// messages once: the parent's queued and buffered lines are not written again
+// by the child.
+//
+static void ForkChild()
+{
+    assert(log_sink_write("INFO", "before fork"));
+
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        assert(log_sink_write("INFO", "in child"));
+        log_sink_flush();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(log_sink_write("INFO", "after fork"));
+    log_sink_flush();
+
+    const std::string log = ReadLog();
+    assert(CountLines(log, "before fork") == 1);
+    assert(CountLines(log, "in child") == 1);
+    assert(CountLines(log, "after fork") == 1);
+    assert(log_sink_dropped_count() == 0);
+}
+
+static void LogSinkForkTest()
+{
+    TEST_START();
+    RunInChild(ForkChild);
+    TEST_PASSED();
+}
+
+extern void LogSinkTests()
+{
+    LogSinkDropTest();
+    LogSinkForkTest();
+}
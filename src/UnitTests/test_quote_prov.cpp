@@ -6,17 +6,27 @@
 #include "sgx_ql_lib_common.h"
 #include "local_cache.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <sys/stat.h>
 #include <chrono>
+#include <thread>
+#include <vector>
 
 #if defined(__LINUX__)
 #include <tgmath.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "alloc_tracking.h"
 #else
 #include <iostream>
 #include <stdlib.h>
@@ -82,6 +92,10 @@ static sgx_ql_get_revocation_info_t sgx_ql_get_revocation_info;
 static sgx_ql_free_quote_config_t sgx_ql_free_quote_config;
 static sgx_ql_get_quote_config_t sgx_ql_get_quote_config;
 static sgx_ql_set_logging_function_t sgx_ql_set_logging_function;
+static sgx_ql_set_log_level_t sgx_ql_set_log_level;
+static sgx_ql_set_trace_function_t sgx_ql_set_trace_function;
+static sgx_ql_get_fetch_stats_t sgx_ql_get_fetch_stats;
+static sgx_ql_free_fetch_stats_t sgx_ql_free_fetch_stats;
 static sgx_ql_free_quote_verification_collateral_t sgx_ql_free_quote_verification_collateral;
 static sgx_ql_free_qve_identity_t sgx_ql_free_qve_identity;
 static sgx_ql_free_root_ca_crl_t sgx_ql_free_root_ca_crl;
@@ -108,6 +122,18 @@ static sgx_isv_svn_t pcesvn = 6;
 static sgx_ql_pck_cert_id_t id = {qe_id, sizeof(qe_id), &cpusvn, &pcesvn, 0};
 
 
+static unsigned log_message_counts[SGX_QL_LOG_NONE + 1];
+static unsigned suppressed_summary_counts[SGX_QL_LOG_NONE + 1];
+
+static void CountingLog(sgx_ql_log_level_t level, const char* message)
+{
+    ++log_message_counts[level];
+    if (strncmp(message, "Suppressed ", 11) == 0)
+    {
+        ++suppressed_summary_counts[level];
+    }
+}
+
 static void Log(sgx_ql_log_level_t level, const char* message)
 {
     char const* levelText = "ERROR";
@@ -155,6 +181,18 @@ static void* LoadFunctions()
     sgx_ql_set_logging_function = reinterpret_cast<sgx_ql_set_logging_function_t>(dlsym(library, "sgx_ql_set_logging_function"));
     assert(sgx_ql_set_logging_function);
 
+    sgx_ql_set_log_level = reinterpret_cast<sgx_ql_set_log_level_t>(dlsym(library, "sgx_ql_set_log_level"));
+    assert(sgx_ql_set_log_level);
+
+    sgx_ql_set_trace_function = reinterpret_cast<sgx_ql_set_trace_function_t>(dlsym(library, "sgx_ql_set_trace_function"));
+    assert(sgx_ql_set_trace_function);
+
+    sgx_ql_get_fetch_stats = reinterpret_cast<sgx_ql_get_fetch_stats_t>(dlsym(library, "sgx_ql_get_fetch_stats"));
+    assert(sgx_ql_get_fetch_stats);
+
+    sgx_ql_free_fetch_stats = reinterpret_cast<sgx_ql_free_fetch_stats_t>(dlsym(library, "sgx_ql_free_fetch_stats"));
+    assert(sgx_ql_free_fetch_stats);
+
     sgx_ql_free_quote_verification_collateral = reinterpret_cast<sgx_ql_free_quote_verification_collateral_t>(dlsym(library, "sgx_ql_free_quote_verification_collateral"));
     assert(sgx_ql_free_quote_verification_collateral);
 
@@ -201,6 +239,18 @@ static HINSTANCE LoadFunctions()
     sgx_ql_set_logging_function = reinterpret_cast<sgx_ql_set_logging_function_t>(GetProcAddress(hLibCapdll, "sgx_ql_set_logging_function"));
     assert(sgx_ql_set_logging_function);
 
+    sgx_ql_set_log_level = reinterpret_cast<sgx_ql_set_log_level_t>(GetProcAddress(hLibCapdll, "sgx_ql_set_log_level"));
+    assert(sgx_ql_set_log_level);
+
+    sgx_ql_set_trace_function = reinterpret_cast<sgx_ql_set_trace_function_t>(GetProcAddress(hLibCapdll, "sgx_ql_set_trace_function"));
+    assert(sgx_ql_set_trace_function);
+
+    sgx_ql_get_fetch_stats = reinterpret_cast<sgx_ql_get_fetch_stats_t>(GetProcAddress(hLibCapdll, "sgx_ql_get_fetch_stats"));
+    assert(sgx_ql_get_fetch_stats);
+
+    sgx_ql_free_fetch_stats = reinterpret_cast<sgx_ql_free_fetch_stats_t>(GetProcAddress(hLibCapdll, "sgx_ql_free_fetch_stats"));
+    assert(sgx_ql_free_fetch_stats);
+
     sgx_ql_free_quote_verification_collateral = reinterpret_cast<sgx_ql_free_quote_verification_collateral_t>(GetProcAddress(hLibCapdll, "sgx_ql_free_quote_verification_collateral"));
     assert(sgx_ql_free_quote_verification_collateral);
 
@@ -288,6 +338,70 @@ static void GetCrlTest()
     TEST_PASSED();
 }
 
+#if defined __LINUX__
+static unsigned sidecar_crl_hits = 0;
+static unsigned sidecar_crl_fetches = 0;
+
+static void SidecarLog(sgx_ql_log_level_t level, const char* message)
+{
+    if (strstr(message, "through the sidecar") != nullptr &&
+        strstr(message, "/pckcrl?") != nullptr)
+    {
+        ++(strstr(message, "(cached)") != nullptr ? sidecar_crl_hits
+                                                  : sidecar_crl_fetches);
+    }
+}
+
+static void FetchCrlThroughSidecar()
+{
+    static const char* TEST_CRL_URL = "https://api.trustedservices.intel.com/sgx/certification/v1/pckcrl?ca=processor";
+    sgx_ql_get_revocation_info_params_t params = {
+        SGX_QL_REVOCATION_INFO_VERSION_1,
+        sizeof(TEST_FMSPC),
+        TEST_FMSPC,
+        1,
+        &TEST_CRL_URL};
+
+    sidecar_crl_hits = 0;
+    sidecar_crl_fetches = 0;
+    sgx_ql_revocation_info_t* output;
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_get_revocation_info(&params, &output));
+    sgx_ql_free_revocation_info(output);
+}
+
+//
+// Under make check-sidecar, test_server answers with a short Cache-Control
+// max-age, and the sidecar keeps the CRL (which the library always fetches)
+// no longer than that.
+//
+static void SidecarExpiryTest()
+{
+    const char* max_age = getenv("AZDCAP_TEST_SIDECAR_MAX_AGE");
+    if (max_age == nullptr)
+    {
+        return;
+    }
+
+    TEST_START();
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(SidecarLog));
+    FetchCrlThroughSidecar();
+
+    // Past the rate limit window of the earlier tests' messages
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    FetchCrlThroughSidecar();
+    assert(sidecar_crl_hits == 1 && sidecar_crl_fetches == 0);
+
+    std::this_thread::sleep_for(std::chrono::seconds(atoi(max_age) + 2));
+    FetchCrlThroughSidecar();
+    assert(sidecar_crl_hits == 0 && sidecar_crl_fetches == 1);
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(Log));
+
+    TEST_PASSED();
+}
+#endif
+
 //
 // Fetches and validates verification APIs of QPL
 //
@@ -373,23 +487,528 @@ static void GetRootCACrlTest()
     TEST_PASSED();
 }
 
-// The Windows tolerance is 40ms while the Linux is about 2ms. That's for two reasons:
+//
+// Verifies that messages above the configured log level never reach the
+// logging callback
+//
+static void SetLogLevelTest()
+{
+    TEST_START();
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(CountingLog));
+    assert(SGX_PLAT_ERROR_INVALID_PARAMETER ==
+           sgx_ql_set_log_level((sgx_ql_log_level_t)(SGX_QL_LOG_NONE + 1)));
+
+    // A null FMSPC logs an INFO message, then fails with an ERROR message
+    sgx_ql_qve_collateral_t* collateral = nullptr;
+    memset(log_message_counts, 0, sizeof(log_message_counts));
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_log_level(SGX_QL_LOG_WARNING));
+    assert(SGX_QL_ERROR_INVALID_PARAMETER ==
+           sgx_ql_get_quote_verification_collateral(
+               nullptr, 0, "processor", &collateral));
+    assert(log_message_counts[SGX_QL_LOG_INFO] == 0);
+    assert(log_message_counts[SGX_QL_LOG_ERROR] > 0);
+
+    memset(log_message_counts, 0, sizeof(log_message_counts));
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_log_level(SGX_QL_LOG_NONE));
+    assert(SGX_QL_ERROR_INVALID_PARAMETER ==
+           sgx_ql_get_quote_verification_collateral(
+               nullptr, 0, "processor", &collateral));
+    assert(log_message_counts[SGX_QL_LOG_ERROR] == 0);
+
+    memset(log_message_counts, 0, sizeof(log_message_counts));
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_log_level(SGX_QL_LOG_INFO));
+    assert(SGX_QL_ERROR_INVALID_PARAMETER ==
+           sgx_ql_get_quote_verification_collateral(
+               nullptr, 0, "processor", &collateral));
+    assert(log_message_counts[SGX_QL_LOG_INFO] > 0);
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(Log));
+
+    TEST_PASSED();
+}
+
+//
+// Verifies that a burst of identical messages from one call site is
+// throttled rather than passed through to the logging callback
+//
+static void LogRateLimitTest()
+{
+    TEST_START();
+
+    constexpr unsigned CALL_COUNT = 1000;
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(CountingLog));
+    memset(log_message_counts, 0, sizeof(log_message_counts));
+    for (unsigned i = 0; i < CALL_COUNT; ++i)
+    {
+        sgx_ql_qve_collateral_t* collateral = nullptr;
+        assert(SGX_QL_ERROR_INVALID_PARAMETER ==
+               sgx_ql_get_quote_verification_collateral(
+                   nullptr, 0, "processor", &collateral));
+    }
+
+    assert(log_message_counts[SGX_QL_LOG_ERROR] > 0);
+    assert(log_message_counts[SGX_QL_LOG_ERROR] < CALL_COUNT);
+
+    // Once the window has passed, the next message from any call site logs
+    // the summary of the suppressed "FMSPC is null" errors
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    memset(suppressed_summary_counts, 0, sizeof(suppressed_summary_counts));
+    static const uint8_t fmspc[] = {0x00, 0x90, 0x6e, 0xa1, 0x00, 0x00};
+    sgx_ql_qve_collateral_t* collateral = nullptr;
+    assert(SGX_QL_ERROR_INVALID_PARAMETER ==
+           sgx_ql_get_quote_verification_collateral(
+               fmspc, sizeof(fmspc), nullptr, &collateral));
+    assert(suppressed_summary_counts[SGX_QL_LOG_ERROR] == 1);
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(Log));
+
+    TEST_PASSED();
+}
+
+//
+// Verifies that the fetches made by the earlier tests show up in the
+// per-endpoint histograms, and that each histogram is self-consistent
+//
+static void FetchStatsTest()
+{
+    TEST_START();
+
+    assert(SGX_PLAT_ERROR_INVALID_PARAMETER == sgx_ql_get_fetch_stats(nullptr));
+
+    sgx_ql_fetch_stats_t* stats = nullptr;
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_get_fetch_stats(&stats));
+    assert(stats != nullptr);
+    assert(stats->endpoint_count > 0);
+    assert(stats->bucket_upper_bounds_us[SGX_QL_FETCH_HISTOGRAM_BUCKETS - 1] ==
+           UINT64_MAX);
+
+    bool found_pck_cert = false;
+    for (uint32_t i = 0; i < stats->endpoint_count; ++i)
+    {
+        const sgx_ql_endpoint_fetch_stats_t& endpoint = stats->endpoints[i];
+        assert(endpoint.host != nullptr && endpoint.collateral != nullptr);
+        assert(endpoint.fetch_count > 0);
+        assert(endpoint.failure_count <= endpoint.fetch_count);
+        found_pck_cert |= strcmp(endpoint.collateral, "pck_cert") == 0;
+
+        for (const auto& histogram : endpoint.phases)
+        {
+            uint64_t bucket_total = 0;
+            for (uint64_t bucket : histogram.buckets)
+            {
+                bucket_total += bucket;
+            }
+            assert(histogram.count == endpoint.fetch_count);
+            assert(bucket_total == histogram.count);
+            assert(histogram.max_us <= histogram.sum_us);
+        }
+    }
+    assert(found_pck_cert);
+
+    sgx_ql_free_fetch_stats(stats);
+
+    TEST_PASSED();
+}
+
+struct trace_event
+{
+    bool begin;
+    uint64_t span_id;
+    uint64_t parent_span_id;
+    std::string name;
+    std::string result;
+    std::string cache_result;
+};
+
+static std::vector<trace_event> trace_events;
+
+static void TraceBegin(
+    uint64_t span_id,
+    uint64_t parent_span_id,
+    const char* name,
+    const sgx_ql_trace_attribute_t*,
+    uint32_t)
+{
+    trace_events.push_back({true, span_id, parent_span_id, name, ""});
+}
+
+static void TraceEnd(
+    uint64_t span_id,
+    const sgx_ql_trace_attribute_t* attributes,
+    uint32_t attribute_count)
+{
+    std::string result;
+    std::string cache_result;
+    for (uint32_t i = 0; i < attribute_count; ++i)
+    {
+        if (strcmp(attributes[i].key, "dcap.result") == 0)
+        {
+            result = attributes[i].value;
+        }
+        else if (strcmp(attributes[i].key, "dcap.cache_result") == 0)
+        {
+            cache_result = attributes[i].value;
+        }
+    }
+    trace_events.push_back({false, span_id, 0, "", result, cache_result});
+}
+
+//
+// Verifies that an exported call is reported as a root span enclosing its
+// cache lookups and fetches, and that spans end in the reverse order they
+// began
+//
+static void TraceFunctionTest()
+{
+    TEST_START();
+
+    assert(SGX_PLAT_ERROR_INVALID_PARAMETER ==
+           sgx_ql_set_trace_function(TraceBegin, nullptr));
+    assert(SGX_PLAT_ERROR_OK ==
+           sgx_ql_set_trace_function(TraceBegin, TraceEnd));
+
+    trace_events.clear();
+    char* root_ca_crl = nullptr;
+    uint16_t root_ca_crl_size = 0;
+    assert(SGX_QL_SUCCESS ==
+           sgx_ql_get_root_ca_crl(&root_ca_crl, &root_ca_crl_size));
+    sgx_ql_free_root_ca_crl(root_ca_crl);
+
+    // The call itself plus at least one cache lookup
+    assert(trace_events.size() >= 4);
+    assert(trace_events.front().begin);
+    assert(trace_events.front().parent_span_id == 0);
+    assert(trace_events.front().name == "sgx_ql_get_root_ca_crl");
+    assert(!trace_events.back().begin);
+    assert(trace_events.back().span_id == trace_events.front().span_id);
+    assert(trace_events.back().result == "0x0");
+
+    std::vector<uint64_t> open_spans;
+    for (const trace_event& event : trace_events)
+    {
+        if (event.begin)
+        {
+            assert(event.span_id != 0);
+            assert(event.parent_span_id ==
+                   (open_spans.empty() ? 0 : open_spans.back()));
+            open_spans.push_back(event.span_id);
+        }
+        else
+        {
+            assert(!open_spans.empty());
+            assert(event.span_id == open_spans.back());
+            open_spans.pop_back();
+        }
+    }
+    assert(open_spans.empty());
+
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_trace_function(nullptr, nullptr));
+    trace_events.clear();
+    root_ca_crl = nullptr;
+    assert(SGX_QL_SUCCESS ==
+           sgx_ql_get_root_ca_crl(&root_ca_crl, &root_ca_crl_size));
+    sgx_ql_free_root_ca_crl(root_ca_crl);
+    assert(trace_events.empty());
+
+    TEST_PASSED();
+}
+
+//
+// Two sets of callbacks counting the spans they see. A span which began with
+// one set must end with the same set, however often they are swapped.
+//
+static std::atomic<uint64_t> swap_counts[4];
+
+template <size_t set>
+static void CountingTraceBegin(
+    uint64_t, uint64_t, const char*, const sgx_ql_trace_attribute_t*, uint32_t)
+{
+    swap_counts[2 * set].fetch_add(1);
+}
+
+template <size_t set>
+static void CountingTraceEnd(uint64_t, const sgx_ql_trace_attribute_t*, uint32_t)
+{
+    swap_counts[2 * set + 1].fetch_add(1);
+}
+
+static void TraceFunctionSwapTest()
+{
+    TEST_START();
+
+    std::atomic<bool> done(false);
+    std::thread swapper([&done] {
+        while (!done.load())
+        {
+            sgx_ql_set_trace_function(CountingTraceBegin<0>, CountingTraceEnd<0>);
+            sgx_ql_set_trace_function(nullptr, nullptr);
+            sgx_ql_set_trace_function(CountingTraceBegin<1>, CountingTraceEnd<1>);
+        }
+    });
+
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        char* root_ca_crl = nullptr;
+        uint16_t root_ca_crl_size = 0;
+        assert(SGX_QL_SUCCESS ==
+               sgx_ql_get_root_ca_crl(&root_ca_crl, &root_ca_crl_size));
+        sgx_ql_free_root_ca_crl(root_ca_crl);
+    }
+
+    done.store(true);
+    swapper.join();
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_trace_function(nullptr, nullptr));
+
+    assert(swap_counts[0].load() + swap_counts[2].load() > 0);
+    assert(swap_counts[0].load() == swap_counts[1].load());
+    assert(swap_counts[2].load() == swap_counts[3].load());
+
+    TEST_PASSED();
+}
+
+#if defined __LINUX__
+static constexpr char METRICS_FILE_NAME[] = "./az_dcap_metrics.prom";
+
+//
+// Verifies that the exporter configured in QuoteProvTests writes a metrics
+// file within a few intervals
+//
+static void MetricsExporterTest()
+{
+    TEST_START();
+
+    std::string metrics;
+    for (int attempt = 0; attempt < 50 && metrics.empty(); ++attempt)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        FILE* file = fopen(METRICS_FILE_NAME, "r");
+        if (file == nullptr)
+        {
+            continue;
+        }
+
+        char buffer[4096];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            metrics.append(buffer, read);
+        }
+        fclose(file);
+    }
+
+    assert(metrics.find("# TYPE az_dcap_collateral_requests_total counter\n") !=
+           std::string::npos);
+    assert(metrics.find("# TYPE az_dcap_fetch_duration_seconds histogram\n") !=
+           std::string::npos);
+    assert(metrics.find("\naz_dcap_log_messages_dropped_total 0\n") !=
+           std::string::npos);
+
+    remove(METRICS_FILE_NAME);
+
+    TEST_PASSED();
+}
+
+//
+// Allocations allowed for one call served from a warm cache, including the
+// returned buffers. Lower these as the hot paths are trimmed; a change that
+// needs to raise them should say why. Byte budgets leave room for the live
+// service's collateral, which is larger than test_server's.
+//
+static constexpr uint64_t COLLATERAL_ALLOCATION_BUDGET = 200;
+static constexpr uint64_t COLLATERAL_ALLOCATION_BYTES_BUDGET = 256 * 1024;
+static constexpr uint64_t QUOTE_CONFIG_ALLOCATION_BUDGET = 32;
+static constexpr uint64_t QUOTE_CONFIG_ALLOCATION_BYTES_BUDGET = 32 * 1024;
+
+//
+// Fewest allocations seen over a few calls, so that one-time growth of a
+// buffer somewhere in the process isn't charged to the call
+//
+template <typename Call>
+static allocation_stats MeasureAllocations(Call call)
+{
+    allocation_stats fewest = {UINT64_MAX, UINT64_MAX};
+    for (int i = 0; i < 5; ++i)
+    {
+        allocation_tracking_start();
+        call();
+        const allocation_stats stats = allocation_tracking_stop();
+        if (stats.count < fewest.count)
+        {
+            fewest = stats;
+        }
+    }
+    return fewest;
+}
+
+//
+// Verifies that warm cache calls stay within their allocation budgets.
+// Expects the cache to hold the collateral for TEST_FMSPC and the
+// certificate for 'id' already.
+//
+static void AllocationBudgetTest()
+{
+    TEST_START();
+
+    const allocation_stats collateral = MeasureAllocations([] {
+        sgx_ql_qve_collateral_t* collateral = nullptr;
+        assert(
+            SGX_QL_SUCCESS ==
+            sgx_ql_get_quote_verification_collateral(
+                TEST_FMSPC, sizeof(TEST_FMSPC), "processor", &collateral));
+        sgx_ql_free_quote_verification_collateral(collateral);
+    });
+    printf(
+        "sgx_ql_get_quote_verification_collateral: %llu allocations, %llu "
+        "bytes (budget %llu, %llu)\n",
+        (unsigned long long)collateral.count,
+        (unsigned long long)collateral.bytes,
+        (unsigned long long)COLLATERAL_ALLOCATION_BUDGET,
+        (unsigned long long)COLLATERAL_ALLOCATION_BYTES_BUDGET);
+    assert(collateral.count <= COLLATERAL_ALLOCATION_BUDGET);
+    assert(collateral.bytes <= COLLATERAL_ALLOCATION_BYTES_BUDGET);
+
+    const allocation_stats quote_config = MeasureAllocations([] {
+        sgx_ql_config_t* config = nullptr;
+        assert(SGX_QL_SUCCESS == sgx_ql_get_quote_config(&id, &config));
+        sgx_ql_free_quote_config(config);
+    });
+    printf(
+        "sgx_ql_get_quote_config: %llu allocations, %llu bytes (budget %llu, "
+        "%llu)\n",
+        (unsigned long long)quote_config.count,
+        (unsigned long long)quote_config.bytes,
+        (unsigned long long)QUOTE_CONFIG_ALLOCATION_BUDGET,
+        (unsigned long long)QUOTE_CONFIG_ALLOCATION_BYTES_BUDGET);
+    assert(quote_config.count <= QUOTE_CONFIG_ALLOCATION_BUDGET);
+    assert(quote_config.bytes <= QUOTE_CONFIG_ALLOCATION_BYTES_BUDGET);
+
+    TEST_PASSED();
+}
+#endif
+
+//
+// Latency budgets for calls served from the local cache, in milliseconds,
+// checked against the percentiles of many calls. The Windows budgets are
+// wider for two reasons:
 // 1) The windows system timer runs at a 10ms cadence, meaning that you're not going to see 1ms or 2ms intervals.
 // 2) The windows console is synchronous and quite slow relative to the linux console.
+// Each can be overridden with AZDCAP_TEST_<env_name>_P50_MS and _P99_MS, and
+// the number of calls with AZDCAP_TEST_LATENCY_ITERATIONS.
+//
+struct latency_budget
+{
+    const char* name;
+    const char* env_name;
+    double p50_ms;
+    double p99_ms;
+};
+
 #if defined __LINUX__
-constexpr auto CURL_TOLERANCE = 0.002;
-constexpr auto CURL_FILESYSTEM_TOLERANCE = 0;
+static const latency_budget QUOTE_CONFIG_BUDGET = {"warm_quote_config", "QUOTE_CONFIG", 2, 4};
+static const latency_budget COLLATERAL_BUDGET = {"warm_verification_collateral", "COLLATERAL", 8, 16};
 #else
-constexpr auto CURL_TOLERANCE = 0.04;
-constexpr auto CURL_FILESYSTEM_TOLERANCE = 0.025;
+static const latency_budget QUOTE_CONFIG_BUDGET = {"warm_quote_config", "QUOTE_CONFIG", 40, 105};
+static const latency_budget COLLATERAL_BUDGET = {"warm_verification_collateral", "COLLATERAL", 160, 420};
 #endif
+static constexpr unsigned DEFAULT_LATENCY_ITERATIONS = 50;
+
+static double GetEnvironmentNumber(const std::string& name, double default_value)
+{
+    const char* value = getenv(name.c_str());
+    return value != nullptr && *value != '\0' ? atof(value) : default_value;
+}
 
-static inline float MeasureFunction(measured_function_t func)
+static inline double MeasureFunction(measured_function_t func)
 {
     auto start = chrono::steady_clock::now();
     func();
-    return (float)chrono::duration_cast<chrono::microseconds>(
-               chrono::steady_clock::now() - start).count() / 1000000;
+    return (double)chrono::duration_cast<chrono::microseconds>(
+               chrono::steady_clock::now() - start).count() / 1000;
+}
+
+// Nearest rank percentile of sorted samples
+static double Percentile(const vector<double>& sorted, unsigned percent)
+{
+    size_t rank = (sorted.size() * percent + 99) / 100;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static void FetchQuoteConfig()
+{
+    sgx_ql_config_t* config = nullptr;
+    assert(SGX_QL_SUCCESS == sgx_ql_get_quote_config(&id, &config));
+    assert(SGX_QL_SUCCESS == sgx_ql_free_quote_config(config));
+}
+
+static void FetchVerificationCollateral()
+{
+    sgx_ql_qve_collateral_t* collateral = nullptr;
+    assert(
+        SGX_QL_SUCCESS ==
+        sgx_ql_get_quote_verification_collateral(
+            TEST_FMSPC, sizeof(TEST_FMSPC), "processor", &collateral));
+    sgx_ql_free_quote_verification_collateral(collateral);
+}
+
+//
+// Times 'func' over many calls, reports the percentiles as one JSON line on
+// stdout (and appended to AZDCAP_TEST_LATENCY_OUTPUT, if set) and checks
+// them against the budget. Returns the p50.
+//
+static double CheckLatency(const latency_budget& budget, measured_function_t func)
+{
+    const std::string prefix = std::string("AZDCAP_TEST_") + budget.env_name;
+    const double p50_budget = GetEnvironmentNumber(prefix + "_P50_MS", budget.p50_ms);
+    const double p99_budget = GetEnvironmentNumber(prefix + "_P99_MS", budget.p99_ms);
+    unsigned iterations = (unsigned)GetEnvironmentNumber(
+        "AZDCAP_TEST_LATENCY_ITERATIONS", DEFAULT_LATENCY_ITERATIONS);
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    vector<double> samples;
+    samples.reserve(iterations);
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        samples.push_back(MeasureFunction(func));
+    }
+    sort(samples.begin(), samples.end());
+    const double p50 = Percentile(samples, 50);
+    const double p99 = Percentile(samples, 99);
+
+    char result[512];
+    snprintf(
+        result,
+        sizeof(result),
+        "{\"name\":\"%s\",\"iterations\":%u,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+        "\"max_ms\":%.3f,\"p50_budget_ms\":%.3f,\"p99_budget_ms\":%.3f}",
+        budget.name,
+        iterations,
+        p50,
+        p99,
+        samples.back(),
+        p50_budget,
+        p99_budget);
+    printf("%s\n", result);
+
+    const char* output = getenv("AZDCAP_TEST_LATENCY_OUTPUT");
+    if (output != nullptr && *output != '\0')
+    {
+        FILE* file = fopen(output, "a");
+        assert(file != nullptr);
+        fprintf(file, "%s\n", result);
+        fclose(file);
+    }
+
+    assert(p50 <= p50_budget);
+    assert(p99 <= p99_budget);
+    return p50;
 }
 
 void RunQuoteProviderTests(bool caching_enabled = false)
@@ -407,31 +1026,22 @@ void RunQuoteProviderTests(bool caching_enabled = false)
     //
     // Second pass: Ensure that we ONLY get data from the cache
     //
-    auto duration_local_cert = MeasureFunction(GetCertsTest);
-
+    GetCertsTest();
     GetCrlTest();
     GetRootCACrlTest();
-
-    auto duration_local_verification =
-        MeasureFunction(GetVerificationCollateralTest);
+    GetVerificationCollateralTest();
 
     if (caching_enabled)
     {
-        // Ensure that there is a signficiant enough difference between the cert
-        // fetch to the end point and cert fetch to local cache and that local
-        // cache call is fast enough
-        constexpr auto PERMISSION_CHECK_TEST_TOLERANCE =
-            CURL_TOLERANCE + CURL_FILESYSTEM_TOLERANCE;
-        assert(fabs(duration_curl_cert - duration_local_cert) > CURL_TOLERANCE);
-        assert(duration_local_cert < (CURL_TOLERANCE + PERMISSION_CHECK_TEST_TOLERANCE));
-        assert(
-            fabs(duration_curl_verification - duration_local_verification) >
-            CURL_TOLERANCE);
-
-        constexpr int NUMBER_VERIFICATION_CURL_CALLS = 4;
-        assert(
-            duration_local_verification <
-            (NUMBER_VERIFICATION_CURL_CALLS * PERMISSION_CHECK_TEST_TOLERANCE));
+        // The cache must be fast enough, and clearly faster than the fetch
+        // from the end point that filled it
+        auto duration_local_cert =
+            CheckLatency(QUOTE_CONFIG_BUDGET, FetchQuoteConfig);
+        assert(duration_local_cert < duration_curl_cert);
+
+        auto duration_local_verification =
+            CheckLatency(COLLATERAL_BUDGET, FetchVerificationCollateral);
+        assert(duration_local_verification < duration_curl_verification);
     }
 }
 
@@ -639,10 +1249,26 @@ void RunCachePermissionTests(libary_type_t *library)
     TEST_PASSED();
 }
 
+//
+// Tests run against the live service unless AZDCAP_BASE_CERT_URL is already
+// set when they start, e.g. to a local test_server
+//
+static const std::string& GetTestBaseUrl()
+{
+    static const std::string base_url = [] {
+        const char* preset = getenv("AZDCAP_BASE_CERT_URL");
+        return std::string(
+            preset != nullptr && *preset != '\0'
+                ? preset
+                : "https://global.acccache.azure.net/sgx/certificates");
+    }();
+    return base_url;
+}
+
 void SetupEnvironment(std::string version)
 {
 #if defined __LINUX__
-    setenv("AZDCAP_BASE_CERT_URL", "https://global.acccache.azure.net/sgx/certificates", 1);
+    setenv("AZDCAP_BASE_CERT_URL", GetTestBaseUrl().c_str(), 1);
     setenv("AZDCAP_CLIENT_ID", "AzureDCAPTestsLinux", 1);
     if (!version.empty())
     {
@@ -656,19 +1282,438 @@ void SetupEnvironment(std::string version)
             "AZDCAP_COLLATERAL_VERSION", version.c_str()));
     }
     assert(SetEnvironmentVariableA(
-        "AZDCAP_BASE_CERT_URL",
-        "https://global.acccache.azure.net/sgx/certificates"));
+        "AZDCAP_BASE_CERT_URL", GetTestBaseUrl().c_str()));
     assert(
         SetEnvironmentVariableA("AZDCAP_CLIENT_ID", "AzureDCAPTestsWindows"));
 #endif
 }
 
+#if defined __LINUX__
+//
+// Cache lookups made since trace_events was cleared, by dcap.cache_result.
+//
+static std::map<std::string, int> CountCacheResults()
+{
+    std::map<std::string, int> counts;
+    for (const trace_event& event : trace_events)
+    {
+        if (!event.cache_result.empty())
+        {
+            ++counts[event.cache_result];
+        }
+    }
+    return counts;
+}
+
+static void FetchRootCaCrl()
+{
+    char* root_ca_crl = nullptr;
+    uint16_t root_ca_crl_size = 0;
+    assert(SGX_QL_SUCCESS ==
+           sgx_ql_get_root_ca_crl(&root_ca_crl, &root_ca_crl_size));
+    sgx_ql_free_root_ca_crl(root_ca_crl);
+}
+
+//
+// With no usable cache location, calls still succeed. The first attempt at
+// creating the cache directory fails, and the calls until the next attempt
+// skip the cache altogether. The library picks its cache directory once, so this
+// runs in a child forked before its first cache lookup.
+//
+static void DisabledCacheTest()
+{
+    TEST_START();
+
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        // No directory can be created in a regular file, whatever our
+        // privileges
+        const char* not_a_directory = "./test_no_cache";
+        FILE* file = fopen(not_a_directory, "w");
+        assert(file != nullptr);
+        fclose(file);
+        setenv("AZDCAP_CACHE", not_a_directory, 1);
+        SetupEnvironment("");
+        assert(SGX_PLAT_ERROR_OK ==
+               sgx_ql_set_trace_function(TraceBegin, TraceEnd));
+
+        // The failed attempt is made by this call's lookup, or by the
+        // metrics exporter if it got there first
+        trace_events.clear();
+        FetchRootCaCrl();
+        auto results = CountCacheResults();
+        assert(results.size() == results.count("error") + results.count("disabled"));
+
+        trace_events.clear();
+        FetchRootCaCrl();
+        results = CountCacheResults();
+        assert(results["disabled"] > 0);
+        assert(results.size() == 1);
+
+        unlink(not_a_directory);
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    TEST_PASSED();
+}
+
+//
+// The library reads its transport settings once, so tests of them run in a
+// child forked before the parent's first fetch. The child gets a cache
+// directory of its own, so that every call reaches the transport, and no
+// sidecar.
+//
+static const std::string CHILD_CACHE_DIR = "./test_child_cache";
+
+static void RunProviderChild(
+    const std::map<std::string, std::string>& environment,
+    void (*test)(),
+    bool keep_cache = false)
+{
+    if (!keep_cache)
+    {
+        assert(system(("rm -rf " + CHILD_CACHE_DIR).c_str()) == 0);
+        assert(mkdir(CHILD_CACHE_DIR.c_str(), 0700) == 0);
+    }
+
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        for (const auto& variable : environment)
+        {
+            setenv(variable.first.c_str(), variable.second.c_str(), 1);
+        }
+        setenv("AZDCAP_CACHE", CHILD_CACHE_DIR.c_str(), 1);
+        unsetenv("AZDCAP_SIDECAR_SOCKET");
+        SetupEnvironment("");
+        test();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+//
+// AZDCAP_HTTP_MODE record and replay
+//
+static const std::string FIXTURE_DIR = "./test_http_fixtures";
+static std::string fixture_path;
+static std::string recorded_crl;
+
+static void RunFixtureChild(const char* mode, void (*test)())
+{
+    RunProviderChild(
+        {{"AZDCAP_HTTP_MODE", mode}, {"AZDCAP_HTTP_FIXTURE_DIR", FIXTURE_DIR}},
+        test);
+}
+
+static quote3_error_t GetRootCaCrl(std::string& crl)
+{
+    char* root_ca_crl = nullptr;
+    uint16_t root_ca_crl_size = 0;
+    const quote3_error_t result =
+        sgx_ql_get_root_ca_crl(&root_ca_crl, &root_ca_crl_size);
+    if (result == SGX_QL_SUCCESS)
+    {
+        // The size counts the terminating null
+        crl.assign(root_ca_crl, root_ca_crl_size - 1);
+        sgx_ql_free_root_ca_crl(root_ca_crl);
+    }
+    return result;
+}
+
+static std::string ReadFixture()
+{
+    FILE* file = fopen(fixture_path.c_str(), "rb");
+    assert(file != nullptr);
+    std::string contents;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.append(buffer, read);
+    }
+    fclose(file);
+    return contents;
+}
+
+static void WriteFixture(const std::string& contents)
+{
+    FILE* file = fopen(fixture_path.c_str(), "wb");
+    assert(file != nullptr);
+    assert(fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+    fclose(file);
+}
+
+//
+// Replaces the value of the preamble line starting with 'prefix'.
+//
+static std::string ReplaceFixtureLine(
+    const std::string& contents,
+    const std::string& prefix,
+    const std::string& value)
+{
+    const size_t start = contents.find("\n" + prefix);
+    assert(start != std::string::npos);
+    const size_t end = contents.find('\n', start + 1);
+    assert(end != std::string::npos);
+    return contents.substr(0, start + 1) + prefix + value + contents.substr(end);
+}
+
+static void RecordFixtureChild()
+{
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+    assert(!crl.empty());
+}
+
+static void ReplayFixtureChild()
+{
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+    assert(crl == recorded_crl);
+}
+
+static void ReplayMissingFixtureChild()
+{
+    std::string crl;
+    assert(SGX_QL_NETWORK_ERROR == GetRootCaCrl(crl));
+}
+
+static void ReplayErrorStatusChild()
+{
+    std::string crl;
+    assert(SGX_QL_NO_QUOTE_COLLATERAL_DATA == GetRootCaCrl(crl));
+}
+
+static void HttpFixtureTest()
+{
+    TEST_START();
+
+    assert(system(("rm -rf " + FIXTURE_DIR).c_str()) == 0);
+    RunFixtureChild("record", RecordFixtureChild);
+
+    // One request, so one fixture, holding the response as received
+    DIR* directory = opendir(FIXTURE_DIR.c_str());
+    assert(directory != nullptr);
+    while (const dirent* entry = readdir(directory))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            assert(fixture_path.empty());
+            fixture_path = FIXTURE_DIR + "/" + entry->d_name;
+        }
+    }
+    closedir(directory);
+    assert(!fixture_path.empty());
+
+    const std::string recorded = ReadFixture();
+    assert(recorded.compare(0, 22, "AZDCAP-HTTP-FIXTURE 1\n") == 0);
+    assert(recorded.find("\nstatus: 200\n") != std::string::npos);
+    const size_t body_size = recorded.find("\nbody-size: ");
+    assert(body_size != std::string::npos);
+    recorded_crl = recorded.substr(recorded.find('\n', body_size + 1) + 1);
+    assert(!recorded_crl.empty());
+
+    // Answered from the fixture, which a different body proves
+    RunFixtureChild("replay", ReplayFixtureChild);
+    recorded_crl = std::string(recorded_crl.size(), 'r');
+    WriteFixture(
+        recorded.substr(0, recorded.size() - recorded_crl.size()) +
+        recorded_crl);
+    RunFixtureChild("replay", ReplayFixtureChild);
+
+    // A truncated or malformed fixture, or one recorded for another URL, is
+    // no fixture at all
+    WriteFixture(recorded.substr(0, recorded.size() - 1));
+    RunFixtureChild("replay", ReplayMissingFixtureChild);
+    WriteFixture("AZDCAP-HTTP-FIXTURE 2" + recorded.substr(21));
+    RunFixtureChild("replay", ReplayMissingFixtureChild);
+    WriteFixture(ReplaceFixtureLine(recorded, "url: ", "https://localhost/other"));
+    RunFixtureChild("replay", ReplayMissingFixtureChild);
+
+    // A recorded error status fails the request as the service would have
+    WriteFixture(ReplaceFixtureLine(recorded, "status: ", "404"));
+    RunFixtureChild("replay", ReplayErrorStatusChild);
+
+    assert(system(("rm -rf " + FIXTURE_DIR + " " + CHILD_CACHE_DIR).c_str()) == 0);
+    fixture_path.clear();
+
+    TEST_PASSED();
+}
+
+//
+// AZDCAP_FAULT_INJECTION
+//
+static unsigned malformed_fault_rules = 0;
+
+static void FaultRuleLog(sgx_ql_log_level_t level, const char* message)
+{
+    if (strncmp(message, "Ignoring malformed fault injection rule", 39) == 0)
+    {
+        ++malformed_fault_rules;
+    }
+}
+
+static void RunFaultChild(const char* rules, void (*test)())
+{
+    RunProviderChild({{"AZDCAP_FAULT_INJECTION", rules}}, test);
+}
+
+static void MalformedFaultRulesChild()
+{
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(FaultRuleLog));
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+    assert(malformed_fault_rules == 6);
+}
+
+static void CurlErrorFaultChild()
+{
+    std::string crl;
+    assert(SGX_QL_NETWORK_ERROR == GetRootCaCrl(crl));
+}
+
+static void StatusFaultChild()
+{
+    std::string crl;
+    assert(SGX_QL_NO_QUOTE_COLLATERAL_DATA == GetRootCaCrl(crl));
+}
+
+static void TruncateFaultChild()
+{
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+    assert(crl.size() == 10);
+}
+
+static void DropHeaderFaultChild()
+{
+    // The CRL is useless without its issuer chain
+    std::string crl;
+    assert(SGX_QL_ERROR_UNEXPECTED == GetRootCaCrl(crl));
+}
+
+static void FaultInjectionTest()
+{
+    TEST_START();
+
+    // Malformed rules, each ignored, and one well formed rule which matches
+    // nothing
+    RunFaultChild(
+        "*,status;*,bogus=1;*,status=304;*,rate=1.5,status=503;"
+        "*,rate=-0.5,status=503;*,rate=often,status=503;"
+        "*/nothing*,curl_error=7",
+        MalformedFaultRulesChild);
+
+    RunFaultChild("*/pckcrl*,curl_error=7", CurlErrorFaultChild);
+    RunFaultChild("*/pckcrl*,status=503", StatusFaultChild);
+    RunFaultChild("*/pckcrl*,truncate=10", TruncateFaultChild);
+    RunFaultChild(
+        "*/pckcrl*,drop_header=sgx-pck-crl-issuer-chain", DropHeaderFaultChild);
+
+    assert(system(("rm -rf " + CHILD_CACHE_DIR).c_str()) == 0);
+
+    TEST_PASSED();
+}
+
+//
+// AZDCAP_CACHE_LAYER, with a layer baked by az-dcap-bake-layer from a cache
+// directory the provider filled
+//
+static const std::string BAKED_LAYER = "./test_baked.layer";
+static const std::string BAKED_CRL = "./test_baked.crl";
+
+static void FillCacheChild()
+{
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+
+    FILE* file = fopen(BAKED_CRL.c_str(), "wb");
+    assert(file != nullptr);
+    assert(fwrite(crl.data(), 1, crl.size(), file) == crl.size());
+    fclose(file);
+}
+
+//
+// Every lookup, of the CRL and of its issuer chain, is answered by the layer,
+// also when the writable cache holds the same entries.
+//
+static void LayerHitChild()
+{
+    assert(SGX_PLAT_ERROR_OK == sgx_ql_set_trace_function(TraceBegin, TraceEnd));
+    trace_events.clear();
+    std::string crl;
+    assert(SGX_QL_SUCCESS == GetRootCaCrl(crl));
+    const auto results = CountCacheResults();
+    assert(results.size() == 1);
+    assert(results.at("layer_hit") == 2);
+
+    FILE* file = fopen(BAKED_CRL.c_str(), "rb");
+    assert(file != nullptr);
+    std::string baked(crl.size() + 1, '\0');
+    assert(fread(&baked[0], 1, baked.size(), file) == crl.size());
+    fclose(file);
+    baked.resize(crl.size());
+    assert(crl == baked);
+}
+
+static void BakedLayerTest()
+{
+    TEST_START();
+
+    RunProviderChild({}, FillCacheChild);
+    remove(BAKED_LAYER.c_str());
+    assert(system(("./az-dcap-bake-layer --cache-dir " + CHILD_CACHE_DIR +
+                   "/.az-dcap-client --output " + BAKED_LAYER + " > /dev/null")
+                      .c_str()) == 0);
+
+    // In front of the filled cache, then of an empty one
+    RunProviderChild(
+        {{"AZDCAP_CACHE_LAYER", BAKED_LAYER}}, LayerHitChild, true);
+    RunProviderChild({{"AZDCAP_CACHE_LAYER", BAKED_LAYER}}, LayerHitChild);
+
+    assert(system(("rm -rf " + CHILD_CACHE_DIR).c_str()) == 0);
+    remove(BAKED_LAYER.c_str());
+    remove(BAKED_CRL.c_str());
+
+    TEST_PASSED();
+}
+#endif
+
 extern void QuoteProvTests()
 {
+#if defined __LINUX__
+    // Must be set before the first call into the library starts the exporter
+    setenv("AZDCAP_METRICS_FILE", METRICS_FILE_NAME, 1);
+    setenv("AZDCAP_METRICS_INTERVAL", "1", 1);
+#endif
+
     libary_type_t library = LoadFunctions();
 
     assert(SGX_PLAT_ERROR_OK == sgx_ql_set_logging_function(Log));
 
+#if defined __LINUX__
+    DisabledCacheTest();
+    HttpFixtureTest();
+    FaultInjectionTest();
+    BakedLayerTest();
+#endif
+    SetLogLevelTest();
+    LogRateLimitTest();
+#if defined __LINUX__
+    MetricsExporterTest();
+#endif
+
     //
     // Get the data from the service
     //
@@ -687,6 +1732,13 @@ extern void QuoteProvTests()
     SetupEnvironment("v2");
     RunQuoteProviderTests();
     GetQveIdentityTest();
+    FetchStatsTest();
+    TraceFunctionTest();
+    TraceFunctionSwapTest();
+#if defined __LINUX__
+    AllocationBudgetTest();
+    SidecarExpiryTest();
+#endif
 
     //
     // Run tests without logging to make sure library can operate
@@ -702,6 +1754,7 @@ extern void QuoteProvTests()
     RunCachePermissionTests(&library);
   
 #if defined __LINUX__
+
     dlclose(library);
 #else
     FreeLibrary(library);
@@ -0,0 +1,588 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+//
+// Local stand-in for the Azure collateral service. Serves canned PCK
+// certificates, TCB info, QE/QvE identities and PCK CRLs with the same
+// issuer chain headers as the real service, so the provider can be tested and
+// benchmarked without network access:
+//
+//   ./test_server --port 8089 --latency-ms 20 --jitter-ms 10 --error-rate 0.01
+//   AZDCAP_BASE_CERT_URL=http://127.0.0.1:8089/sgx/certificates ./tests
+//
+// Only plain HTTP is served; the provider accepts any scheme curl supports.
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "command_line.h"
+
+namespace
+{
+struct options
+{
+    int port = 8089;
+    int latency_ms = 0;
+    int jitter_ms = 0;
+    double error_rate = 0.0;
+    int error_status = 503;
+    int throttle_rps = 0;
+    int max_age = 0;
+    unsigned seed = 0;
+    bool daemon = false;
+    bool verbose = false;
+};
+
+options config;
+
+std::mutex random_mutex;
+std::mt19937 random_engine;
+
+std::mutex throttle_mutex;
+std::chrono::steady_clock::time_point throttle_window_start;
+int throttle_window_count = 0;
+
+std::atomic<uint64_t> next_request_id(1);
+
+//
+// SGX-TCBm value for the PCK certificate, chosen so that the provider reports
+// the CPU SVN 04040204018000000000000000000000 and PCE SVN 5 GetCertsTest
+// expects from the live service.
+//
+constexpr char TCBM[] = "040402040180000000000000000000000500";
+
+constexpr char ROOT_CA_CERT[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "QXp1cmUgRENBUCBDbGllbnQgdGVzdCBzZXJ2ZXIgcm9vdCBDQQ==\n"
+    "-----END CERTIFICATE-----\n";
+constexpr char PCK_CA_CERT[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "QXp1cmUgRENBUCBDbGllbnQgdGVzdCBzZXJ2ZXIgUENLIENB\n"
+    "-----END CERTIFICATE-----\n";
+constexpr char SIGNING_CERT[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "QXp1cmUgRENBUCBDbGllbnQgdGVzdCBzZXJ2ZXIgc2lnbmluZw==\n"
+    "-----END CERTIFICATE-----\n";
+constexpr char PCK_CERT[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "QXp1cmUgRENBUCBDbGllbnQgdGVzdCBzZXJ2ZXIgUENLIGNlcnRpZmljYXRl\n"
+    "-----END CERTIFICATE-----\n";
+constexpr char PCK_CRL[] =
+    "-----BEGIN X509 CRL-----\n"
+    "QXp1cmUgRENBUCBDbGllbnQgdGVzdCBzZXJ2ZXIgQ1JM\n"
+    "-----END X509 CRL-----\n";
+
+struct http_request
+{
+    std::string method;
+    std::string path;
+    bool keep_alive = true;
+};
+
+struct http_response
+{
+    int status = 200;
+    std::string content_type = "application/json";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+};
+
+const char* reason_phrase(int status)
+{
+    switch (status)
+    {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 429:
+            return "Too Many Requests";
+        case 500:
+            return "Internal Server Error";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Unknown";
+    }
+}
+
+std::string url_escape(const std::string& value)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    std::string escaped;
+    for (unsigned char c : value)
+    {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+        {
+            escaped += static_cast<char>(c);
+        }
+        else
+        {
+            escaped += '%';
+            escaped += HEX[c >> 4];
+            escaped += HEX[c & 0xF];
+        }
+    }
+    return escaped;
+}
+
+std::vector<std::string> split_path(const std::string& path)
+{
+    std::vector<std::string> segments;
+    std::string segment;
+    std::istringstream stream(path.substr(0, path.find('?')));
+    while (std::getline(stream, segment, '/'))
+    {
+        if (!segment.empty())
+        {
+            segments.push_back(segment);
+        }
+    }
+    return segments;
+}
+
+bool is_hex(const std::string& value, size_t length)
+{
+    if (value.size() != length)
+    {
+        return false;
+    }
+    for (char c : value)
+    {
+        if (!isxdigit(static_cast<unsigned char>(c)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string enclave_identity(const char* id)
+{
+    std::ostringstream body;
+    body << "{\"enclaveIdentity\":{\"id\":\"" << id << "\",\"version\":2,"
+         << "\"issueDate\":\"2020-01-01T00:00:00Z\","
+         << "\"nextUpdate\":\"2099-01-01T00:00:00Z\","
+         << "\"tcbEvaluationDataNumber\":1,"
+         << "\"miscselect\":\"00000000\",\"miscselectMask\":\"FFFFFFFF\","
+         << "\"attributes\":\"11000000000000000000000000000000\","
+         << "\"attributesMask\":\"FBFFFFFFFFFFFFFF0000000000000000\","
+         << "\"mrsigner\":"
+         << "\"8C4F5775D796503E96137F77C68A829A0056AC8DED70140B081B094490C57BFF\","
+         << "\"isvprodid\":1,\"tcbLevels\":[]},"
+         << "\"signature\":\"00\"}";
+    return body.str();
+}
+
+//
+// Maps the request path onto a canned response. Any base path is accepted,
+// so both AZDCAP_BASE_CERT_URL=http://host:port and .../sgx/certificates
+// work, with or without the collateral version segment.
+//
+http_response route(const http_request& request)
+{
+    http_response response;
+    const std::vector<std::string> segments = split_path(request.path);
+    const std::string signing_chain =
+        url_escape(std::string(SIGNING_CERT) + ROOT_CA_CERT);
+    const size_t count = segments.size();
+
+    if (request.method != "GET")
+    {
+        response.status = 400;
+        return response;
+    }
+
+    if (count >= 1 && segments[count - 1] == "pckcrl")
+    {
+        response.content_type = "application/pkix-crl";
+        response.headers.emplace_back(
+            "SGX-PCK-CRL-Issuer-Chain",
+            url_escape(std::string(PCK_CA_CERT) + ROOT_CA_CERT));
+        response.body = PCK_CRL;
+    }
+    else if (count >= 2 && segments[count - 2] == "tcb")
+    {
+        std::ostringstream body;
+        body << "{\"tcbInfo\":{\"version\":2,"
+             << "\"issueDate\":\"2020-01-01T00:00:00Z\","
+             << "\"nextUpdate\":\"2099-01-01T00:00:00Z\","
+             << "\"fmspc\":\"" << segments[count - 1] << "\","
+             << "\"pceId\":\"0000\",\"tcbType\":0,"
+             << "\"tcbEvaluationDataNumber\":1,\"tcbLevels\":[]},"
+             << "\"signature\":\"00\"}";
+        response.headers.emplace_back(
+            "SGX-TCB-Info-Issuer-Chain", signing_chain);
+        response.body = body.str();
+    }
+    else if (
+        count >= 1 &&
+        (segments[count - 1] == "qeid" || segments[count - 1] == "qveid"))
+    {
+        // v1 clients expect the QE header, v2 clients the enclave one
+        response.headers.emplace_back(
+            "SGX-QE-Identity-Issuer-Chain", signing_chain);
+        response.headers.emplace_back(
+            "SGX-Enclave-Identity-Issuer-Chain", signing_chain);
+        response.body =
+            enclave_identity(segments[count - 1] == "qeid" ? "QE" : "QVE");
+    }
+    else if (
+        count >= 4 && is_hex(segments[count - 4], 32) &&
+        is_hex(segments[count - 3], 32) && is_hex(segments[count - 2], 4) &&
+        is_hex(segments[count - 1], 4))
+    {
+        response.content_type = "application/x-pem-file";
+        response.headers.emplace_back("SGX-TCBm", TCBM);
+        response.headers.emplace_back(
+            "SGX-PCK-Certificate-Issuer-Chain",
+            url_escape(std::string(PCK_CA_CERT) + ROOT_CA_CERT));
+        response.body = PCK_CERT;
+    }
+    else
+    {
+        response.status = 404;
+    }
+
+    return response;
+}
+
+bool throttled()
+{
+    if (config.throttle_rps <= 0)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(throttle_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    if (now - throttle_window_start >= std::chrono::seconds(1))
+    {
+        throttle_window_start = now;
+        throttle_window_count = 0;
+    }
+    return ++throttle_window_count > config.throttle_rps;
+}
+
+//
+// Applies the configured latency, throttling and error injection before
+// routing, the order a request would see them behind a real front door.
+//
+http_response handle(const http_request& request)
+{
+    int delay_ms = config.latency_ms;
+    bool fail = false;
+    {
+        std::lock_guard<std::mutex> lock(random_mutex);
+        if (config.jitter_ms > 0)
+        {
+            delay_ms += std::uniform_int_distribution<int>(
+                0, config.jitter_ms)(random_engine);
+        }
+        if (config.error_rate > 0)
+        {
+            fail = std::uniform_real_distribution<double>(0.0, 1.0)(
+                       random_engine) < config.error_rate;
+        }
+    }
+
+    if (delay_ms > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    }
+
+    http_response response;
+    if (throttled())
+    {
+        response.status = 429;
+        response.headers.emplace_back("Retry-After", "1");
+    }
+    else if (fail)
+    {
+        response.status = config.error_status;
+    }
+    else
+    {
+        response = route(request);
+        if (response.status == 200 && config.max_age > 0)
+        {
+            response.headers.emplace_back(
+                "Cache-Control", "max-age=" + std::to_string(config.max_age));
+        }
+    }
+
+    response.headers.emplace_back(
+        "Request-ID", "test-server-" + std::to_string(next_request_id++));
+    return response;
+}
+
+std::string serialize(const http_response& response, bool keep_alive)
+{
+    std::ostringstream out;
+    out << "HTTP/1.1 " << response.status << ' '
+        << reason_phrase(response.status) << "\r\n";
+    out << "Content-Type: " << response.content_type << "\r\n";
+    out << "Content-Length: " << response.body.size() << "\r\n";
+    out << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n";
+    for (const auto& header : response.headers)
+    {
+        out << header.first << ": " << header.second << "\r\n";
+    }
+    out << "\r\n" << response.body;
+    return out.str();
+}
+
+bool send_all(int fd, const std::string& data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n =
+            send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+std::string lowercase(std::string value)
+{
+    for (auto& c : value)
+    {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return value;
+}
+
+//
+// Parses one request out of 'buffer', consuming it (body included) on
+// success. Returns false when more data is needed.
+//
+bool parse_request(std::string& buffer, http_request& request)
+{
+    const size_t header_end = buffer.find("\r\n\r\n");
+    if (header_end == std::string::npos)
+    {
+        return false;
+    }
+
+    std::istringstream lines(buffer.substr(0, header_end));
+    std::string line;
+    std::getline(lines, line);
+    std::istringstream request_line(line);
+    std::string version;
+    request_line >> request.method >> request.path >> version;
+    request.keep_alive = version == "HTTP/1.1";
+
+    size_t content_length = 0;
+    while (std::getline(lines, line))
+    {
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos)
+        {
+            continue;
+        }
+        const std::string name = lowercase(line.substr(0, colon));
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        value.erase(value.find_last_not_of("\r ") + 1);
+        if (name == "content-length")
+        {
+            content_length = strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (name == "connection")
+        {
+            request.keep_alive = lowercase(value) != "close";
+        }
+    }
+
+    const size_t total = header_end + 4 + content_length;
+    if (buffer.size() < total)
+    {
+        return false;
+    }
+    buffer.erase(0, total);
+    return true;
+}
+
+void serve_connection(int fd)
+{
+    // Drop idle keep-alive connections eventually
+    timeval timeout = {30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open)
+    {
+        http_request request;
+        while (!parse_request(buffer, request))
+        {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                close(fd);
+                return;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+
+        const http_response response = handle(request);
+        if (config.verbose)
+        {
+            fprintf(
+                stderr,
+                "%s %s -> %d\n",
+                request.method.c_str(),
+                request.path.c_str(),
+                response.status);
+        }
+        open = send_all(fd, serialize(response, request.keep_alive)) &&
+               request.keep_alive;
+    }
+    close(fd);
+}
+
+void usage(const char* program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "  --port N          port to listen on, 0 picks one (default 8089)\n"
+        "  --latency-ms N    delay added to every response\n"
+        "  --jitter-ms N     extra uniformly distributed delay, 0..N ms\n"
+        "  --error-rate P    fraction of requests failed, 0.0-1.0\n"
+        "  --error-status N  status for failed requests (default 503)\n"
+        "  --throttle N      answer 429 past N requests per second\n"
+        "  --max-age N       Cache-Control max-age sent with every answer\n"
+        "  --seed N          random seed for jitter and errors\n"
+        "  --daemon          fork once listening and print the child's pid\n"
+        "  --verbose         log each request to stderr\n",
+        program);
+}
+
+bool parse_options(int argc, char** argv)
+{
+    if (!parse_command_line(
+            argc,
+            argv,
+            {{"--daemon", &config.daemon}, {"--verbose", &config.verbose}},
+            {{"--port", [](const char* value) { config.port = atoi(value); }},
+             {"--latency-ms", [](const char* value) { config.latency_ms = atoi(value); }},
+             {"--jitter-ms", [](const char* value) { config.jitter_ms = atoi(value); }},
+             {"--error-rate", [](const char* value) { config.error_rate = atof(value); }},
+             {"--error-status", [](const char* value) { config.error_status = atoi(value); }},
+             {"--throttle", [](const char* value) { config.throttle_rps = atoi(value); }},
+             {"--max-age", [](const char* value) { config.max_age = atoi(value); }},
+             {"--seed", [](const char* value) {
+                  config.seed = static_cast<unsigned>(strtoul(value, nullptr, 10));
+              }}}))
+    {
+        return false;
+    }
+    return config.port >= 0 && config.latency_ms >= 0 &&
+           config.jitter_ms >= 0 && config.error_rate >= 0.0 &&
+           config.error_rate <= 1.0;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    random_engine.seed(config.seed);
+    throttle_window_start = std::chrono::steady_clock::now();
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(config.port));
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+            0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    socklen_t length = sizeof(address);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+    const int port = ntohs(address.sin_port);
+
+    if (config.daemon)
+    {
+        if (!start_daemon())
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        printf("Listening on http://127.0.0.1:%d\n", port);
+    }
+    fflush(stdout);
+
+    signal(SIGPIPE, SIG_IGN);
+    for (;;)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        std::thread(serve_connection, fd).detach();
+    }
+}
@@ -261,8 +261,43 @@ DWORD curl_easy::get_response_code() const
     return dwStatusCode;
 }
 
+//
+// Records the total duration of perform() and the bytes received when it goes
+// out of scope, whether perform() returns or throws. WinHTTP does not break
+// the duration down by phase or report connection reuse.
+//
+class perform_timer
+{
+  public:
+    perform_timer(fetch_timings& timings, const std::vector<uint8_t>& body)
+        : timings(timings), body(body), start(std::chrono::steady_clock::now())
+    {
+        timings = fetch_timings();
+    }
+
+    ~perform_timer()
+    {
+        timings.total =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        timings.bytes_downloaded = body.size();
+    }
+
+  private:
+    fetch_timings& timings;
+    const std::vector<uint8_t>& body;
+    std::chrono::steady_clock::time_point start;
+};
+
+const fetch_timings& curl_easy::get_timings() const
+{
+    return timings;
+}
+
 void curl_easy::perform() const
 {
+    perform_timer timer(timings, body);
     int retry_delay = initial_retry_delay_ms;
     int attempts = 0;
     do
@@ -291,7 +326,7 @@ void curl_easy::perform() const
                 if (attempts <= maximum_retries)
                 {
                     attempts++;
-                    log(SGX_QL_LOG_INFO,
+                    LOG_INFO(
                         "CURL timeout detected (WINHTTP Error %zd). Retrying "
                         "after %d milliseconds (attempt %d / %d) ",
                         lastError,
@@ -308,14 +343,18 @@ void curl_easy::perform() const
         }
 
         DWORD response_code = get_response_code();
+        timings.http_status = response_code;
         if (response_code >= HTTP_STATUS_BAD_REQUEST && response_code <= HTTP_STATUS_SERVER_ERROR)
         {
-            log(SGX_QL_LOG_INFO,
+            LOG_INFO(
                 "HTTP Error (%d) on curl->perform() request",
                 response_code);
             throw_on_error(
                 WINHTTP_ERROR_BASE, "curl_easy::perform");
         }
+
+        // Read the body now so that it counts towards the fetch time and size
+        get_body();
         return;
     } while (true);
 }
@@ -415,7 +454,7 @@ void curl_easy::set_headers(
     request_header_text = L"";
     for (auto kvp : header_name_values)
     {
-        request_header_text.append(UnicodeStringFromUtf8String(kvp.first + ":" + kvp.second));
+        request_header_text.append(UnicodeStringFromUtf8String(kvp.first + ":" + kvp.second + "\r\n"));
     }
 }
 
@@ -551,7 +590,7 @@ void curl_easy::throw_on_error(DWORD code, const char* function)
 {
     if (code != 0)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Encountered CURL error %d in %s",
             code,
             function);
@@ -15,6 +15,7 @@
 #include <string>
 #include <vector>
 #include <wil\resource.h>
+#include "telemetry.h"
 
 const DWORD CURLE_HTTP_RETURNED_ERROR = 0x7fff;
 //
@@ -50,6 +51,10 @@ class curl_easy
 
     void perform() const;
 
+    // Phase durations of the most recent perform(). WinHTTP does not break
+    // the transfer down, so only the total is filled in.
+    const fetch_timings& get_timings() const;
+
     const std::vector<uint8_t>& get_body() const;
 
     const std::string* get_header(const std::string& field_name) const;
@@ -57,6 +62,9 @@ class curl_easy
     void set_headers(
         const std::map<std::string, std::string>& header_name_values);
 
+    // Only used by the Linux sidecar.
+    void set_cache_max_age(int64_t) {}
+
     std::string unescape(const std::string& encoded) const;
     static std::string escape(const char* url, int length);
 
@@ -80,6 +88,7 @@ class curl_easy
     mutable std::map<std::string, std::string> headers; // response headers
     mutable std::wstring request_header_text;
     mutable std::string request_body_data;
+    mutable fetch_timings timings;
 };
 
 #endif
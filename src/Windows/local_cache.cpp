@@ -1,6 +1,8 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <mutex>
 #include <windows.h>
@@ -16,6 +18,7 @@
 #include <cstdio>
 #include <filesystem>
 #include <wil\resource.h>
+#include "local_cache.h"
 
 #define NT_SUCCESS(Status)          (((NTSTATUS)(Status)) >= 0)
 
@@ -28,6 +31,49 @@ constexpr uint16_t CACHE_V1 = 1;
 
 static std::wstring g_cache_dirname;
 
+// See init(), and its Linux counterpart
+static std::mutex init_lock;
+static constexpr std::chrono::seconds INIT_RETRY_MIN(1);
+static constexpr std::chrono::seconds INIT_RETRY_MAX(60);
+static std::chrono::seconds init_retry_delay(0);
+static std::chrono::steady_clock::time_point next_init_attempt;
+
+//
+// Contention counters for each local_cache_lock. Windows has no directory
+// mutex; file locking is done with share modes, and contention shows up as
+// sharing violations which OpenHandle retries.
+//
+struct lock_counters
+{
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> total_wait_ns{0};
+    std::atomic<uint64_t> max_wait_ns{0};
+};
+
+static lock_counters lock_stats[static_cast<size_t>(local_cache_lock::count)];
+
+static void record_lock_wait(
+    local_cache_lock lock,
+    std::chrono::steady_clock::time_point wait_start)
+{
+    const uint64_t wait_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - wait_start)
+            .count());
+
+    lock_counters& counters = lock_stats[static_cast<size_t>(lock)];
+    counters.contended.fetch_add(1, std::memory_order_relaxed);
+    counters.total_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+
+    uint64_t max_wait_ns = counters.max_wait_ns.load(std::memory_order_relaxed);
+    while (wait_ns > max_wait_ns &&
+           !counters.max_wait_ns.compare_exchange_weak(
+               max_wait_ns, wait_ns, std::memory_order_relaxed))
+    {
+    }
+}
+
 static void throw_if(bool should_throw, const std::string& error)
 {
     if (should_throw)
@@ -84,10 +130,45 @@ static void init_callback()
     g_cache_dirname = dirname;
 }
 
-static void init()
+//
+// Returns false while the cache is disabled. An attempt at creating the
+// cache directory which fails throws, the calls until the next attempt do
+// not.
+//
+static bool init()
+{
+    std::lock_guard<std::mutex> lock(init_lock);
+    if (!g_cache_dirname.empty())
+    {
+        return true;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (init_retry_delay.count() > 0 && now < next_init_attempt)
+    {
+        return false;
+    }
+
+    try
+    {
+        init_callback();
+    }
+    catch (std::runtime_error&)
+    {
+        init_retry_delay = init_retry_delay.count() == 0
+                               ? INIT_RETRY_MIN
+                               : (std::min)(init_retry_delay * 2, INIT_RETRY_MAX);
+        next_init_attempt = now + init_retry_delay;
+        throw;
+    }
+
+    init_retry_delay = std::chrono::seconds(0);
+    return true;
+}
+
+bool local_cache_enabled()
 {
-    static std::once_flag init_flag;
-    std::call_once(init_flag, init_callback);
+    return init();
 }
 
 static std::wstring sha256(size_t data_size, const void* data)
@@ -196,7 +277,10 @@ static std::wstring get_file_name(const std::string& id)
 
 void local_cache_clear()
 {
-    init();
+    if (!init())
+    {
+        return;
+    }
 
     WIN32_FIND_DATA data;
     std::wstring baseDir(g_cache_dirname.begin(), g_cache_dirname.end());
@@ -224,13 +308,31 @@ wil::unique_hfile OpenHandle(LPCWSTR lpFileName, DWORD dwDesiredAccess, DWORD dw
     
     wil::unique_hfile file;
     int i = 0;
+    std::chrono::steady_clock::time_point wait_start;
     do {
         file.reset(CreateFile(lpFileName, dwDesiredAccess, dwShareMode, lpSecurityAttributes,
             dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile));
+        if (i == 0 && !file && GetLastError() == ERROR_SHARING_VIOLATION)
+        {
+            wait_start = std::chrono::steady_clock::now();
+        }
         Sleep(SLEEP_RETRY_MS);
         i++;
     } while (!file && (GetLastError() == ERROR_SHARING_VIOLATION) && (i < MAX_RETRY));
 
+    const local_cache_lock lock = (dwDesiredAccess & GENERIC_WRITE)
+                                      ? local_cache_lock::file_exclusive
+                                      : local_cache_lock::file_shared;
+    if (file)
+    {
+        lock_stats[static_cast<size_t>(lock)].acquisitions.fetch_add(
+            1, std::memory_order_relaxed);
+    }
+    if (i > 1)
+    {
+        record_lock_wait(lock, wait_start);
+    }
+
     return std::move(file);
 }
 
@@ -241,7 +343,10 @@ void local_cache_add(const std::string& id, time_t expiry, size_t data_size, con
     throw_if(data_size == 0, "Data cannot be empty.");
     throw_if(data == nullptr, "Data pointer must not be NULL.");
 
-    init();
+    if (!init())
+    {
+        return;
+    }
     CacheEntryHeaderV1 header{};
     header.version = CACHE_V1;
     header.expiry = expiry;
@@ -266,7 +371,10 @@ std::unique_ptr<std::vector<uint8_t>> local_cache_get(
     const std::string& id)
 {
     throw_if(id.empty(), "The 'id' parameter must not be empty.");
-    init();
+    if (!init())
+    {
+        return nullptr;
+    }
 
     std::wstring filename = get_file_name(id);
     
@@ -307,3 +415,106 @@ std::unique_ptr<std::vector<uint8_t>> local_cache_get(
 
     return cache_entry;
 }
+
+//
+// The fill lock is a file beside the entry, opened without sharing. Closing
+// the handle releases it, also when the holder dies, and deletes the file.
+//
+struct windows_fill_lock : local_cache_fill_lock
+{
+    wil::unique_hfile file;
+};
+
+std::unique_ptr<local_cache_fill_lock> local_cache_lock_fill(
+    const std::string& id,
+    std::chrono::milliseconds timeout)
+{
+    throw_if(id.empty(), "The 'id' parameter must not be empty.");
+    if (!init())
+    {
+        return nullptr;
+    }
+
+    auto lock = std::make_unique<windows_fill_lock>();
+    const std::wstring lock_name = get_file_name(id) + L".lock";
+    const auto wait_start = std::chrono::steady_clock::now();
+    const auto deadline = wait_start + timeout;
+    DWORD interval_ms = 2;
+    for (;;)
+    {
+        lock->file.reset(CreateFile(lock_name.c_str(), GENERIC_WRITE | DELETE, 0, nullptr,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, nullptr));
+        if (lock->file)
+        {
+            break;
+        }
+        // While the holder's close is deleting the file, opening it fails
+        // with ERROR_ACCESS_DENIED rather than a sharing violation
+        const DWORD error = GetLastError();
+        throw_if(error != ERROR_SHARING_VIOLATION && error != ERROR_ACCESS_DENIED,
+            "Opening lock file failed");
+
+        lock->waited = true;
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            break;
+        }
+        Sleep(interval_ms);
+        interval_ms = (std::min)(interval_ms * 2, static_cast<DWORD>(50));
+    }
+
+    if (lock->waited)
+    {
+        record_lock_wait(local_cache_lock::fill, wait_start);
+    }
+    if (!lock->file)
+    {
+        return nullptr;
+    }
+
+    lock_stats[static_cast<size_t>(local_cache_lock::fill)].acquisitions.fetch_add(
+        1, std::memory_order_relaxed);
+    return std::move(lock);
+}
+
+bool local_cache_size(uint64_t& size)
+{
+    std::wstring searchPattern;
+    {
+        std::lock_guard<std::mutex> lock(init_lock);
+        if (g_cache_dirname.empty())
+        {
+            return false;
+        }
+        searchPattern = g_cache_dirname + L"\\*";
+    }
+
+    WIN32_FIND_DATA data;
+    size = 0;
+    wil::unique_hfind hFind(FindFirstFile(searchPattern.c_str(), &data));
+    if (hFind)
+    {
+        do {
+            if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                size += (static_cast<uint64_t>(data.nFileSizeHigh) << 32) |
+                        data.nFileSizeLow;
+            }
+        } while (FindNextFile(hFind.get(), &data));
+    }
+
+    return true;
+}
+
+local_cache_lock_stats local_cache_get_lock_stats(local_cache_lock lock)
+{
+    const lock_counters& counters = lock_stats[static_cast<size_t>(lock)];
+
+    local_cache_lock_stats stats;
+    stats.acquisitions = counters.acquisitions.load(std::memory_order_relaxed);
+    stats.contended = counters.contended.load(std::memory_order_relaxed);
+    stats.total_wait_ns =
+        counters.total_wait_ns.load(std::memory_order_relaxed);
+    stats.max_wait_ns = counters.max_wait_ns.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,25 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef ALLOC_TRACKING_H
+#define ALLOC_TRACKING_H
+
+#include <cstdint>
+
+struct allocation_stats
+{
+    uint64_t count;
+    uint64_t bytes;
+};
+
+//
+// Counts heap allocations made by the calling thread between start and stop,
+// including those made inside the provider library and its dependencies.
+// Linux only: executables linking alloc_tracking.cpp, the tests and
+// microbench, interpose the allocator.
+//
+void allocation_tracking_start();
+allocation_stats allocation_tracking_stop();
+
+#endif
@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef CACHE_LAYER_H
+#define CACHE_LAYER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// Read-only cache layer baked into an image (see Linux/cache_layer_bake.cpp),
+// for containers whose root filesystem cannot hold the writable cache.
+// AZDCAP_CACHE_LAYER names a layer file, or a directory whose files are all
+// layers. Layers are mapped into memory once and consulted before the local
+// cache, without any locking or writes. Expired entries are skipped, and a
+// whole layer is skipped once it is older than AZDCAP_CACHE_LAYER_MAX_AGE
+// seconds (one day by default, the longest the provider caches anything).
+//
+// A layer is a cache_layer_header, entry_count cache_layer_records sorted by
+// key, then the entry data. The key is the SHA-256 of the cache id, as in
+// the names of the local cache files. Integers are in host byte order.
+//
+
+constexpr char CACHE_LAYER_MAGIC[8] = {'A', 'Z', 'D', 'C', 'L', 'A', 'Y', 'R'};
+constexpr uint32_t CACHE_LAYER_VERSION = 1;
+constexpr size_t CACHE_LAYER_KEY_SIZE = 32;
+
+struct cache_layer_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    int64_t build_time; // seconds since the epoch
+};
+
+struct cache_layer_record
+{
+    uint8_t key[CACHE_LAYER_KEY_SIZE];
+    int64_t expiry; // seconds since the epoch
+    uint64_t offset; // of the data, from the start of the layer
+    uint64_t size;
+};
+
+static_assert(sizeof(cache_layer_header) == 24, "cache_layer_header is part of the file format");
+static_assert(sizeof(cache_layer_record) == 56, "cache_layer_record is part of the file format");
+
+//
+// Look up an entry in the configured layers. Returns nullptr if no fresh
+// layer holds an unexpired entry for 'id'. Never throws for a missing or
+// malformed layer, which is ignored.
+//
+#ifdef __LINUX__
+std::unique_ptr<std::vector<uint8_t>> cache_layer_get(const std::string& id);
+#else
+inline std::unique_ptr<std::vector<uint8_t>> cache_layer_get(const std::string&)
+{
+    return nullptr;
+}
+#endif
+
+#endif
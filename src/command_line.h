@@ -0,0 +1,46 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef COMMAND_LINE_H
+#define COMMAND_LINE_H
+
+#include <functional>
+#include <initializer_list>
+
+//
+// Command line handling shared by the tools built beside the library,
+// az-dcap-sidecar and test_server.
+//
+
+struct command_line_flag
+{
+    const char* name;
+    bool* value; // set when the flag is given
+};
+
+struct command_line_option
+{
+    const char* name;
+    std::function<void(const char* value)> set; // called with the next argument
+};
+
+//
+// Returns false on an unknown argument or an option missing its value.
+//
+bool parse_command_line(
+    int argc,
+    char** argv,
+    std::initializer_list<command_line_flag> flags,
+    std::initializer_list<command_line_option> options);
+
+//
+// --daemon, for a tool which is already listening so that callers can
+// connect as soon as it returns: forks, and the parent prints the child's
+// pid and exits. The child starts a session of its own and closes stdout, so
+// that a caller reading it, e.g. pid=`test_server --daemon`, sees end of
+// file. Returns false, having said why, if that fails.
+//
+bool start_daemon();
+
+#endif
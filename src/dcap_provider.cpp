@@ -3,12 +3,17 @@
 
 #include "dcap_provider.h"
 #include <curl_easy.h>
+#include "cache_layer.h"
 #include "local_cache.h"
 #include "private.h"
+#include "probes.h"
+#include "telemetry.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdarg>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 #include <memory>
@@ -53,8 +58,7 @@ static const std::map<std::string, std::string> default_values = {
 constexpr char API_VERSION_LEGACY[] = "api-version=2018-10-01-preview";
 constexpr char API_VERSION[] = "api-version=2020-02-12-preview";
 
-static char DEFAULT_CERT_URL[] =
-    "https://global.acccache.azure.net/sgx/certificates";
+static char DEFAULT_CERT_URL[] = AZDCAP_DEFAULT_BASE_URL;
 static std::string cert_base_url = DEFAULT_CERT_URL;
 
 static char DEFAULT_CLIENT_ID[] = "production_client";
@@ -63,6 +67,9 @@ static std::string prod_client_id = DEFAULT_CLIENT_ID;
 static char DEFAULT_COLLATERAL_VERSION[] = "v2";
 static std::string default_collateral_version = DEFAULT_COLLATERAL_VERSION;
 
+// Longest a cache miss waits for another process fetching the same entry
+static constexpr unsigned long DEFAULT_CACHE_FILL_WAIT_MS = 5000;
+
 static char CRL_CA_PROCESSOR[] = "processor";
 static char CRL_CA_PLATFORM[] = "platform";
 static char ROOT_CRL_NAME[] =
@@ -85,7 +92,7 @@ static std::string get_env_variable(std::string env_variable)
     auto retval = get_env_variable_no_log(env_variable);
     if (!retval.second.empty())
     {
-        log(SGX_QL_LOG_ERROR, retval.second.c_str());
+        LOG_ERROR(retval.second.c_str());
     }
     return retval.first;
 }
@@ -97,7 +104,7 @@ static std::string get_collateral_version()
 
     if (collateral_version.empty())
     {
-        log(SGX_QL_LOG_WARNING,
+        LOG_WARNING(
             "Using default collateral version '%s'.",
             default_collateral_version.c_str());
         return default_collateral_version;
@@ -107,19 +114,19 @@ static std::string get_collateral_version()
         if (!collateral_version.compare("v1") &&
             !collateral_version.compare("v2"))
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Value specified in environment variable '%s' is invalid. "
                 "Acceptable values are empty, v1, or v2",
                 collateral_version.c_str(),
                 MAX_ENV_VAR_LENGTH);
 
-            log(SGX_QL_LOG_WARNING,
+            LOG_WARNING(
                 "Using default collateral version '%s'.",
                 default_collateral_version.c_str());
             return default_collateral_version;
         }
 
-        log(SGX_QL_LOG_INFO,
+        LOG_INFO(
             "Using %s envvar for collateral version URL, set to '%s'.",
             ENV_AZDCAP_COLLATERAL_VER,
             collateral_version.c_str());
@@ -133,13 +140,13 @@ static std::string get_base_url()
 
     if (env_base_url.empty())
     {
-        log(SGX_QL_LOG_WARNING,
+        LOG_WARNING(
             "Using default base cert URL '%s'.",
             cert_base_url.c_str());
         return cert_base_url;
     }
 
-    log(SGX_QL_LOG_INFO,
+    LOG_INFO(
         "Using %s envvar for base cert URL, set to '%s'.",
         ENV_AZDCAP_BASE_URL,
         env_base_url.c_str());
@@ -152,13 +159,13 @@ static std::string get_client_id()
 
     if (env_client_id.empty())
     {
-        log(SGX_QL_LOG_WARNING,
+        LOG_WARNING(
             "Using default client id '%s'.",
             prod_client_id.c_str());
         return prod_client_id;
     }
 
-    log(SGX_QL_LOG_INFO,
+    LOG_INFO(
         "Using %s envvar for client id, set to '%s'.",
         ENV_AZDCAP_CLIENT_ID,
         env_client_id.c_str());
@@ -175,7 +182,7 @@ static inline quote3_error_t fill_qpl_string_buffer(
     buffer = new char[bufferLength];
     if (buffer == nullptr)
     {
-        log(SGX_QL_LOG_ERROR, "Out of memory thrown");
+        LOG_ERROR("Out of memory thrown");
         return SGX_QL_ERROR_OUT_OF_MEMORY;
     }
 
@@ -193,7 +200,7 @@ static inline quote3_error_t fill_qpl_string_buffer(
     buffer = new char[bufferLength];
     if (!buffer)
     {
-        log(SGX_QL_LOG_ERROR, "Out of memory thrown");
+        LOG_ERROR("Out of memory thrown");
         return SGX_QL_ERROR_OUT_OF_MEMORY;
     }
     memcpy(buffer, content.data(), content.size());
@@ -272,6 +279,143 @@ std::string get_collateral_friendly_name(CollateralTypes collateral_type)
     }
 }
 
+//
+// The kind of each collateral type, for use in telemetry
+//
+static telemetry_collateral get_telemetry_collateral(CollateralTypes collateral_type)
+{
+    switch (collateral_type)
+    {
+        case CollateralTypes::TcbInfo:
+            return telemetry_collateral::tcb_info;
+        case CollateralTypes::QeIdentity:
+            return telemetry_collateral::qe_identity;
+        case CollateralTypes::QveIdentity:
+            return telemetry_collateral::qve_identity;
+        case CollateralTypes::PckCert:
+            return telemetry_collateral::pck_cert;
+        case CollateralTypes::PckCrl:
+            return telemetry_collateral::pck_crl;
+        case CollateralTypes::PckRootCrl:
+            return telemetry_collateral::root_ca_crl;
+        default:
+            return telemetry_collateral::unknown;
+    }
+}
+
+//
+// Get a short identifier for each collateral type, for use in telemetry
+//
+static const char* get_collateral_metric_name(CollateralTypes collateral_type)
+{
+    return telemetry_collateral_name(get_telemetry_collateral(collateral_type));
+}
+
+//
+// Tag a request with the request ID of the API call in progress, and
+// optionally with the default headers.
+//
+static void set_request_headers(curl_easy& curl, bool include_defaults)
+{
+    std::map<std::string, std::string> values;
+    if (include_defaults)
+    {
+        values = headers::default_values;
+    }
+
+    const std::string& request_id = current_request_id();
+    if (!request_id.empty())
+    {
+        values[headers::REQUEST_ID] = request_id;
+    }
+
+    if (!values.empty())
+    {
+        curl.set_headers(values);
+    }
+}
+
+//
+// Host name part of a URL, used to group fetch statistics by endpoint.
+//
+static std::string get_url_host(const std::string& url)
+{
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    const size_t end = url.find_first_of(":/?", start);
+    return url.substr(start, end == std::string::npos ? end : end - start);
+}
+
+static void record_fetch(
+    const curl_easy& curl,
+    const std::string& host,
+    const char* collateral,
+    int error_code,
+    trace_span& span)
+{
+    const fetch_timings& timings = curl.get_timings();
+    telemetry_record_fetch(
+        host,
+        collateral,
+        error_code,
+        timings,
+        curl.get_header(headers::REQUEST_ID));
+
+    if (span.active())
+    {
+        span.set_end_attribute(
+            "http.response.status_code", std::to_string(timings.http_status));
+        span.set_end_attribute(
+            "http.response.body.size",
+            std::to_string(timings.bytes_downloaded));
+        if (error_code != 0)
+        {
+            span.set_end_attribute("error.type", std::to_string(error_code));
+        }
+    }
+}
+
+//
+// Perform a request for 'url' inside an http_fetch trace span, recording its
+// timings and the service's request ID whether or not it succeeds.
+//
+static void perform_request(
+    curl_easy& curl,
+    const std::string& url,
+    CollateralTypes collateral_type)
+{
+    time_t expiry = 0;
+    if (get_cache_expiration_time(collateral_type, expiry))
+    {
+        curl.set_cache_max_age(expiry - time(nullptr));
+    }
+
+    const std::string host = get_url_host(url);
+    const char* collateral = get_collateral_metric_name(collateral_type);
+    trace_span span(
+        "http_fetch",
+        {{"server.address", host.c_str()},
+         {"url.full", url.c_str()},
+         {"dcap.collateral", collateral}});
+
+    try
+    {
+        curl.perform();
+    }
+    catch (const curl_easy::error& error)
+    {
+        record_fetch(
+            curl, host, collateral, static_cast<int>(error.code), span);
+        throw;
+    }
+    catch (...)
+    {
+        record_fetch(curl, host, collateral, -1, span);
+        throw;
+    }
+    record_fetch(curl, host, collateral, 0, span);
+}
+
 //
 // get raw value for header_item item if exists
 //
@@ -283,16 +427,16 @@ sgx_plat_error_t get_raw_header(
     const std::string* raw_header = curl.get_header(header_item);
     if (raw_header == nullptr)
     {
-        log(SGX_QL_LOG_ERROR, "Header '%s' is missing.", header_item.c_str());
+        LOG_ERROR("Header '%s' is missing.", header_item.c_str());
         return SGX_PLAT_ERROR_UNEXPECTED_SERVER_RESPONSE;
     }
     if (out_header != nullptr)
     {
         *out_header = *raw_header;
-        log(SGX_QL_LOG_INFO,
+        LOG_INFO(
             "raw_header %s:[%s]\n",
             header_item.c_str(),
-            raw_header->c_str());
+            log_value(*raw_header).c_str());
     }
     return SGX_PLAT_ERROR_OK;
 }
@@ -312,10 +456,10 @@ sgx_plat_error_t get_unescape_header(
     if (result != SGX_PLAT_ERROR_OK)
         return result;
     *unescape_header = curl.unescape(raw_header);
-    log(SGX_QL_LOG_INFO,
+    LOG_INFO(
         "unescape_header %s:[%s]\n",
         header_item.c_str(),
-        unescape_header->c_str());
+        log_value(*unescape_header).c_str());
     return result;
 }
 
@@ -337,7 +481,7 @@ static std::string format_as_hex_string(
 
     formatted_buffer[formatted_buffer_size - 1] = '\0';
 
-    return formatted_buffer.get();
+    return std::string(formatted_buffer.get(), formatted_buffer_size - 1);
 }
 
 //
@@ -482,7 +626,7 @@ static std::string build_cert_chain(const curl_easy& curl)
     const std::string chain =
         curl.unescape(*curl.get_header(headers::PCK_CERT_ISSUER_CHAIN));
 
-    log(SGX_QL_LOG_INFO, "libquote_provider.so: [%s]\n", chain.c_str());
+    LOG_INFO("libquote_provider.so: [%s]\n", log_value(chain).c_str());
     return leaf_cert + chain;
 }
 
@@ -497,7 +641,7 @@ static sgx_plat_error_t hex_decode(const std::string& hex_string, T* decoded)
     static constexpr size_t EXPECTED_STRING_SIZE = 2 * sizeof(T);
     if (hex_string.size() != EXPECTED_STRING_SIZE)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Malformed hex-encoded data. Size is not %u.",
             EXPECTED_STRING_SIZE);
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
@@ -513,7 +657,7 @@ static sgx_plat_error_t hex_decode(const std::string& hex_string, T* decoded)
 
         if (*end != 0)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Malformed hex-encoded data. '%s' is not a hex integer value.",
                 byte_string.c_str());
             return SGX_PLAT_ERROR_INVALID_PARAMETER;
@@ -547,25 +691,25 @@ static sgx_plat_error_t parse_svn_values(
 
     if (tcb.size() != CPUSVN_SIZE + PCESVN_SIZE)
     {
-        log(SGX_QL_LOG_ERROR, "TCB info header is malformed.");
+        LOG_ERROR("TCB info header is malformed.");
         return SGX_PLAT_ERROR_UNEXPECTED_SERVER_RESPONSE;
     }
 
     const std::string cpu_svn_string = tcb.substr(0, CPUSVN_SIZE);
-    log(SGX_QL_LOG_INFO, "CPU SVN: '%s'.", cpu_svn_string.c_str());
+    LOG_INFO("CPU SVN: '%s'.", cpu_svn_string.c_str());
     if (const sgx_plat_error_t err =
             hex_decode(cpu_svn_string, &quote_config->cert_cpu_svn))
     {
-        log(SGX_QL_LOG_ERROR, "CPU SVN is malformed.");
+        LOG_ERROR("CPU SVN is malformed.");
         return err;
     }
 
     const std::string pce_svn_string = tcb.substr(CPUSVN_SIZE, PCESVN_SIZE);
-    log(SGX_QL_LOG_INFO, "PCE ISV SVN: '%s'.", pce_svn_string.c_str());
+    LOG_INFO("PCE ISV SVN: '%s'.", pce_svn_string.c_str());
     if (const sgx_plat_error_t err =
             hex_decode(pce_svn_string, &quote_config->cert_pce_isv_svn))
     {
-        log(SGX_QL_LOG_ERROR, "PCE ISV SVN is malformed.");
+        LOG_ERROR("PCE ISV SVN is malformed.");
         return err;
     }
 
@@ -576,7 +720,7 @@ static sgx_plat_error_t parse_svn_values(
             byte_swap(quote_config->cert_pce_isv_svn);
     }
 
-    log(SGX_QL_LOG_INFO,
+    LOG_INFO(
         "PCE SVN parsed as '0x%04x'",
         quote_config->cert_pce_isv_svn);
 
@@ -641,7 +785,7 @@ static sgx_plat_error_t build_pck_crl_url(
     std::string crl_url = params.crl_urls[crl_index];
     if (crl_url.empty())
     {
-        log(SGX_QL_LOG_ERROR, "Empty input CRL string.");
+        LOG_ERROR("Empty input CRL string.");
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
     }
 
@@ -726,15 +870,39 @@ static std::string build_enclave_id_url(
 static std::unique_ptr<std::vector<uint8_t>> try_cache_get(
     const std::string& cert_url)
 {
+    trace_span span("cache_lookup", {{"dcap.cache_key", cert_url.c_str()}});
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<std::vector<uint8_t>> entry;
     try 
     {
-        return local_cache_get(cert_url);
+        // The read-only layer baked into the image comes first, see
+        // cache_layer.h
+        entry = cache_layer_get(cert_url);
+        if (entry)
+        {
+            span.set_end_attribute("dcap.cache_result", "layer_hit");
+        }
+        else if (!local_cache_enabled())
+        {
+            span.set_end_attribute("dcap.cache_result", "disabled");
+        }
+        else
+        {
+            entry = local_cache_get(cert_url);
+            span.set_end_attribute("dcap.cache_result", entry ? "hit" : "miss");
+        }
     }
     catch (std::runtime_error& error)
     {
-        log(SGX_QL_LOG_WARNING, "Unable to access cache: %s", error.what());
-        return nullptr;
+        LOG_WARNING("Unable to access cache: %s", error.what());
+        span.set_end_attribute("dcap.cache_result", "error");
     }
+
+    telemetry_record_cache_lookup(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+    return entry;
 }
 
 static std::string get_issuer_chain_cache_name(std::string url)
@@ -742,40 +910,129 @@ static std::string get_issuer_chain_cache_name(std::string url)
     return url + "IssuerChain";
 }
 
-static quote3_error_t get_collateral(
+//
+// How long a cache miss waits for another process (or thread) which is
+// already fetching the same entry, see local_cache_lock_fill.
+// AZDCAP_CACHE_FILL_WAIT_MS=0 turns the coordination off.
+//
+static std::chrono::milliseconds get_cache_fill_wait()
+{
+    static const std::chrono::milliseconds wait = [] {
+        const std::string value =
+            get_env_variable_no_log(ENV_AZDCAP_CACHE_FILL_WAIT_MS).first;
+        return std::chrono::milliseconds(
+            value.empty() ? DEFAULT_CACHE_FILL_WAIT_MS
+                          : strtoul(value.c_str(), nullptr, 10));
+    }();
+    return wait;
+}
+
+//
+// Take the fill lock for an entry missing from the cache, so that only one
+// of the processes sharing the cache fetches it. Returns nullptr if the
+// entry should be fetched without it.
+//
+static std::unique_ptr<local_cache_fill_lock> lock_cache_fill(
+    const std::string& url)
+{
+    const std::chrono::milliseconds wait = get_cache_fill_wait();
+    if (wait.count() == 0)
+    {
+        return nullptr;
+    }
+
+    try
+    {
+        if (!local_cache_enabled())
+        {
+            return nullptr;
+        }
+
+        auto lock = local_cache_lock_fill(url, wait);
+        if (!lock)
+        {
+            LOG_WARNING(
+                "Timed out waiting for another process to fetch '%s'",
+                url.c_str());
+        }
+        return lock;
+    }
+    catch (std::runtime_error& error)
+    {
+        LOG_WARNING("Unable to lock cache entry: %s", error.what());
+        return nullptr;
+    }
+}
+
+static bool try_cache_get_collateral(
+    const std::string& url,
+    std::vector<uint8_t>& response_body,
+    std::string& issuer_chain)
+{
+    if (auto cache_hit_collateral = try_cache_get(url))
+    {
+        if (auto cache_hit_issuer_chain =
+                try_cache_get(get_issuer_chain_cache_name(url)))
+        {
+            response_body = *cache_hit_collateral;
+            issuer_chain = std::string(
+                cache_hit_issuer_chain->begin(), cache_hit_issuer_chain->end());
+            return true;
+        }
+    }
+    return false;
+}
+
+static quote3_error_t lookup_collateral(
     CollateralTypes collateral_type,
     std::string url,
     const char header_name[],
     std::vector<uint8_t>& response_body,
     std::string& issuer_chain,
-    const std::string* const request_body = nullptr)
+    const std::string* const request_body)
 {
     quote3_error_t retval = SGX_QL_ERROR_UNEXPECTED;
     std::string friendly_name = get_collateral_friendly_name(collateral_type);
     try
     {
         std::string issuer_chain_cache_name = get_issuer_chain_cache_name(url);
-        if (auto cache_hit_collateral = try_cache_get(url))
+        bool cached = try_cache_get_collateral(url, response_body, issuer_chain);
+
+        // On a miss, wait for any other process fetching the entry and look
+        // again once it is published. The lock is held until the entry is
+        // added below.
+        std::unique_ptr<local_cache_fill_lock> fill_lock;
+        if (!cached)
         {
-            if (auto cache_hit_issuer_chain = try_cache_get(issuer_chain_cache_name))
-            {
-                log(SGX_QL_LOG_INFO,
-                    "Fetching %s from cache: '%s'.",
-                    friendly_name.c_str(),
-                    url.c_str());
-                response_body = *cache_hit_collateral;
-                issuer_chain = std::string(cache_hit_issuer_chain->begin(), cache_hit_issuer_chain->end());
-                return SGX_QL_SUCCESS;
-            }
+            fill_lock = lock_cache_fill(url);
+            cached = fill_lock && fill_lock->waited &&
+                     try_cache_get_collateral(url, response_body, issuer_chain);
+        }
+
+        if (cached)
+        {
+            LOG_INFO(
+                "Fetching %s from cache: '%s'.",
+                friendly_name.c_str(),
+                url.c_str());
+            telemetry_record_collateral(
+                get_telemetry_collateral(collateral_type),
+                telemetry_source::hit);
+            return SGX_QL_SUCCESS;
         }
 
-        log(SGX_QL_LOG_INFO,
+        telemetry_record_collateral(
+            get_telemetry_collateral(collateral_type),
+            telemetry_source::miss);
+
+        LOG_INFO(
             "Fetching %s from remote server: '%s'.",
             friendly_name.c_str(),
             url.c_str());
 
         const auto curl_operation = curl_easy::create(url, request_body);
-        curl_operation->perform();
+        set_request_headers(*curl_operation, false);
+        perform_request(*curl_operation, url, collateral_type);
         response_body = curl_operation->get_body();
         auto get_header_operation =
             get_unescape_header(*curl_operation, header_name, &issuer_chain);
@@ -797,7 +1054,7 @@ static quote3_error_t get_collateral(
     }
     catch (std::runtime_error& error)
     {
-        log(SGX_QL_LOG_WARNING,
+        LOG_WARNING(
             "Runtime exception thrown, error: %s",
             error.what());
         // Swallow adding file to cache. Library can
@@ -806,7 +1063,7 @@ static quote3_error_t get_collateral(
     }
     catch (curl_easy::error& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "curl error thrown, error code: %x: %s",
             error.code,
             error.what());
@@ -816,6 +1073,31 @@ static quote3_error_t get_collateral(
     }
 }
 
+//
+// Get collateral from the cache, or from the service on a miss, between the
+// get_collateral__entry and get_collateral__return probes.
+//
+static quote3_error_t get_collateral(
+    CollateralTypes collateral_type,
+    std::string url,
+    const char header_name[],
+    std::vector<uint8_t>& response_body,
+    std::string& issuer_chain,
+    const std::string* const request_body = nullptr)
+{
+    const char* collateral = get_collateral_metric_name(collateral_type);
+    AZDCAP_PROBE2(get_collateral__entry, collateral, url.c_str());
+    const quote3_error_t result = lookup_collateral(
+        collateral_type,
+        url,
+        header_name,
+        response_body,
+        issuer_chain,
+        request_body);
+    AZDCAP_PROBE2(get_collateral__return, collateral, static_cast<int>(result));
+    return result;
+}
+
 static std::string build_eppid_json(const sgx_ql_pck_cert_id_t& pck_cert_id)
 {
     const std::string disable_ondemand = get_env_variable(ENV_AZDCAP_DISABLE_ONDEMAND);
@@ -823,7 +1105,7 @@ static std::string build_eppid_json(const sgx_ql_pck_cert_id_t& pck_cert_id)
     {
         if (disable_ondemand == "1")
         {
-            log(SGX_QL_LOG_WARNING, "On demand registration disabled by environment variable. No eppid being sent to caching service");
+            LOG_WARNING("On demand registration disabled by environment variable. No eppid being sent to caching service");
             return "";
         }
     }
@@ -833,12 +1115,12 @@ static std::string build_eppid_json(const sgx_ql_pck_cert_id_t& pck_cert_id)
 
     if (eppid.empty())
     {
-        log(SGX_QL_LOG_WARNING, "No eppid provided - unable to send to caching service");
+        LOG_WARNING("No eppid provided - unable to send to caching service");
         return "";
     }
     else 
     {
-        log(SGX_QL_LOG_INFO, "Sending the provided eppid to caching service");
+        LOG_INFO("Sending the provided eppid to caching service");
     }
 
     static const char json_prefix[] = "{\"eppid\":\"";
@@ -851,7 +1133,7 @@ static std::string build_eppid_json(const sgx_ql_pck_cert_id_t& pck_cert_id)
     return json.str();
 }
 
-extern "C" quote3_error_t sgx_ql_get_quote_config(
+static quote3_error_t get_quote_config(
     const sgx_ql_pck_cert_id_t* p_pck_cert_id,
     sgx_ql_config_t** pp_quote_config)
 {
@@ -860,9 +1142,22 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
     try
     {
         const std::string cert_url = build_pck_cert_url(*p_pck_cert_id);
-        if (auto cache_hit = try_cache_get(cert_url))
+        auto cache_hit = try_cache_get(cert_url);
+
+        // See lookup_collateral
+        std::unique_ptr<local_cache_fill_lock> fill_lock;
+        if (!cache_hit)
         {
-            log(SGX_QL_LOG_INFO,
+            fill_lock = lock_cache_fill(cert_url);
+            if (fill_lock && fill_lock->waited)
+            {
+                cache_hit = try_cache_get(cert_url);
+            }
+        }
+
+        if (cache_hit)
+        {
+            LOG_INFO(
                 "Fetching quote config from cache: '%s'.",
                 cert_url.c_str());
 
@@ -874,16 +1169,23 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
             (*pp_quote_config)->p_cert_data =
                 (uint8_t*)(*pp_quote_config) + sizeof(sgx_ql_config_t);
 
+            telemetry_record_collateral(
+                get_telemetry_collateral(CollateralTypes::PckCert),
+                telemetry_source::hit);
             return SGX_QL_SUCCESS;
         }
-        
+
+        telemetry_record_collateral(
+            get_telemetry_collateral(CollateralTypes::PckCert),
+            telemetry_source::miss);
+
         const std::string eppid_json = build_eppid_json(*p_pck_cert_id);
         const auto curl = curl_easy::create(cert_url, &eppid_json);
-        log(SGX_QL_LOG_INFO,
+        LOG_INFO(
             "Fetching quote config from remote server: '%s'.",
             cert_url.c_str());
-        curl->set_headers(headers::default_values);
-        curl->perform();
+        set_request_headers(*curl, true);
+        perform_request(*curl, cert_url, CollateralTypes::PckCert);
 
         // we better get TCB info and the cert chain, else we cannot provide the
         // required data to the caller.
@@ -892,7 +1194,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
             (get_raw_header(*curl, headers::PCK_CERT_ISSUER_CHAIN, nullptr) !=
              SGX_PLAT_ERROR_OK))
         {
-            log(SGX_QL_LOG_ERROR, "Required HTTP headers are missing.");
+            LOG_ERROR("Required HTTP headers are missing.");
             return SGX_QL_ERROR_UNEXPECTED;
         }
 
@@ -946,7 +1248,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
     }
     catch (curl_easy::error& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "error thrown, error code: %x: %s",
             error.code,
             error.what());
@@ -956,7 +1258,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
     }
     catch (std::runtime_error& error)
     {
-        log(SGX_QL_LOG_WARNING,
+        LOG_WARNING(
             "Runtime exception thrown, error: %s",
             error.what());
         // Swallow adding file to cache. Library can
@@ -965,7 +1267,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_QL_ERROR_UNEXPECTED;
@@ -974,7 +1276,15 @@ extern "C" quote3_error_t sgx_ql_get_quote_config(
     return SGX_QL_SUCCESS;
 }
 
-extern "C" quote3_error_t sgx_ql_free_quote_config(
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_get_quote_config(
+    const sgx_ql_pck_cert_id_t* p_pck_cert_id,
+    sgx_ql_config_t** pp_quote_config)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_quote_config(p_pck_cert_id, pp_quote_config));
+}
+
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_free_quote_config(
     sgx_ql_config_t* p_quote_config)
 {
     delete[] p_quote_config;
@@ -982,7 +1292,7 @@ extern "C" quote3_error_t sgx_ql_free_quote_config(
     return SGX_QL_SUCCESS;
 }
 
-extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
+static sgx_plat_error_t get_revocation_info(
     const sgx_ql_get_revocation_info_params_t* params,
     sgx_ql_revocation_info_t** pp_revocation_info)
 {
@@ -992,7 +1302,7 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
     // highest version of output that it supports.
     if (params->version < SGX_QL_REVOCATION_INFO_VERSION_1)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unexpected parameter version: %u.",
             params->version);
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
@@ -1000,13 +1310,13 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
 
     if ((params->crl_url_count == 0) != (params->crl_urls == nullptr))
     {
-        log(SGX_QL_LOG_ERROR, "Invalid CRL input parameters.");
+        LOG_ERROR("Invalid CRL input parameters.");
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
     }
 
     if ((params->fmspc == nullptr) != (params->fmspc_size == 0))
     {
-        log(SGX_QL_LOG_ERROR, "Invalid FMSPC input parameters.");
+        LOG_ERROR("Invalid FMSPC input parameters.");
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
     }
 
@@ -1033,12 +1343,15 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
             }
 
             const auto crl_operation = curl_easy::create(crl_url, nullptr);
-            log(SGX_QL_LOG_INFO,
+            LOG_INFO(
                 "Fetching revocation info from remote server: '%s'",
                 crl_url.c_str());
 
-            crl_operation->set_headers(headers::default_values);
-            crl_operation->perform();
+            set_request_headers(*crl_operation, true);
+            perform_request(*crl_operation, crl_url, CollateralTypes::PckCrl);
+            telemetry_record_collateral(
+                get_telemetry_collateral(CollateralTypes::PckCrl),
+                telemetry_source::uncached);
             crls.push_back(crl_operation->get_body());
             total_crl_size = safe_add(total_crl_size, crls.back().size());
             total_crl_size =
@@ -1068,10 +1381,15 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
 
             const auto tcb_info_operation =
                 curl_easy::create(tcb_info_url, nullptr);
-            log(SGX_QL_LOG_INFO,
+            LOG_INFO(
                 "Fetching TCB Info from remote server: '%s'.",
                 tcb_info_url.c_str());
-            tcb_info_operation->perform();
+            set_request_headers(*tcb_info_operation, false);
+            perform_request(
+                *tcb_info_operation, tcb_info_url, CollateralTypes::TcbInfo);
+            telemetry_record_collateral(
+                get_telemetry_collateral(CollateralTypes::TcbInfo),
+                telemetry_source::uncached);
 
             tcb_info = tcb_info_operation->get_body();
 
@@ -1176,14 +1494,14 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
     }
     catch (std::overflow_error& error)
     {
-        log(SGX_QL_LOG_ERROR, "Overflow error. '%s'", error.what());
+        LOG_ERROR("Overflow error. '%s'", error.what());
         delete[] buffer;
         *pp_revocation_info = nullptr;
         return SGX_PLAT_ERROR_OVERFLOW;
     }
     catch (curl_easy::error& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "error thrown, error code: %x: %s",
             error.code,
             error.what());
@@ -1193,7 +1511,7 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_PLAT_ERROR_UNEXPECTED_SERVER_RESPONSE;
@@ -1201,7 +1519,15 @@ extern "C" sgx_plat_error_t sgx_ql_get_revocation_info(
     return SGX_PLAT_ERROR_OK;
 }
 
-extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_ql_get_revocation_info(
+    const sgx_ql_get_revocation_info_params_t* params,
+    sgx_ql_revocation_info_t** pp_revocation_info)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_revocation_info(params, pp_revocation_info));
+}
+
+static sgx_plat_error_t get_qe_identity_info(
     sgx_qe_identity_info_t** pp_qe_identity_info)
 {
     sgx_qe_identity_info_t* p_qe_identity_info = NULL;
@@ -1210,7 +1536,7 @@ extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
 
     if (!pp_qe_identity_info)
     {
-        log(SGX_QL_LOG_ERROR, "Invalid parameter pp_qe_identity_info");
+        LOG_ERROR("Invalid parameter pp_qe_identity_info");
         return SGX_PLAT_ERROR_INVALID_PARAMETER;
     }
 
@@ -1225,10 +1551,14 @@ extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
             build_enclave_id_url(false, issuer_chain_header);
 
         const auto curl = curl_easy::create(qe_id_url, nullptr);
-        log(SGX_QL_LOG_INFO,
+        LOG_INFO(
             "Fetching QE Identity from remote server: '%s'.",
             qe_id_url.c_str());
-        curl->perform();
+        set_request_headers(*curl, false);
+        perform_request(*curl, qe_id_url, CollateralTypes::QeIdentity);
+        telemetry_record_collateral(
+            get_telemetry_collateral(CollateralTypes::QeIdentity),
+            telemetry_source::uncached);
 
         // issuer chain
         result = get_unescape_header(*curl, issuer_chain_header, &issuer_chain);
@@ -1288,13 +1618,13 @@ extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
     }
     catch (std::overflow_error& error)
     {
-        log(SGX_QL_LOG_ERROR, "Overflow error. '%s'", error.what());
+        LOG_ERROR("Overflow error. '%s'", error.what());
         *pp_qe_identity_info = nullptr;
         return SGX_PLAT_ERROR_OVERFLOW;
     }
     catch (curl_easy::error& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "error thrown, error code: %x: %s",
             error.code,
             error.what());
@@ -1304,7 +1634,7 @@ extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_PLAT_ERROR_UNEXPECTED_SERVER_RESPONSE;
@@ -1313,26 +1643,81 @@ extern "C" sgx_plat_error_t sgx_get_qe_identity_info(
     return SGX_PLAT_ERROR_OK;
 }
 
-extern "C" void sgx_free_qe_identity_info(
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_get_qe_identity_info(
+    sgx_qe_identity_info_t** pp_qe_identity_info)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_qe_identity_info(pp_qe_identity_info));
+}
+
+extern "C" AZDCAP_EXPORT void sgx_free_qe_identity_info(
     sgx_qe_identity_info_t* p_qe_identity_info)
 {
     delete[] reinterpret_cast<uint8_t*>(p_qe_identity_info);
 }
 
-extern "C" void sgx_ql_free_revocation_info(
+extern "C" AZDCAP_EXPORT void sgx_ql_free_revocation_info(
     sgx_ql_revocation_info_t* p_revocation_info)
 {
     delete[] reinterpret_cast<uint8_t*>(p_revocation_info);
 }
 
-extern "C" sgx_plat_error_t sgx_ql_set_logging_function(
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_ql_set_logging_function(
     sgx_ql_logging_function_t logger)
 {
     logger_callback = logger;
     return SGX_PLAT_ERROR_OK;
 }
 
-extern "C" quote3_error_t sgx_ql_free_quote_verification_collateral(
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_ql_set_log_level(sgx_ql_log_level_t level)
+{
+    if (!set_log_level(level))
+    {
+        LOG_ERROR("Invalid log level: %d", level);
+        return SGX_PLAT_ERROR_INVALID_PARAMETER;
+    }
+
+    return SGX_PLAT_ERROR_OK;
+}
+
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_ql_set_trace_function(
+    sgx_ql_trace_begin_function_t begin,
+    sgx_ql_trace_end_function_t end)
+{
+    if ((begin == nullptr) != (end == nullptr))
+    {
+        LOG_ERROR("Trace begin and end functions must both be set or both be null");
+        return SGX_PLAT_ERROR_INVALID_PARAMETER;
+    }
+
+    set_trace_functions(begin, end);
+    return SGX_PLAT_ERROR_OK;
+}
+
+extern "C" AZDCAP_EXPORT sgx_plat_error_t sgx_ql_get_fetch_stats(
+    sgx_ql_fetch_stats_t** pp_fetch_stats)
+{
+    if (!pp_fetch_stats)
+    {
+        LOG_ERROR("Invalid parameter pp_fetch_stats");
+        return SGX_PLAT_ERROR_INVALID_PARAMETER;
+    }
+
+    *pp_fetch_stats = telemetry_get_fetch_stats();
+    if (*pp_fetch_stats == nullptr)
+    {
+        return SGX_PLAT_ERROR_OUT_OF_MEMORY;
+    }
+
+    return SGX_PLAT_ERROR_OK;
+}
+
+extern "C" AZDCAP_EXPORT void sgx_ql_free_fetch_stats(sgx_ql_fetch_stats_t* p_fetch_stats)
+{
+    delete[] reinterpret_cast<uint8_t*>(p_fetch_stats);
+}
+
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_free_quote_verification_collateral(
     sgx_ql_qve_collateral_t* p_quote_collateral)
 {
     delete[] p_quote_collateral->pck_crl;
@@ -1347,7 +1732,7 @@ extern "C" quote3_error_t sgx_ql_free_quote_verification_collateral(
     return SGX_QL_SUCCESS;
 }
 
-extern "C" quote3_error_t sgx_ql_free_qve_identity(
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_free_qve_identity(
     char* p_qve_identity,
     char* p_qve_identity_issuer_chain)
 {
@@ -1358,50 +1743,50 @@ extern "C" quote3_error_t sgx_ql_free_qve_identity(
     return SGX_QL_SUCCESS;
 }
 
-extern "C" quote3_error_t sgx_ql_free_root_ca_crl(char* p_root_ca_crl)
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_free_root_ca_crl(char* p_root_ca_crl)
 {
     delete[] p_root_ca_crl;
     return SGX_QL_SUCCESS;
 }
 
-extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
+static quote3_error_t get_quote_verification_collateral(
     const uint8_t* fmspc,
     const uint16_t fmspc_size,
     const char* pck_ca,
     sgx_ql_qve_collateral_t** pp_quote_collateral)
 {
-    log(SGX_QL_LOG_INFO, "Getting quote verification collateral");
+    LOG_INFO("Getting quote verification collateral");
     sgx_ql_qve_collateral_t* p_quote_collateral = nullptr;
 
     try
     {
         if (fmspc == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "FMSPC is null");
+            LOG_ERROR("FMSPC is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (fmspc_size == 0)
         {
-            log(SGX_QL_LOG_ERROR, "FMSPC buffer size is 0");
+            LOG_ERROR("FMSPC buffer size is 0");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (pck_ca == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "PCK CA is null");
+            LOG_ERROR("PCK CA is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (pp_quote_collateral == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "Pointer to collateral pointer is null");
+            LOG_ERROR("Pointer to collateral pointer is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (*pp_quote_collateral != nullptr)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Collateral pointer is not null. This memory will be allocated "
                 "by "
                 "this library");
@@ -1416,13 +1801,13 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
 
         if (strcmp(CRL_CA_PLATFORM, pck_ca) == 0)
         {
-            log(SGX_QL_LOG_ERROR, "Platform CA CRL is not supported");
+            LOG_ERROR("Platform CA CRL is not supported");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (requested_ca.empty())
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "PCK CA must be either %s or %s",
                 CRL_CA_PROCESSOR,
                 CRL_CA_PLATFORM);
@@ -1450,7 +1835,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
             pck_issuer_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching PCK CRL: %d",
                 operation_result);
             return operation_result;
@@ -1467,7 +1852,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
             root_ca_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching Root CA CRL: %d",
                 operation_result);
             return operation_result;
@@ -1486,7 +1871,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
             tcb_issuer_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching TCB Info: %d",
                 operation_result);
             return operation_result;
@@ -1506,7 +1891,7 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
             qe_identity_issuer_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching QE Identity: %d",
                 operation_result);
             return operation_result;
@@ -1573,25 +1958,39 @@ extern "C" quote3_error_t sgx_ql_get_quote_verification_collateral(
     catch (std::bad_alloc&)
     {
         sgx_ql_free_quote_verification_collateral(p_quote_collateral);
-        log(SGX_QL_LOG_ERROR, "Out of memory thrown");
+        LOG_ERROR("Out of memory thrown");
         return SGX_QL_ERROR_OUT_OF_MEMORY;
     }
     catch (std::overflow_error& error)
     {
-        log(SGX_QL_LOG_ERROR, "Overflow error. '%s'", error.what());
+        LOG_ERROR("Overflow error. '%s'", error.what());
         sgx_ql_free_quote_verification_collateral(p_quote_collateral);
         return SGX_QL_ERROR_UNEXPECTED;
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_QL_ERROR_UNEXPECTED;
     }
 }
 
-extern "C" quote3_error_t sgx_ql_get_qve_identity(
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_get_quote_verification_collateral(
+    const uint8_t* fmspc,
+    const uint16_t fmspc_size,
+    const char* pck_ca,
+    sgx_ql_qve_collateral_t** pp_quote_collateral)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_quote_verification_collateral(
+        fmspc,
+        fmspc_size,
+        pck_ca,
+        pp_quote_collateral));
+}
+
+static quote3_error_t get_qve_identity(
     char** pp_qve_identity,
     uint32_t* p_qve_identity_size,
     char** pp_qve_identity_issuer_chain,
@@ -1599,16 +1998,16 @@ extern "C" quote3_error_t sgx_ql_get_qve_identity(
 {
     try
     {
-        log(SGX_QL_LOG_INFO, "Getting quote verification enclave identity");
+        LOG_INFO("Getting quote verification enclave identity");
         if (pp_qve_identity == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "Pointer to qve identity pointer is null");
+            LOG_ERROR("Pointer to qve identity pointer is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (*pp_qve_identity != nullptr)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Qve identity pointer is not null. This memory will be "
                 "allocated by "
                 "this library");
@@ -1617,13 +2016,13 @@ extern "C" quote3_error_t sgx_ql_get_qve_identity(
 
         if (pp_qve_identity_issuer_chain == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "Pointer to issuer chain pointer is null");
+            LOG_ERROR("Pointer to issuer chain pointer is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (*pp_qve_identity_issuer_chain != nullptr)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Issuer chain pointer is not null. This memory will be "
                 "allocated by "
                 "this library");
@@ -1636,7 +2035,7 @@ extern "C" quote3_error_t sgx_ql_get_qve_identity(
         std::string qve_url = build_enclave_id_url(true, expected_issuer);
         if (qve_url.empty())
         {
-            log(SGX_QL_LOG_ERROR, "V1 QVE is not supported");
+            LOG_ERROR("V1 QVE is not supported");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
@@ -1645,7 +2044,7 @@ extern "C" quote3_error_t sgx_ql_get_qve_identity(
             qve_url, expected_issuer.c_str(), qve_identity, issuer_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching QVE Identity: %d",
                 operation_result);
         }
@@ -1666,41 +2065,55 @@ extern "C" quote3_error_t sgx_ql_get_qve_identity(
     {
         sgx_ql_free_qve_identity(
             *pp_qve_identity, *pp_qve_identity_issuer_chain);
-        log(SGX_QL_LOG_ERROR, "Out of memory thrown");
+        LOG_ERROR("Out of memory thrown");
         return SGX_QL_ERROR_OUT_OF_MEMORY;
     }
     catch (std::overflow_error& error)
     {
-        log(SGX_QL_LOG_ERROR, "Overflow error. '%s'", error.what());
+        LOG_ERROR("Overflow error. '%s'", error.what());
         sgx_ql_free_qve_identity(
             *pp_qve_identity, *pp_qve_identity_issuer_chain);
         return SGX_QL_ERROR_UNEXPECTED;
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_QL_ERROR_UNEXPECTED;
     }
 }
 
-extern "C" quote3_error_t sgx_ql_get_root_ca_crl(
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_get_qve_identity(
+    char** pp_qve_identity,
+    uint32_t* p_qve_identity_size,
+    char** pp_qve_identity_issuer_chain,
+    uint32_t* p_qve_identity_issuer_chain_size)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_qve_identity(
+        pp_qve_identity,
+        p_qve_identity_size,
+        pp_qve_identity_issuer_chain,
+        p_qve_identity_issuer_chain_size));
+}
+
+static quote3_error_t get_root_ca_crl(
     char** pp_root_ca_crl,
     uint16_t* p_root_ca_crl_size)
 {
     try
     {
-        log(SGX_QL_LOG_INFO, "Getting root ca crl");
+        LOG_INFO("Getting root ca crl");
         if (pp_root_ca_crl == nullptr)
         {
-            log(SGX_QL_LOG_ERROR, "Pointer to crl pointer is null");
+            LOG_ERROR("Pointer to crl pointer is null");
             return SGX_QL_ERROR_INVALID_PARAMETER;
         }
 
         if (*pp_root_ca_crl != nullptr)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Crl pointer is not null. This memory will be allocated by "
                 "this library");
             return SGX_QL_ERROR_INVALID_PARAMETER;
@@ -1719,7 +2132,7 @@ extern "C" quote3_error_t sgx_ql_get_root_ca_crl(
             root_ca_chain);
         if (operation_result != SGX_QL_SUCCESS)
         {
-            log(SGX_QL_LOG_ERROR,
+            LOG_ERROR(
                 "Error fetching Root CA CRL: %d",
                 operation_result);
             return operation_result;
@@ -1735,20 +2148,28 @@ extern "C" quote3_error_t sgx_ql_get_root_ca_crl(
     catch (std::bad_alloc&)
     {
         sgx_ql_free_root_ca_crl(*pp_root_ca_crl);
-        log(SGX_QL_LOG_ERROR, "Out of memory thrown");
+        LOG_ERROR("Out of memory thrown");
         return SGX_QL_ERROR_OUT_OF_MEMORY;
     }
     catch (std::overflow_error& error)
     {
-        log(SGX_QL_LOG_ERROR, "Overflow error. '%s'", error.what());
+        LOG_ERROR("Overflow error. '%s'", error.what());
         sgx_ql_free_root_ca_crl(*pp_root_ca_crl);
         return SGX_QL_ERROR_UNEXPECTED;
     }
     catch (std::exception& error)
     {
-        log(SGX_QL_LOG_ERROR,
+        LOG_ERROR(
             "Unknown exception thrown, error: %s",
             error.what());
         return SGX_QL_ERROR_UNEXPECTED;
     }
+}
+
+extern "C" AZDCAP_EXPORT quote3_error_t sgx_ql_get_root_ca_crl(
+    char** pp_root_ca_crl,
+    uint16_t* p_root_ca_crl_size)
+{
+    request_scope scope(__func__);
+    return scope.complete(get_root_ca_crl(pp_root_ca_crl, p_root_ca_crl_size));
 }
\ No newline at end of file
@@ -103,4 +103,96 @@ typedef void (
 typedef sgx_plat_error_t (*sgx_ql_set_logging_function_t)(
     sgx_ql_logging_function_t logger);
 
+/// Set the most verbose level passed to the logging callback. Messages above
+/// this level are discarded before being formatted. Defaults to
+/// SGX_QL_LOG_INFO; SGX_QL_LOG_NONE disables logging entirely.
+typedef sgx_plat_error_t (*sgx_ql_set_log_level_t)(sgx_ql_log_level_t level);
+
+/*****************************************************************************
+ * Data types and interfaces for tracing the work done by the library. Spans
+ * are reported around each exported call, each cache lookup and each HTTP
+ * fetch, so that a host can bridge them into its own tracer.
+ ****************************************************************************/
+typedef struct _sgx_ql_trace_attribute_t
+{
+    const char* key;   // null-terminated attribute name
+    const char* value; // null-terminated attribute value
+} sgx_ql_trace_attribute_t;
+
+/// Called when a span begins. 'span_id' is nonzero and unique within the
+/// process. 'parent_span_id' is the span enclosing this one on the calling
+/// thread, or 0 for the span of an exported call, which the host may parent
+/// to its own active span. Names and attributes are only valid for the
+/// duration of the callback.
+typedef void (*sgx_ql_trace_begin_function_t)(
+    uint64_t span_id,
+    uint64_t parent_span_id,
+    const char* name,
+    const sgx_ql_trace_attribute_t* attributes,
+    uint32_t attribute_count);
+
+/// Called when a span ends, on the thread which began it, with the
+/// attributes only known once the work is done (e.g. the result).
+typedef void (*sgx_ql_trace_end_function_t)(
+    uint64_t span_id,
+    const sgx_ql_trace_attribute_t* attributes,
+    uint32_t attribute_count);
+
+/// Set the callbacks used to report spans. Both must be set, or both null to
+/// stop tracing.
+typedef sgx_plat_error_t (*sgx_ql_set_trace_function_t)(
+    sgx_ql_trace_begin_function_t begin,
+    sgx_ql_trace_end_function_t end);
+
+/*****************************************************************************
+ * Data types and interfaces for querying the timing of the fetches made by
+ * the library, aggregated per endpoint (service host and collateral type).
+ ****************************************************************************/
+#define SGX_QL_FETCH_HISTOGRAM_BUCKETS 17
+
+typedef enum _sgx_ql_fetch_phase_t {
+    SGX_QL_FETCH_PHASE_NAME_LOOKUP,        // DNS resolution
+    SGX_QL_FETCH_PHASE_CONNECT,            // TCP connect
+    SGX_QL_FETCH_PHASE_TLS_HANDSHAKE,      // TLS handshake
+    SGX_QL_FETCH_PHASE_TIME_TO_FIRST_BYTE, // request sent to first byte back
+    SGX_QL_FETCH_PHASE_TRANSFER,           // first byte to last byte
+    SGX_QL_FETCH_PHASE_TOTAL,              // the whole fetch
+    SGX_QL_FETCH_PHASE_COUNT
+} sgx_ql_fetch_phase_t;
+
+typedef struct _sgx_ql_fetch_histogram_t
+{
+    uint64_t count;  // number of samples
+    uint64_t sum_us; // sum of all samples, in microseconds
+    uint64_t max_us; // largest sample, in microseconds
+    uint64_t buckets[SGX_QL_FETCH_HISTOGRAM_BUCKETS]; // samples per bucket
+} sgx_ql_fetch_histogram_t;
+
+typedef struct _sgx_ql_endpoint_fetch_stats_t
+{
+    const char* host;       // null-terminated service host name
+    const char* collateral; // null-terminated collateral type, e.g. tcb_info
+    uint64_t fetch_count;
+    uint64_t failure_count;
+    uint64_t reused_connection_count;
+    uint64_t bytes_downloaded;
+    sgx_ql_fetch_histogram_t phases[SGX_QL_FETCH_PHASE_COUNT];
+} sgx_ql_endpoint_fetch_stats_t;
+
+typedef struct _sgx_ql_fetch_stats_t
+{
+    // Inclusive upper bound of each histogram bucket, in microseconds. The
+    // last bucket is unbounded and holds UINT64_MAX.
+    uint64_t bucket_upper_bounds_us[SGX_QL_FETCH_HISTOGRAM_BUCKETS];
+    uint32_t endpoint_count;                  // number of endpoints returned
+    sgx_ql_endpoint_fetch_stats_t* endpoints; // array of endpoint statistics
+} sgx_ql_fetch_stats_t;
+
+/// Get a snapshot of the fetch statistics gathered since the library was
+/// loaded. Free with sgx_ql_free_fetch_stats.
+typedef sgx_plat_error_t (*sgx_ql_get_fetch_stats_t)(
+    sgx_ql_fetch_stats_t** pp_fetch_stats);
+
+typedef void (*sgx_ql_free_fetch_stats_t)(sgx_ql_fetch_stats_t* p_fetch_stats);
+
 #endif // #ifndef PLATFORM_QUOTE_PROVIDER_H
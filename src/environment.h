@@ -11,10 +11,26 @@
 //  modify or override these values as they can cause regressions in
 //  caching service behavior.
 #define ENV_AZDCAP_BASE_URL "AZDCAP_BASE_CERT_URL"
+#define ENV_AZDCAP_CACHE_FILL_WAIT_MS "AZDCAP_CACHE_FILL_WAIT_MS"
 #define ENV_AZDCAP_CLIENT_ID "AZDCAP_CLIENT_ID"
 #define ENV_AZDCAP_COLLATERAL_VER "AZDCAP_COLLATERAL_VERSION"
 #define ENV_AZDCAP_DEBUG_LOG "AZDCAP_DEBUG_LOG_LEVEL"
+#define ENV_AZDCAP_DEBUG_LOG_FILE "AZDCAP_DEBUG_LOG_FILE"
+#define ENV_AZDCAP_DEBUG_LOG_FILE_MAX_SIZE "AZDCAP_DEBUG_LOG_FILE_MAX_SIZE"
 #define ENV_AZDCAP_DISABLE_ONDEMAND "AZDCAP_DISABLE_ONDEMAND"
+#define ENV_AZDCAP_FAULT_INJECTION "AZDCAP_FAULT_INJECTION"
+#define ENV_AZDCAP_FAULT_INJECTION_SEED "AZDCAP_FAULT_INJECTION_SEED"
+#define ENV_AZDCAP_HTTP_FIXTURE_DIR "AZDCAP_HTTP_FIXTURE_DIR"
+#define ENV_AZDCAP_HTTP_MODE "AZDCAP_HTTP_MODE"
+#define ENV_AZDCAP_HTTP_REPLAY_LATENCY "AZDCAP_HTTP_REPLAY_LATENCY"
+#define ENV_AZDCAP_LOG_RATE_LIMIT "AZDCAP_LOG_RATE_LIMIT"
+#define ENV_AZDCAP_LOG_VERBOSE "AZDCAP_LOG_VERBOSE"
+#define ENV_AZDCAP_METRICS_FILE "AZDCAP_METRICS_FILE"
+#define ENV_AZDCAP_METRICS_INTERVAL "AZDCAP_METRICS_INTERVAL"
+#define ENV_AZDCAP_SIDECAR_SOCKET "AZDCAP_SIDECAR_SOCKET"
+
+// Service used when AZDCAP_BASE_CERT_URL is not set
+#define AZDCAP_DEFAULT_BASE_URL "https://global.acccache.azure.net/sgx/certificates"
 
 #define MAX_ENV_VAR_LENGTH 2000
 
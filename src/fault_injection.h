@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef FAULT_INJECTION_H
+#define FAULT_INJECTION_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//
+// Fault and latency injection for testing behavior against a degraded
+// service. AZDCAP_FAULT_INJECTION holds rules separated by ';', each a URL glob
+// (fnmatch syntax, matched against the full request URL) followed by
+// comma-separated actions:
+//
+//   latency_ms=N       wait N milliseconds before the request
+//   jitter_ms=N        wait up to N more milliseconds, uniformly distributed
+//   curl_error=N       fail with CURLcode N instead of sending the request
+//   status=N           answer with HTTP error status N (400 or above) instead
+//                      of sending the request
+//   truncate=N         keep only the first N bytes of the response body
+//   drop_header=NAME   remove response header NAME (repeatable)
+//   rate=P             apply the rule to a fraction P, from 0 to 1, of
+//                      requests (default 1)
+//
+// For example, "*/pckcrl*,rate=0.1,status=503;*,latency_ms=50,jitter_ms=200"
+// fails a tenth of the CRL requests and slows every request down. Every
+// matching rule applies. AZDCAP_FAULT_INJECTION_SEED makes the random choices
+// repeatable.
+//
+
+struct fault_plan
+{
+    std::chrono::microseconds delay{0};
+    int curl_error = 0;  // CURLcode, 0 for none
+    long http_status = 0; // 0 for none
+    bool truncate = false;
+    size_t truncate_size = 0;
+    std::vector<std::string> dropped_headers;
+};
+
+//
+// The faults to inject into a request for 'url'. Returns false, leaving
+// 'plan' untouched, if there are none.
+//
+bool fault_injection_plan(const std::string& url, fault_plan& plan);
+
+#endif
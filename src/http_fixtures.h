@@ -0,0 +1,70 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef HTTP_FIXTURES_H
+#define HTTP_FIXTURES_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+//
+// Record/replay transport for deterministic offline benchmarking. With
+// AZDCAP_HTTP_MODE=record, every response received from the service (status,
+// headers and body) is also written to a fixture file in
+// AZDCAP_HTTP_FIXTURE_DIR. With AZDCAP_HTTP_MODE=replay, requests are answered
+// from those files and never reach the network; a request without a fixture
+// fails as if the service were unreachable. Fixtures are keyed by URL and
+// request body.
+//
+// Replayed responses are returned immediately unless
+// AZDCAP_HTTP_REPLAY_LATENCY is set, either to "recorded" to wait as long as
+// the original request took, or to a fixed number of milliseconds.
+//
+
+enum class http_fixture_mode
+{
+    off,
+    record,
+    replay
+};
+
+struct http_fixture
+{
+    long status = 0;
+    std::map<std::string, std::string> headers;
+    std::vector<uint8_t> body;
+    int64_t latency_us = 0; // how long the recorded request took
+};
+
+//
+// The configured mode. The environment is read on first use only.
+//
+http_fixture_mode http_fixture_get_mode();
+
+//
+// Load the fixture recorded for a request. Returns false if there is none.
+//
+bool http_fixture_load(
+    const std::string& url,
+    const std::string& request_body,
+    http_fixture& fixture);
+
+//
+// Write the fixture for a request, replacing any earlier recording of it.
+// Failures are logged and otherwise ignored.
+//
+void http_fixture_save(
+    const std::string& url,
+    const std::string& request_body,
+    const http_fixture& fixture);
+
+//
+// How long a replay of 'fixture' should take.
+//
+std::chrono::microseconds http_fixture_replay_delay(const http_fixture& fixture);
+
+#endif
@@ -5,11 +5,22 @@
 #ifndef LOCAL_CACHE_H
 #define LOCAL_CACHE_H
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 #include <time.h>
 
+//
+// Whether the local cache can be used. If no cache directory could be
+// created, the cache is disabled: lookups miss, additions are dropped and
+// no error is raised, other than by the attempts at creating a directory,
+// which are repeated with a growing delay of up to a minute.
+// Throws std::exception (or subtype) if such an attempt fails.
+//
+bool local_cache_enabled();
+
 //
 // Wipe all entries from the local cache.
 // Throws std::exception (or subtype) on error.
@@ -36,4 +47,62 @@ void local_cache_add(
 std::unique_ptr<std::vector<uint8_t>> local_cache_get(
     const std::string& id);
 
+//
+// Held while this process fetches a missing entry, so that the other
+// processes sharing the cache directory wait for it to be published instead
+// of fetching it too. Released when destroyed.
+//
+struct local_cache_fill_lock
+{
+    virtual ~local_cache_fill_lock() = default;
+
+    // Another process held the lock first, and may have published the entry
+    // meanwhile: look it up again before fetching.
+    bool waited = false;
+};
+
+//
+// Take the fill lock for 'id', waiting up to 'timeout' for another process
+// holding it. Returns nullptr if it was not released in time, in which case
+// the caller fetches the entry without coordination.
+// Throws std::exception (or subtype) on error.
+//
+std::unique_ptr<local_cache_fill_lock> local_cache_lock_fill(
+    const std::string& id,
+    std::chrono::milliseconds timeout);
+
+//
+// Total size in bytes of the entries in the local cache, expired or not.
+// Returns false without setting up the cache directory if no other call has
+// yet, or while caching is disabled, so that watching the size never changes
+// when or where the cache is created.
+// Throws std::exception (or subtype) on error.
+//
+bool local_cache_size(uint64_t& size);
+
+//
+// Locks taken by the local cache, for contention statistics.
+//
+enum class local_cache_lock
+{
+    directory,      // in-process mutex guarding the cache directory name
+    file_shared,    // shared file lock taken to read an entry
+    file_exclusive, // exclusive file lock taken to write an entry
+    fill,           // per-entry lock file held while fetching a missing entry
+    count
+};
+
+struct local_cache_lock_stats
+{
+    uint64_t acquisitions = 0;  // times the lock was taken
+    uint64_t contended = 0;     // times it was not immediately available
+    uint64_t total_wait_ns = 0; // time spent waiting for it
+    uint64_t max_wait_ns = 0;   // longest single wait
+};
+
+//
+// Wait statistics for one lock type since the library was loaded.
+//
+local_cache_lock_stats local_cache_get_lock_stats(local_cache_lock lock);
+
 #endif
@@ -0,0 +1,38 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include <cstdint>
+
+//
+// Asynchronous sink for the AZDCAP_DEBUG_LOG_LEVEL debug log. Messages are
+// formatted into a fixed-size lock-free ring buffer and written out by a
+// single background thread, either to stdout or to the file named by
+// AZDCAP_DEBUG_LOG_FILE (rotated once it exceeds
+// AZDCAP_DEBUG_LOG_FILE_MAX_SIZE bytes). The sink is flushed when the library
+// is unloaded and when the process exits, and after every error. A forked
+// child starts a sink of its own.
+//
+
+//
+// Queue a message for the background writer. Never blocks. Returns false if
+// the sink is not running, in which case the caller should write the message
+// itself. A full ring buffer drops the message and counts it.
+//
+bool log_sink_write(const char* level_name, const char* message);
+
+//
+// Block until every message queued before this call has been written.
+//
+void log_sink_flush();
+
+//
+// Number of messages dropped because the ring buffer was full, exported as
+// az_dcap_log_messages_dropped_total.
+//
+uint64_t log_sink_dropped_count();
+
+#endif
@@ -1,11 +1,14 @@
 // Licensed under the MIT License.
 
-#ifndef __LINUX__
+#ifdef __LINUX__
+#include "log_sink.h"
+#else
 #include "evtx_logging.h"
 #endif
 
 #include "private.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
 #include <cstddef>
@@ -15,15 +18,31 @@
 #include <new>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <mutex>
 #include "environment.h"
 
 using namespace std;
 
 sgx_ql_logging_function_t logger_callback = nullptr;
-static sgx_ql_log_level_t debug_log_level = SGX_QL_LOG_NONE;
-static bool debug_log_initialized = false;
-static mutex log_init_mutex;
+static atomic<int> debug_log_level(SGX_QL_LOG_NONE);
+static atomic<int> host_log_level(SGX_QL_LOG_INFO);
+static once_flag debug_log_init_flag;
+
+static constexpr uint32_t DEFAULT_LOG_RATE_LIMIT = 10; // per call site, per second
+static constexpr int64_t LOG_RATE_WINDOW_MS = 1000;
+static constexpr size_t LOG_VALUE_SUMMARY_THRESHOLD = 256;
+static uint32_t log_rate_limit = DEFAULT_LOG_RATE_LIMIT;
+static bool log_verbose = false;
+static once_flag log_options_init_flag;
+
+// Call sites with suppressed messages not reported yet, and the earliest
+// time one of their windows ends
+static mutex pending_call_sites_mutex;
+static log_call_site* pending_call_sites = nullptr;
+static atomic<int64_t> next_pending_report(numeric_limits<int64_t>::max());
 
 static const string LEVEL_ERROR = "ERROR";
 static const string LEVEL_ERROR_ALT = "SGX_QL_LOG_ERROR";
@@ -84,7 +103,7 @@ static inline void enable_debug_logging(string level)
     sgx_ql_log_level_t sgx_level;
     if (convert_string_to_level(level, sgx_level))
     {
-        debug_log_level = sgx_level;
+        debug_log_level.store(sgx_level, memory_order_relaxed);
 
         auto logging_enabled_message = "Debug Logging Enabled";
         if (logger_callback != nullptr)
@@ -101,11 +120,13 @@ static inline void enable_debug_logging(string level)
     }
 }
 
+//
+// Reads AZDCAP_DEBUG_LOG_LEVEL exactly once. After the first call this is a
+// single atomic check and never takes a lock.
+//
 void init_debug_log()
 {
-    std::lock_guard<std::mutex> lock(log_init_mutex);
-    if (!debug_log_initialized)
-    {
+    call_once(debug_log_init_flag, [] {
         auto log_level = get_env_variable_no_log(ENV_AZDCAP_DEBUG_LOG);
         if (!log_level.first.empty() && log_level.second.empty())
         {
@@ -119,15 +140,245 @@ void init_debug_log()
                 log_level_string(SGX_QL_LOG_ERROR).c_str(),
                 log_level.second.c_str());
         }
-        debug_log_initialized = true;
+    });
+}
+
+//
+// Set the most verbose level which will be emitted at all. Messages above
+// this level are dropped before they are formatted.
+//
+bool set_log_level(sgx_ql_log_level_t level)
+{
+    if (level < SGX_QL_LOG_ERROR || level > SGX_QL_LOG_NONE)
+    {
+        return false;
+    }
+
+    host_log_level.store(level, memory_order_relaxed);
+    return true;
+}
+
+//
+// Returns true if a message at the given level would be emitted anywhere.
+// This only reads atomics, so callers can use it to skip formatting.
+//
+bool log_level_enabled(sgx_ql_log_level_t level)
+{
+    const int host_level = host_log_level.load(memory_order_relaxed);
+    if (level == SGX_QL_LOG_NONE || host_level == SGX_QL_LOG_NONE ||
+        level > host_level)
+    {
+        return false;
+    }
+
+#ifdef __LINUX__
+    if (logger_callback != nullptr)
+    {
+        return true;
+    }
+
+    init_debug_log();
+    const int debug_level = debug_log_level.load(memory_order_relaxed);
+    return debug_level != SGX_QL_LOG_NONE && level <= debug_level;
+#else
+    // The event log receives every message regardless of the callback
+    return true;
+#endif
+}
+
+//
+// Reads the rate limiting and verbosity settings exactly once.
+//
+static void init_log_options()
+{
+    call_once(log_options_init_flag, [] {
+        auto rate_limit = get_env_variable_no_log(ENV_AZDCAP_LOG_RATE_LIMIT);
+        if (!rate_limit.first.empty())
+        {
+            log_rate_limit =
+                static_cast<uint32_t>(strtoul(rate_limit.first.c_str(), nullptr, 10));
+        }
+
+        auto verbose = get_env_variable_no_log(ENV_AZDCAP_LOG_VERBOSE);
+        log_verbose = verbose.first == "1";
+    });
+}
+
+static void add_pending_call_site(
+    log_call_site& call_site,
+    sgx_ql_log_level_t level,
+    const char* file,
+    int line)
+{
+    lock_guard<mutex> lock(pending_call_sites_mutex);
+    call_site.level = level;
+    call_site.file = file;
+    call_site.line = line;
+    call_site.next_pending = pending_call_sites;
+    pending_call_sites = &call_site;
+
+    const int64_t window_end =
+        call_site.window_start.load(memory_order_relaxed) + LOG_RATE_WINDOW_MS;
+    if (window_end < next_pending_report.load(memory_order_relaxed))
+    {
+        next_pending_report.store(window_end, memory_order_relaxed);
     }
 }
 
+//
+// Logs the summaries of the pending call sites whose window has passed,
+// rather than waiting for them to log again, which they may never do.
+//
+static void report_pending_call_sites(int64_t now)
+{
+    struct summary
+    {
+        sgx_ql_log_level_t level;
+        const char* file;
+        int line;
+        uint32_t suppressed;
+        int64_t elapsed;
+    };
+    vector<summary> summaries;
+
+    {
+        unique_lock<mutex> lock(pending_call_sites_mutex, try_to_lock);
+        if (!lock.owns_lock())
+        {
+            // Another thread is reporting them
+            return;
+        }
+
+        int64_t next_report = numeric_limits<int64_t>::max();
+        log_call_site** link = &pending_call_sites;
+        while (log_call_site* call_site = *link)
+        {
+            const int64_t window_start =
+                call_site->window_start.load(memory_order_relaxed);
+            if (now - window_start < LOG_RATE_WINDOW_MS)
+            {
+                next_report = min(next_report, window_start + LOG_RATE_WINDOW_MS);
+                link = &call_site->next_pending;
+                continue;
+            }
+
+            // Cleared first, so that a message suppressed after the
+            // exchange below adds the call site again
+            *link = call_site->next_pending;
+            call_site->pending.store(false);
+            const uint32_t suppressed = call_site->suppressed.exchange(0);
+            if (suppressed != 0)
+            {
+                summaries.push_back(
+                    {call_site->level,
+                     call_site->file,
+                     call_site->line,
+                     suppressed,
+                     now - window_start});
+            }
+        }
+        next_pending_report.store(next_report, memory_order_relaxed);
+    }
+
+    for (const summary& summary : summaries)
+    {
+        log(summary.level,
+            "Suppressed %u messages from %s:%d in the last %lld ms",
+            summary.suppressed,
+            summary.file,
+            summary.line,
+            static_cast<long long>(summary.elapsed));
+    }
+}
+
+bool log_call_site_allow(
+    log_call_site& call_site,
+    sgx_ql_log_level_t level,
+    const char* file,
+    int line)
+{
+    init_log_options();
+    if (log_rate_limit == 0)
+    {
+        return true;
+    }
+
+    const int64_t now = chrono::duration_cast<chrono::milliseconds>(
+                            chrono::steady_clock::now().time_since_epoch())
+                            .count();
+    if (now >= next_pending_report.load(memory_order_relaxed))
+    {
+        report_pending_call_sites(now);
+    }
+
+    int64_t window_start = call_site.window_start.load(memory_order_relaxed);
+    if (now - window_start >= LOG_RATE_WINDOW_MS &&
+        call_site.window_start.compare_exchange_strong(
+            window_start, now, memory_order_relaxed))
+    {
+        // This thread won the race to open a new window
+        call_site.emitted.store(0, memory_order_relaxed);
+        const uint32_t suppressed =
+            call_site.suppressed.exchange(0, memory_order_relaxed);
+        if (suppressed != 0)
+        {
+            log(level,
+                "Suppressed %u messages from %s:%d in the last %lld ms",
+                suppressed,
+                file,
+                line,
+                static_cast<long long>(now - window_start));
+        }
+    }
+
+    if (call_site.emitted.fetch_add(1, memory_order_relaxed) < log_rate_limit)
+    {
+        return true;
+    }
+
+    call_site.suppressed.fetch_add(1);
+    if (!call_site.pending.exchange(true))
+    {
+        add_pending_call_site(call_site, level, file, line);
+    }
+    return false;
+}
+
+string log_value(const string& value)
+{
+    init_log_options();
+    if (log_verbose || value.size() <= LOG_VALUE_SUMMARY_THRESHOLD)
+    {
+        return value;
+    }
+
+    // 64-bit FNV-1a; only needs to tell values apart in a log, not be secure
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : value)
+    {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+
+    char summary[64];
+    snprintf(
+        summary,
+        sizeof(summary),
+        "<%zu bytes, hash %016llx>",
+        value.size(),
+        static_cast<unsigned long long>(hash));
+    return summary;
+}
+
 //
 // Logging function which doesn't allocate buffer 
 //
 void log_message(sgx_ql_log_level_t level, const char* message)
 {
+    if (!log_level_enabled(level))
+    {
+        return;
+    }
+
     if (logger_callback != nullptr)
     {
         logger_callback(level, message);
@@ -135,9 +386,23 @@ void log_message(sgx_ql_log_level_t level, const char* message)
     else 
     {
         init_debug_log();
-        if (debug_log_level != SGX_QL_LOG_NONE)
+        const int debug_level = debug_log_level.load(memory_order_relaxed);
+        if (debug_level != SGX_QL_LOG_NONE && level <= debug_level)
         {
-            if (level <= debug_log_level)
+#ifdef __LINUX__
+            // Hand the message to the background writer so the calling
+            // thread doesn't wait on stdout or the log file. Errors are
+            // written out before returning, so that they are not lost if the
+            // process goes down because of them.
+            if (log_sink_write(log_level_string(level).c_str(), message))
+            {
+                if (level == SGX_QL_LOG_ERROR)
+                {
+                    log_sink_flush();
+                }
+            }
+            else
+#endif
             {
                 printf("Azure Quote Provider: libdcap_quoteprov.so [%s]: %s\n", log_level_string(level).c_str(), message);
             }
@@ -176,6 +441,11 @@ void log_message(sgx_ql_log_level_t level, const char* message)
 //
 void log(sgx_ql_log_level_t level, const char* fmt, ...)
 {
+    if (!log_level_enabled(level))
+    {
+        return;
+    }
+
     char message[512];
     va_list args;
     va_start(args, fmt);
@@ -0,0 +1,29 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef METRICS_EXPORTER_H
+#define METRICS_EXPORTER_H
+
+#include <string>
+
+//
+// Optional exporter for node_exporter's textfile collector. When
+// AZDCAP_METRICS_FILE is set, a background thread rewrites that file every
+// AZDCAP_METRICS_INTERVAL seconds (15 by default) with the provider's metrics
+// in the Prometheus text exposition format, and once more when the library is
+// unloaded. The file is replaced atomically, so readers never see a partial
+// write.
+//
+
+//
+// Start the exporter if it is configured. Only the first call has any effect.
+//
+void metrics_exporter_start();
+
+//
+// The current metrics in the Prometheus text exposition format.
+//
+std::string metrics_format_prometheus();
+
+#endif
@@ -6,6 +6,8 @@
 #define PRIVATE_H
 
 #include "dcap_provider.h"
+#include <atomic>
+#include <cstdint>
 #include <string>
 
 extern sgx_ql_logging_function_t logger_callback;
@@ -15,4 +17,95 @@ extern sgx_ql_logging_function_t logger_callback;
 ///////////////////////////////////////////////////////////////////////////////
 void log(sgx_ql_log_level_t level, const char* fmt, ...);
 void log_message(sgx_ql_log_level_t level, const char* message);
+bool log_level_enabled(sgx_ql_log_level_t level);
+bool set_log_level(sgx_ql_log_level_t level);
+
+//
+// Rate limiting state for a single logging call site. Each LOG_* expansion
+// owns one of these, so identical messages are throttled independently of
+// all other messages.
+//
+struct log_call_site
+{
+    std::atomic<int64_t> window_start{0};
+    std::atomic<uint32_t> emitted{0};
+    std::atomic<uint32_t> suppressed{0};
+
+    // Set while the call site is on the list of those with suppressed
+    // messages to report, with what the summary needs
+    std::atomic<bool> pending{false};
+    log_call_site* next_pending = nullptr;
+    sgx_ql_log_level_t level = SGX_QL_LOG_NONE;
+    const char* file = nullptr;
+    int line = 0;
+};
+
+//
+// Returns false if the call site has exceeded AZDCAP_LOG_RATE_LIMIT messages
+// in the current one second window. Once a window with suppressed messages
+// has passed, a summary with the number of suppressed messages is logged by
+// the next message allowed from any call site. Nothing reports it while the
+// library logs nothing else.
+//
+bool log_call_site_allow(
+    log_call_site& call_site,
+    sgx_ql_log_level_t level,
+    const char* file,
+    int line);
+
+//
+// Returns the value itself if it is short or AZDCAP_LOG_VERBOSE is set.
+// Otherwise returns its length and a short hash, which is enough to tell
+// large values such as issuer chains apart without flooding the log.
+//
+std::string log_value(const std::string& value);
+
+//
+// Marks the exported sgx_* entry points, so that they stay visible when Linux
+// release builds compile with -fvisibility=hidden. Windows exports them
+// through dcap_provider.def instead.
+//
+#if defined(__LINUX__)
+#define AZDCAP_EXPORT __attribute__((visibility("default")))
+#else
+#define AZDCAP_EXPORT
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Logging macros. Messages more verbose than AZDCAP_COMPILE_LOG_LEVEL are
+// removed by the preprocessor, arguments included. The remaining levels only
+// evaluate their arguments when the level is enabled at runtime.
+///////////////////////////////////////////////////////////////////////////////
+#define AZDCAP_LOG_LEVEL_ERROR 0
+#define AZDCAP_LOG_LEVEL_WARNING 1
+#define AZDCAP_LOG_LEVEL_INFO 2
+
+#ifndef AZDCAP_COMPILE_LOG_LEVEL
+#define AZDCAP_COMPILE_LOG_LEVEL AZDCAP_LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT_LEVEL(level, ...)                                         \
+    do                                                                   \
+    {                                                                    \
+        static log_call_site call_site;                                  \
+        if (log_level_enabled(level) &&                                  \
+            log_call_site_allow(call_site, level, __FILE__, __LINE__))   \
+        {                                                                \
+            log(level, __VA_ARGS__);                                     \
+        }                                                                \
+    } while (false)
+
+#define LOG_ERROR(...) LOG_AT_LEVEL(SGX_QL_LOG_ERROR, __VA_ARGS__)
+
+#if AZDCAP_COMPILE_LOG_LEVEL >= AZDCAP_LOG_LEVEL_WARNING
+#define LOG_WARNING(...) LOG_AT_LEVEL(SGX_QL_LOG_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) do {} while (false)
+#endif
+
+#if AZDCAP_COMPILE_LOG_LEVEL >= AZDCAP_LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT_LEVEL(SGX_QL_LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (false)
+#endif
 #endif
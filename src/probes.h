@@ -0,0 +1,47 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef PROBES_H
+#define PROBES_H
+
+//
+// USDT (SystemTap/bpftrace) static probes under the az_dcap_client provider.
+// They are compiled in when <sys/sdt.h> is available (systemtap-sdt-dev) and
+// compiled out otherwise. A probe with nothing attached costs a single nop;
+// its arguments are always evaluated, so keep them cheap.
+//
+#if defined(__LINUX__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AZDCAP_USDT_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef AZDCAP_USDT_PROBES_ENABLED
+#define AZDCAP_PROBE1(name, a) DTRACE_PROBE1(az_dcap_client, name, a)
+#define AZDCAP_PROBE2(name, a, b) DTRACE_PROBE2(az_dcap_client, name, a, b)
+#define AZDCAP_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3(az_dcap_client, name, a, b, c)
+#else
+#define AZDCAP_PROBE1(name, a) \
+    do                         \
+    {                          \
+        (void)(a);             \
+    } while (false)
+#define AZDCAP_PROBE2(name, a, b) \
+    do                            \
+    {                             \
+        (void)(a);                \
+        (void)(b);                \
+    } while (false)
+#define AZDCAP_PROBE3(name, a, b, c) \
+    do                               \
+    {                                \
+        (void)(a);                   \
+        (void)(b);                   \
+        (void)(c);                   \
+    } while (false)
+#endif
+
+#endif
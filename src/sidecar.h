@@ -0,0 +1,108 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+//
+// Node-local collateral sidecar, see Linux/sidecar_daemon.cpp. The daemon
+// fetches from the service on behalf of every process on the node, so that
+// the upstream traffic grows with the number of nodes rather than processes.
+// When its socket exists (AZDCAP_SIDECAR_SOCKET, or SIDECAR_DEFAULT_SOCKET)
+// the library sends its cache misses there instead of to the network, and
+// falls back to fetching in process if the daemon cannot answer.
+//
+// Both ends are on the same node, so the protocol uses host byte order. A
+// frame is a sidecar_frame_header followed by 'size' bytes of payload, made
+// of fixed size integers and u32 length prefixed strings:
+//
+//   request:  u64 id, i64 max age, url, request body,
+//             header count, (name, value)*
+//   response: u64 id, i32 curl code, i32 http status, u8 cache hit,
+//             header count, (name, value)*, body
+//
+// One connection carries any number of request/response pairs in turn. The
+// response echoes the id of its request, which the client checks so that it
+// can never be handed the answer to another request.
+//
+// The daemon only fetches URLs under the configured service base URL, and
+// its socket is only open to its group (see --group), so it is not a way
+// for local users to reach anything else.
+//
+
+#define SIDECAR_DEFAULT_SOCKET "/run/az-dcap-client/sidecar.sock"
+
+constexpr uint32_t SIDECAR_MAGIC = 0x43534441; // "ADSC"
+constexpr uint16_t SIDECAR_VERSION = 2;
+constexpr uint32_t SIDECAR_MAX_FRAME = 64 * 1024 * 1024;
+
+enum class sidecar_frame_type : uint16_t
+{
+    fetch_request = 1,
+    fetch_response = 2,
+};
+
+#pragma pack(push, 1)
+struct sidecar_frame_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t size;
+};
+#pragma pack(pop)
+
+struct sidecar_request
+{
+    uint64_t id = 0;
+    int64_t max_age = 0; // seconds the caller caches the response, 0 for not at all
+    std::string url;
+    std::string body;
+    std::map<std::string, std::string> headers;
+};
+
+struct sidecar_response
+{
+    uint64_t id = 0; // of the request
+    int32_t curl_code = 0;
+    int32_t http_status = 0;
+    bool cache_hit = false; // answered from the daemon's cache
+    std::map<std::string, std::string> headers;
+    std::vector<uint8_t> body;
+};
+
+//
+// Frame I/O on a connected socket. Each returns false on a closed connection,
+// an I/O error or a malformed frame.
+//
+bool sidecar_write_request(int fd, const sidecar_request& request);
+bool sidecar_read_request(int fd, sidecar_request& request);
+bool sidecar_write_response(int fd, const sidecar_response& response);
+bool sidecar_read_response(int fd, sidecar_response& response);
+
+//
+// The socket path the library looks for. The environment is read on first
+// use only.
+//
+const std::string& sidecar_socket_path();
+
+//
+// Fetch through the sidecar. Returns false without side effects if no
+// sidecar is listening or it failed to answer, in which case the caller
+// fetches the request itself. Only a socket owned by root or the current
+// user is used. request.id is filled in.
+//
+bool sidecar_fetch(sidecar_request request, sidecar_response& response);
+
+//
+// Stops this process from using the sidecar, for the daemon itself.
+//
+void sidecar_client_disable();
+
+#endif
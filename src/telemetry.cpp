@@ -0,0 +1,490 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "telemetry.h"
+#include "dcap_provider.h"
+#include "metrics_exporter.h"
+#include "private.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <forward_list>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <utility>
+
+using namespace std;
+
+static thread_local request_scope* current_scope = nullptr;
+
+//
+// The registered callbacks, published as one pointer so that a span always
+// sees a begin and end function registered together. Pairs are never freed,
+// as a span may still be reading the one it loaded after it is replaced;
+// registering the same pair again reuses it.
+//
+struct trace_functions
+{
+    sgx_ql_trace_begin_function_t begin;
+    sgx_ql_trace_end_function_t end;
+};
+
+static atomic<const trace_functions*> current_trace_functions(nullptr);
+static mutex trace_functions_lock;
+static forward_list<trace_functions> registered_trace_functions;
+static atomic<uint64_t> next_span_id(1);
+static thread_local uint64_t current_span_id = 0;
+
+static constexpr uint64_t bucket_upper_bounds_us[SGX_QL_FETCH_HISTOGRAM_BUCKETS] = {
+    100,
+    250,
+    500,
+    1000,
+    2500,
+    5000,
+    10000,
+    25000,
+    50000,
+    100000,
+    250000,
+    500000,
+    1000000,
+    2500000,
+    5000000,
+    10000000,
+    UINT64_MAX};
+
+// Bounds memory use if the base URL keeps changing; endpoints seen after the
+// limit is reached are all counted under OVERFLOW_ENDPOINT.
+static constexpr size_t MAX_ENDPOINTS = 64;
+static const char OVERFLOW_ENDPOINT[] = "other";
+
+struct endpoint_stats
+{
+    uint64_t fetch_count = 0;
+    uint64_t failure_count = 0;
+    uint64_t reused_connection_count = 0;
+    uint64_t bytes_downloaded = 0;
+    sgx_ql_fetch_histogram_t phases[SGX_QL_FETCH_PHASE_COUNT] = {};
+};
+
+// Keyed by (host, collateral)
+typedef map<pair<string, string>, endpoint_stats> endpoint_stats_map;
+
+// Also guards the process-wide counters
+static mutex endpoint_stats_mutex;
+static endpoint_stats_map endpoint_stats_by_key;
+static telemetry_counters counters;
+
+static const char* const collateral_names[] = {
+    "tcb_info",
+    "qe_identity",
+    "qve_identity",
+    "pck_cert",
+    "pck_crl",
+    "root_ca_crl",
+    "unknown"};
+static_assert(
+    sizeof(collateral_names) / sizeof(collateral_names[0]) ==
+        static_cast<size_t>(telemetry_collateral::count),
+    "A name is needed for each kind of collateral");
+
+static const char* const source_names[] = {"hit", "miss", "uncached"};
+static_assert(
+    sizeof(source_names) / sizeof(source_names[0]) ==
+        static_cast<size_t>(telemetry_source::count),
+    "A name is needed for each source");
+
+// Counted on every lookup, so kept apart from 'counters' and its lock, and
+// turned into telemetry_counters::collateral_lookups by
+// telemetry_get_counters.
+static atomic<uint64_t> collateral_lookups
+    [static_cast<size_t>(telemetry_collateral::count)]
+    [static_cast<size_t>(telemetry_source::count)];
+
+static int64_t microseconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration_cast<chrono::microseconds>(
+               chrono::steady_clock::now() - start)
+        .count();
+}
+
+//
+// Random (version 4 style) UUID, formatted with dashes.
+//
+static string generate_request_id()
+{
+    static thread_local mt19937_64 generator(random_device{}());
+    const uint64_t high = generator();
+    const uint64_t low = generator();
+
+    char id[37];
+    snprintf(
+        id,
+        sizeof(id),
+        "%08x-%04x-4%03x-%04x-%012llx",
+        static_cast<unsigned>(high >> 32),
+        static_cast<unsigned>((high >> 16) & 0xffff),
+        static_cast<unsigned>(high & 0x0fff),
+        static_cast<unsigned>(((low >> 48) & 0x3fff) | 0x8000),
+        static_cast<unsigned long long>(low & 0xffffffffffffULL));
+    return id;
+}
+
+static void append_list_item(string& list, const string& item)
+{
+    if (!list.empty())
+    {
+        list += ',';
+    }
+    list += item;
+}
+
+trace_span::trace_span(
+    const char* name,
+    initializer_list<sgx_ql_trace_attribute_t> attributes)
+{
+    const trace_functions* functions =
+        current_trace_functions.load(memory_order_acquire);
+    if (functions == nullptr)
+    {
+        return;
+    }
+
+    end_function = functions->end;
+    id = next_span_id.fetch_add(1, memory_order_relaxed);
+    parent_id = current_span_id;
+    current_span_id = id;
+
+    functions->begin(
+        id,
+        parent_id,
+        name,
+        attributes.begin(),
+        static_cast<uint32_t>(attributes.size()));
+}
+
+trace_span::~trace_span()
+{
+    if (end_function == nullptr)
+    {
+        return;
+    }
+
+    current_span_id = parent_id;
+
+    vector<sgx_ql_trace_attribute_t> attributes;
+    attributes.reserve(end_attributes.size());
+    for (const auto& attribute : end_attributes)
+    {
+        attributes.push_back({attribute.first, attribute.second.c_str()});
+    }
+
+    end_function(
+        id, attributes.data(), static_cast<uint32_t>(attributes.size()));
+}
+
+void trace_span::set_end_attribute(const char* key, string value)
+{
+    if (active())
+    {
+        end_attributes.emplace_back(key, move(value));
+    }
+}
+
+void set_trace_functions(
+    sgx_ql_trace_begin_function_t begin,
+    sgx_ql_trace_end_function_t end)
+{
+    // Spans already open keep the end callback they began with
+    if (begin == nullptr)
+    {
+        current_trace_functions.store(nullptr, memory_order_release);
+        return;
+    }
+
+    lock_guard<mutex> lock(trace_functions_lock);
+    auto functions = find_if(
+        registered_trace_functions.begin(),
+        registered_trace_functions.end(),
+        [&](const trace_functions& registered) {
+            return registered.begin == begin && registered.end == end;
+        });
+    if (functions == registered_trace_functions.end())
+    {
+        registered_trace_functions.push_front({begin, end});
+        functions = registered_trace_functions.begin();
+    }
+    current_trace_functions.store(&*functions, memory_order_release);
+}
+
+request_scope::request_scope(const char* api_name)
+    : api_name(api_name),
+      request_id(generate_request_id()),
+      start(chrono::steady_clock::now()),
+      previous(current_scope),
+      span(api_name, {{"dcap.request_id", request_id.c_str()}})
+{
+    current_scope = this;
+
+#ifdef __LINUX__
+    metrics_exporter_start();
+#endif
+}
+
+request_scope::~request_scope()
+{
+    current_scope = previous;
+
+    if (span.active())
+    {
+        char result_text[16];
+        snprintf(result_text, sizeof(result_text), "0x%x", result);
+        span.set_end_attribute("dcap.result", result_text);
+    }
+
+    // Bypasses the per call site rate limit on purpose: this is the one line
+    // per call used to correlate with service-side logs.
+    if (!log_level_enabled(SGX_QL_LOG_INFO))
+    {
+        return;
+    }
+
+    const int64_t total_us = microseconds_since(start);
+    int64_t assembly_us = total_us - cache_lookup_us - fetch_totals.total;
+    if (assembly_us < 0)
+    {
+        assembly_us = 0;
+    }
+
+    log(SGX_QL_LOG_INFO,
+        "api=%s request_id=%s result=0x%x total_us=%lld "
+        "cache_lookup_us=%lld dns_us=%lld connect_us=%lld tls_us=%lld "
+        "ttfb_us=%lld transfer_us=%lld assembly_us=%lld fetches=%u "
+        "collateral=%s service_request_ids=%s",
+        api_name,
+        request_id.c_str(),
+        result,
+        static_cast<long long>(total_us),
+        static_cast<long long>(cache_lookup_us),
+        static_cast<long long>(fetch_totals.name_lookup),
+        static_cast<long long>(fetch_totals.connect),
+        static_cast<long long>(fetch_totals.tls_handshake),
+        static_cast<long long>(fetch_totals.time_to_first_byte),
+        static_cast<long long>(fetch_totals.transfer),
+        static_cast<long long>(assembly_us),
+        fetch_count,
+        collateral.empty() ? "-" : collateral.c_str(),
+        service_request_ids.empty() ? "-" : service_request_ids.c_str());
+}
+
+const string& current_request_id()
+{
+    static const string no_request_id;
+    return current_scope == nullptr ? no_request_id : current_scope->request_id;
+}
+
+void telemetry_record_cache_lookup(int64_t duration_us)
+{
+    if (current_scope != nullptr)
+    {
+        current_scope->cache_lookup_us += duration_us;
+    }
+}
+
+const char* telemetry_collateral_name(telemetry_collateral collateral)
+{
+    return collateral_names[static_cast<size_t>(collateral)];
+}
+
+void telemetry_record_collateral(
+    telemetry_collateral collateral,
+    telemetry_source source)
+{
+    collateral_lookups[static_cast<size_t>(collateral)]
+                      [static_cast<size_t>(source)]
+                          .fetch_add(1, memory_order_relaxed);
+
+    if (current_scope != nullptr)
+    {
+        append_list_item(
+            current_scope->collateral,
+            string(telemetry_collateral_name(collateral)) + ':' +
+                source_names[static_cast<size_t>(source)]);
+    }
+}
+
+static void add_sample(sgx_ql_fetch_histogram_t& histogram, int64_t value_us)
+{
+    const uint64_t value = value_us > 0 ? static_cast<uint64_t>(value_us) : 0;
+    const uint64_t* bucket = lower_bound(
+        begin(bucket_upper_bounds_us), end(bucket_upper_bounds_us), value);
+    ++histogram.buckets[bucket - begin(bucket_upper_bounds_us)];
+    ++histogram.count;
+    histogram.sum_us += value;
+    histogram.max_us = max(histogram.max_us, value);
+}
+
+static void record_endpoint_fetch(
+    const string& host,
+    const char* collateral,
+    int error_code,
+    const fetch_timings& timings)
+{
+    lock_guard<mutex> lock(endpoint_stats_mutex);
+
+    if (error_code != 0)
+    {
+        ++counters.fetch_errors[make_pair(error_code, timings.http_status)];
+    }
+
+    auto key = make_pair(host, string(collateral));
+    if (endpoint_stats_by_key.size() >= MAX_ENDPOINTS &&
+        endpoint_stats_by_key.find(key) == endpoint_stats_by_key.end())
+    {
+        key = make_pair(string(OVERFLOW_ENDPOINT), string(OVERFLOW_ENDPOINT));
+    }
+
+    endpoint_stats& stats = endpoint_stats_by_key[key];
+    ++stats.fetch_count;
+    if (error_code != 0)
+    {
+        ++stats.failure_count;
+    }
+    if (timings.connection_reused)
+    {
+        ++stats.reused_connection_count;
+    }
+    stats.bytes_downloaded += timings.bytes_downloaded;
+
+    add_sample(stats.phases[SGX_QL_FETCH_PHASE_NAME_LOOKUP], timings.name_lookup);
+    add_sample(stats.phases[SGX_QL_FETCH_PHASE_CONNECT], timings.connect);
+    add_sample(
+        stats.phases[SGX_QL_FETCH_PHASE_TLS_HANDSHAKE], timings.tls_handshake);
+    add_sample(
+        stats.phases[SGX_QL_FETCH_PHASE_TIME_TO_FIRST_BYTE],
+        timings.time_to_first_byte);
+    add_sample(stats.phases[SGX_QL_FETCH_PHASE_TRANSFER], timings.transfer);
+    add_sample(stats.phases[SGX_QL_FETCH_PHASE_TOTAL], timings.total);
+}
+
+void telemetry_record_fetch(
+    const string& host,
+    const char* collateral,
+    int error_code,
+    const fetch_timings& timings,
+    const string* service_request_id)
+{
+    record_endpoint_fetch(host, collateral, error_code, timings);
+
+    if (current_scope == nullptr)
+    {
+        return;
+    }
+
+    fetch_timings& totals = current_scope->fetch_totals;
+    totals.name_lookup += timings.name_lookup;
+    totals.connect += timings.connect;
+    totals.tls_handshake += timings.tls_handshake;
+    totals.time_to_first_byte += timings.time_to_first_byte;
+    totals.transfer += timings.transfer;
+    totals.total += timings.total;
+    ++current_scope->fetch_count;
+
+    if (service_request_id != nullptr && !service_request_id->empty())
+    {
+        append_list_item(
+            current_scope->service_request_ids, *service_request_id);
+    }
+}
+
+sgx_ql_fetch_stats_t* telemetry_get_fetch_stats()
+{
+    lock_guard<mutex> lock(endpoint_stats_mutex);
+
+    // Header, then the endpoint array, then the host and collateral strings
+    size_t buffer_size = sizeof(sgx_ql_fetch_stats_t) +
+                         endpoint_stats_by_key.size() *
+                             sizeof(sgx_ql_endpoint_fetch_stats_t);
+    for (const auto& entry : endpoint_stats_by_key)
+    {
+        buffer_size += entry.first.first.size() + 1;
+        buffer_size += entry.first.second.size() + 1;
+    }
+
+    uint8_t* buffer = new (nothrow) uint8_t[buffer_size];
+    if (buffer == nullptr)
+    {
+        return nullptr;
+    }
+    memset(buffer, 0, buffer_size);
+
+    auto stats = reinterpret_cast<sgx_ql_fetch_stats_t*>(buffer);
+    auto endpoints = reinterpret_cast<sgx_ql_endpoint_fetch_stats_t*>(
+        buffer + sizeof(sgx_ql_fetch_stats_t));
+    char* strings = reinterpret_cast<char*>(
+        endpoints + endpoint_stats_by_key.size());
+
+    memcpy(
+        stats->bucket_upper_bounds_us,
+        bucket_upper_bounds_us,
+        sizeof(bucket_upper_bounds_us));
+    stats->endpoint_count = static_cast<uint32_t>(endpoint_stats_by_key.size());
+    stats->endpoints = endpoints;
+
+    for (const auto& entry : endpoint_stats_by_key)
+    {
+        sgx_ql_endpoint_fetch_stats_t& endpoint = *endpoints++;
+
+        memcpy(strings, entry.first.first.c_str(), entry.first.first.size() + 1);
+        endpoint.host = strings;
+        strings += entry.first.first.size() + 1;
+
+        memcpy(
+            strings, entry.first.second.c_str(), entry.first.second.size() + 1);
+        endpoint.collateral = strings;
+        strings += entry.first.second.size() + 1;
+
+        const endpoint_stats& source = entry.second;
+        endpoint.fetch_count = source.fetch_count;
+        endpoint.failure_count = source.failure_count;
+        endpoint.reused_connection_count = source.reused_connection_count;
+        endpoint.bytes_downloaded = source.bytes_downloaded;
+        memcpy(endpoint.phases, source.phases, sizeof(endpoint.phases));
+    }
+
+    return stats;
+}
+
+telemetry_counters telemetry_get_counters()
+{
+    telemetry_counters snapshot;
+    {
+        lock_guard<mutex> lock(endpoint_stats_mutex);
+        snapshot = counters;
+    }
+
+    for (size_t collateral = 0;
+         collateral < static_cast<size_t>(telemetry_collateral::count);
+         collateral++)
+    {
+        for (size_t source = 0;
+             source < static_cast<size_t>(telemetry_source::count);
+             source++)
+        {
+            const uint64_t count =
+                collateral_lookups[collateral][source].load(memory_order_relaxed);
+            if (count != 0)
+            {
+                snapshot.collateral_lookups[make_pair(
+                    string(collateral_names[collateral]),
+                    string(source_names[source]))] = count;
+            }
+        }
+    }
+    return snapshot;
+}
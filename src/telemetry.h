@@ -0,0 +1,220 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dcap_provider.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-call telemetry. Each exported API call opens a request_scope; the
+// helpers below attribute cache lookups and fetches to the scope active on
+// the calling thread, and are no-ops when there is none.
+///////////////////////////////////////////////////////////////////////////////
+
+//
+// Durations of the phases of one HTTP transfer, in microseconds, and what
+// came back.
+//
+struct fetch_timings
+{
+    int64_t name_lookup = 0;
+    int64_t connect = 0;
+    int64_t tls_handshake = 0;
+    int64_t time_to_first_byte = 0;
+    int64_t transfer = 0;
+    int64_t total = 0;
+
+    uint64_t bytes_downloaded = 0;
+    bool connection_reused = false;
+    long http_status = 0; // 0 if no response was received
+};
+
+//
+// RAII span reported to the trace callbacks registered with
+// sgx_ql_set_trace_function, if any. Spans nest per thread: the span active
+// when another begins is its parent. Costs a single atomic load when no
+// callbacks are registered.
+//
+class trace_span
+{
+  public:
+    explicit trace_span(
+        const char* name,
+        std::initializer_list<sgx_ql_trace_attribute_t> attributes = {});
+    ~trace_span();
+
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    // Whether the span is being reported, to skip formatting attributes.
+    bool active() const
+    {
+        return end_function != nullptr;
+    }
+
+    // Add an attribute reported when the span ends.
+    void set_end_attribute(const char* key, std::string value);
+
+  private:
+    uint64_t id = 0;
+    uint64_t parent_id = 0;
+    sgx_ql_trace_end_function_t end_function = nullptr;
+    std::vector<std::pair<const char*, std::string>> end_attributes;
+};
+
+//
+// Replace the trace callbacks. Both null disables tracing.
+//
+void set_trace_functions(
+    sgx_ql_trace_begin_function_t begin,
+    sgx_ql_trace_end_function_t end);
+
+//
+// Kinds of collateral, as counted by telemetry_record_collateral.
+//
+enum class telemetry_collateral
+{
+    tcb_info,
+    qe_identity,
+    qve_identity,
+    pck_cert,
+    pck_crl,
+    root_ca_crl,
+    unknown,
+    count
+};
+
+//
+// How a piece of collateral was obtained: "hit" or "miss" when the cache was
+// consulted, "uncached" for collateral that is always fetched.
+//
+enum class telemetry_source
+{
+    hit,
+    miss,
+    uncached,
+    count
+};
+
+//
+// Short identifier of a collateral kind, e.g. "tcb_info", used in logs and
+// metrics.
+//
+const char* telemetry_collateral_name(telemetry_collateral collateral);
+
+//
+// RAII scope for one exported API call. Generates the request ID sent with
+// every fetch made by the call, and when the scope ends logs a single
+// key=value line with the collateral touched, the time spent in each phase,
+// and the result code. The call is also reported as a trace span.
+//
+class request_scope
+{
+  public:
+    explicit request_scope(const char* api_name);
+    ~request_scope();
+
+    request_scope(const request_scope&) = delete;
+    request_scope& operator=(const request_scope&) = delete;
+
+    // Records the result returned to the caller and passes it through.
+    template <typename T>
+    T complete(T result)
+    {
+        this->result = static_cast<int>(result);
+        return result;
+    }
+
+  private:
+    friend const std::string& current_request_id();
+    friend void telemetry_record_cache_lookup(int64_t duration_us);
+    friend void telemetry_record_collateral(
+        telemetry_collateral collateral,
+        telemetry_source source);
+    friend void telemetry_record_fetch(
+        const std::string& host,
+        const char* collateral,
+        int error_code,
+        const fetch_timings& timings,
+        const std::string* service_request_id);
+
+    const char* api_name;
+    std::string request_id;
+    std::chrono::steady_clock::time_point start;
+    request_scope* previous;
+    trace_span span;
+
+    std::string collateral;
+    std::string service_request_ids;
+    unsigned fetch_count = 0;
+    int64_t cache_lookup_us = 0;
+    fetch_timings fetch_totals;
+    int result = 0;
+};
+
+//
+// The request ID of the API call in progress on this thread, or an empty
+// string outside of one.
+//
+const std::string& current_request_id();
+
+//
+// Time spent reading the local cache, hit or miss.
+//
+void telemetry_record_cache_lookup(int64_t duration_us);
+
+//
+// How a piece of collateral was obtained. Counted without taking a lock.
+//
+void telemetry_record_collateral(
+    telemetry_collateral collateral,
+    telemetry_source source);
+
+//
+// One completed or failed fetch of 'collateral' from 'host'. Added to the
+// per-endpoint histograms, and to the API call in progress if any.
+// 'error_code' is 0 for a successful fetch, otherwise the CURLcode (WinHTTP
+// error on Windows) it failed with, or -1 if it failed some other way.
+// 'service_request_id' is the Request-ID response header, if the service sent
+// one.
+//
+void telemetry_record_fetch(
+    const std::string& host,
+    const char* collateral,
+    int error_code,
+    const fetch_timings& timings,
+    const std::string* service_request_id);
+
+//
+// Snapshot of the per-endpoint fetch histograms, in a single allocation to
+// be released with sgx_ql_free_fetch_stats. Returns nullptr when out of
+// memory.
+//
+struct _sgx_ql_fetch_stats_t* telemetry_get_fetch_stats();
+
+//
+// Process-wide counters, for the metrics exporter.
+//
+struct telemetry_counters
+{
+    // Keyed by the names of the (collateral, source) pairs passed to
+    // telemetry_record_collateral, for those counted at least once
+    std::map<std::pair<std::string, std::string>, uint64_t> collateral_lookups;
+
+    // Failed fetches, keyed by (error code, HTTP status)
+    std::map<std::pair<int, long>, uint64_t> fetch_errors;
+};
+
+telemetry_counters telemetry_get_counters();
+
+#endif